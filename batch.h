@@ -0,0 +1,313 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <omp.h>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+#include "parser.h"
+#include "csrmatrix.h"
+#include "bench.h"
+#include "csv.h"
+#include "alloc.h"
+#include "export.h"
+#include "trace.h"
+
+using namespace std;
+typedef unsigned int uint;
+
+// One manifest line: a graph and the parameter sets to solve it with.
+// Graph is an edge list (plain, gzip, zstd), a csv written by save, or a snapshot.
+struct BatchJob{
+    string name;
+    string graph;
+    vector<double> alphas = {0.2};
+    double epsillon = 1e-6;
+};
+
+// One solve of a job
+struct BatchResult{
+    uint job = 0;
+    double alpha = 0;
+    int iterations = 0;
+    double load_time = 0, solve_time = 0;
+    bool ok = false;
+    vector<string> names;
+    vector<double> scores;
+};
+
+// Manifest has one job per line as key=value pairs, # starts a comment:
+//   graph=tr.txt.gz [name=tr] [alpha=0.2,0.15,0.1] [epsillon=1e-6]
+inline bool read_manifest(const string &filename, vector<BatchJob> &jobs){
+    ifstream in(filename);
+    string line, token;
+    if(!in.good()){
+        return false;
+    }
+    while(getline(in, line)){
+        line = line.substr(0, line.find('#'));
+        istringstream tokens(line);
+        BatchJob job;
+        bool any = false;
+        while(tokens >> token){
+            size_t eq = token.find('=');
+            string key = token.substr(0, eq), value = eq==string::npos ? "" : token.substr(eq+1);
+            any = true;
+            if(key=="graph"){
+                job.graph = value;
+            }else if(key=="name"){
+                job.name = value;
+            }else if(key=="alpha" || key=="epsillon"){
+                try{
+                    if(key=="alpha"){
+                        job.alphas.clear();
+                        for(const string &a : string_to_svector(value, ",")){
+                            job.alphas.push_back(stod(a));
+                        }
+                    }else{
+                        job.epsillon = stod(value);
+                    }
+                }catch(const logic_error &){
+                    cout << "Bad value in manifest: " << token << endl;
+                    return false;
+                }
+            }else{
+                cout << "Unknown manifest option: " << token << endl;
+            }
+        }
+        if(!any){
+            continue;
+        }
+        if(job.graph.empty() || job.alphas.empty()){
+            cout << "Manifest line without graph or alpha: " << line << endl;
+            return false;
+        }
+        if(job.name.empty()){
+            job.name = job.graph;
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+struct BatchOptions{
+    // Concurrent groups for small graphs, each on its own share of the cores
+    uint groups = 1;
+    // Graphs at least this large (file size) run one at a time on all cores
+    unsigned long long large_bytes = 64ULL<<20;
+    uint topk = 5;
+    string out = "batch.csv";
+    // Full rank vector of every job and alpha as <dir>/<name>_<alpha>.bin,
+    // and .csv sorted by score with export_csv, written in the background
+    string export_dir;
+    bool export_csv = false;
+};
+
+// Runs a manifest in one process. Large graphs run first, one at a time with all
+// cores. Small graphs are then taken in order by "groups" threads, each pinned to
+// a disjoint set of cores with its own OpenMP team. Every graph is loaded once
+// and solved for all of its alphas. Rank vectors of a group are reused across jobs.
+// All results go to one csv. Full vectors are exported on a background thread
+// while the next jobs run.
+class BatchRunner{
+    private:
+    BatchOptions opt;
+    const vector<BatchJob> &jobs;
+    vector<BatchResult> results;
+    mutex out_mtx;
+    unique_ptr<ResultWriter> writer;
+
+    // Export files of a job and alpha, / in names is replaced
+    ExportOptions export_files(const BatchJob &job, double alpha) const{
+        ExportOptions files;
+        if(opt.export_dir.empty()){
+            return files;
+        }
+        string base = job.name;
+        replace(base.begin(), base.end(), '/', '_');
+        base = opt.export_dir + "/" + base + "_" + number_to_string(alpha);
+        files.binary = base + ".bin";
+        if(opt.export_csv){
+            files.sorted_csv = base + ".csv";
+        }
+        return files;
+    }
+
+    static unsigned long long file_bytes(const string &filename){
+        struct stat st;
+        return stat(filename.c_str(), &st)==0 ? st.st_size : 0;
+    }
+
+    static CSR_Matrix<double> *load(const string &filename){
+        if(is_snapshot(filename) || (filename.size()>4 && filename.compare(filename.size()-4, 4, ".csv")==0)){
+            if(!ifstream(filename).good()){
+                return NULL;
+            }
+            CSR_Matrix<double> *P = new CSR_Matrix<double>(filename);
+            if(!P->loaded){
+                delete P;
+                return NULL;
+            }
+            return P;
+        }
+        return parse(filename);
+    }
+
+    // Load job k and solve it for every alpha, reusing r_t and r_t1
+    void run_job(uint k, page_vector<double> &r_t, page_vector<double> &r_t1){
+        const BatchJob &job = jobs[k];
+        TraceScope load_phase("load");
+        CSR_Matrix<double> *P = load(job.graph);
+        double load_time = load_phase.stop();
+        vector<BatchResult> done;
+        // Shared with the exports, which may still be written after P is deleted
+        shared_ptr<const vector<string>> names;
+        if(P!=NULL){
+            names = make_shared<const vector<string>>(move(P->arr_dict));
+        }
+        for(double alpha : job.alphas){
+            BatchResult res;
+            res.job = k;
+            res.alpha = alpha;
+            res.load_time = load_time;
+            if(P!=NULL){
+                uint n = P->get_size().second;
+                r_t1.assign(n, 1);
+                TraceScope solve_phase("solve");
+                do{
+                    r_t.swap(r_t1);
+                    P->ops(r_t, alpha, 1-alpha, r_t1);
+                    res.iterations++;
+                } while(P->two_vec_diff > job.epsillon);
+                res.solve_time = solve_phase.stop();
+                for(uint i : top_k(r_t, opt.topk)){
+                    res.names.push_back((*names)[i]);
+                    res.scores.push_back(r_t[i]);
+                }
+                res.ok = true;
+                if(writer!=NULL){
+                    writer->submit(export_files(job, alpha), names, r_t);
+                }
+            }
+            done.push_back(res);
+        }
+        delete P;
+
+        lock_guard<mutex> lock(out_mtx);
+        for(BatchResult &res : done){
+            if(res.ok){
+                cout << "Job " << job.name << " alpha " << res.alpha << ": " << res.iterations << " iterations in "
+                     << res.solve_time << " s on " << omp_get_max_threads() << " thread(s)" << endl;
+            }else{
+                cout << "Job " << job.name << " failed, cannot load " << job.graph << endl;
+            }
+            results.push_back(res);
+        }
+    }
+
+    public:
+    BatchRunner(const vector<BatchJob> &jobs, const BatchOptions &opt) : opt(opt), jobs(jobs){
+        if(!opt.export_dir.empty()){
+            // Parent directories must exist, the last one is created
+            mkdir(opt.export_dir.c_str(), 0755);
+            writer.reset(new ResultWriter());
+        }
+    }
+
+    // Returns false without running any job if the export directory is not writable
+    bool run(){
+        if(writer!=NULL && access(opt.export_dir.c_str(), W_OK|X_OK)!=0){
+            cout << "Cannot write to export directory: " << opt.export_dir << endl;
+            return false;
+        }
+        vector<uint> large, small;
+        for(uint k=0; k<jobs.size(); k++){
+            (file_bytes(jobs[k].graph)>=opt.large_bytes ? large : small).push_back(k);
+        }
+
+        page_vector<double> r_t, r_t1;
+        for(uint k : large){
+            run_job(k, r_t, r_t1);
+        }
+
+        // Cores of this process, split into contiguous groups
+        cpu_set_t all;
+        vector<int> cpus;
+        CPU_ZERO(&all);
+        if(sched_getaffinity(0, sizeof(all), &all)==0){
+            for(int c=0; c<CPU_SETSIZE; c++){
+                if(CPU_ISSET(c, &all)){
+                    cpus.push_back(c);
+                }
+            }
+        }
+        uint groups = max(1u, min<uint>(opt.groups, min<size_t>(small.size(), max<size_t>(cpus.size(), 1))));
+        atomic<uint> next{0};
+        vector<thread> workers;
+        for(uint g=0; g<groups; g++){
+            workers.push_back(thread([&, g]{
+                uint first = cpus.size()*g/groups, last = cpus.size()*(g+1)/groups;
+                if(groups>1 && first<last){
+                    cpu_set_t set;
+                    CPU_ZERO(&set);
+                    for(uint c=first; c<last; c++){
+                        CPU_SET(cpus[c], &set);
+                    }
+                    // OpenMP threads started from this thread inherit the mask
+                    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+                }
+                omp_set_num_threads(max(1u, last-first));
+                page_vector<double> g_t, g_t1;
+                uint k;
+                while((k = next++)<small.size()){
+                    run_job(small[k], g_t, g_t1);
+                }
+            }));
+        }
+        for(thread &w : workers){
+            w.join();
+        }
+        if(writer!=NULL && !writer->flush()){
+            cout << "Some rank vectors could not be exported" << endl;
+        }
+        return true;
+    }
+
+    // One row per job, alpha and top node, in manifest order
+    bool write() const{
+        vector<BatchResult> sorted = results;
+        stable_sort(sorted.begin(), sorted.end(), [](const BatchResult &a, const BatchResult &b){
+            return a.job<b.job;
+        });
+        vector<vector<string>> rows;
+        bool ok = true;
+        for(const BatchResult &res : sorted){
+            const BatchJob &job = jobs[res.job];
+            ok = ok && res.ok;
+            for(uint i=0; i<res.names.size(); i++){
+                rows.push_back(vector<string>({job.name, number_to_string(res.alpha), number_to_string(job.epsillon),
+                        to_string(res.iterations), number_to_string(res.load_time), number_to_string(res.solve_time),
+                        to_string(i+1), res.names[i], number_to_string(res.scores[i])}));
+            }
+        }
+        write_csv(opt.out, vector<string>({"name", "alpha", "epsillon", "iterations", "load_time", "solve_time",
+                                           "No.", "Nodes", "Scores"}), rows);
+        return ok;
+    }
+};
+
+#endif
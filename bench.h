@@ -0,0 +1,475 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <cmath>
+#include <unistd.h>
+#include <omp.h>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+#include "csrmatrix.h"
+#include "csv.h"
+#include "perfcount.h"
+#include "steal.h"
+
+using namespace std;
+typedef unsigned int uint;
+
+// Bump when columns or keys of bench output change
+#define BENCH_SCHEMA_VERSION 2
+
+// Benchmark parameter grid. Every schedule is run with every chunk size and
+// thread count. Options are given as key=value, either on command line or as
+// lines of a config file (# starts a comment). Lists are comma separated.
+struct BenchConfig{
+    // static, dynamic, guided, auto, nnz (nonzero balanced, ignores chunk size),
+    // or steal (work stealing pool, chunk is nonzeros taken at once)
+    vector<string> schedules = {"static", "dynamic", "guided", "auto", "nnz", "steal"};
+    vector<int> chunks = {1, 100, 10000, 1000000};
+    vector<int> threads = {1, 2, 3, 4, 5, 6, 7, 8};
+    // Matrix formats: csr, or sell (SELL-C-sigma, not run with nnz and steal schedules)
+    vector<string> formats = {"csr"};
+    int sell_sigma = 1024;
+    // Untimed solves before, and timed solves for each configuration
+    int warmup = 1;
+    int reps = 3;
+    int topk = 5;
+    double alpha = 0.2;
+    double epsillon = 1e-6;
+    string csv = "bench.csv";
+    string json = "bench.json";
+    // Per thread SpMV instrumentation (hardware counters if available)
+    bool perf = false;
+    // Run every solve in one parallel region (solver=persistent) instead of an ops call
+    // per iteration (solver=ops). Only for OpenMP schedules, not nnz and steal.
+    bool persistent = false;
+    string perf_csv = "bench_perf.csv";
+};
+
+// Set a single option. Returns false for an unknown key.
+inline bool bench_option(BenchConfig &cfg, const string &key, const string &value){
+    try{
+        if(key=="schedules"){
+            cfg.schedules = string_to_svector(value, ",");
+        }else if(key=="formats"){
+            cfg.formats = string_to_svector(value, ",");
+        }else if(key=="sell_sigma"){
+            cfg.sell_sigma = max(1, stoi(value));
+        }else if(key=="chunks" || key=="threads"){
+            vector<int> values;
+            for(const string &v : string_to_svector(value, ",")){
+                values.push_back(stoi(v));
+            }
+            (key=="chunks" ? cfg.chunks : cfg.threads) = values;
+        }else if(key=="warmup"){
+            cfg.warmup = stoi(value);
+        }else if(key=="reps"){
+            cfg.reps = max(1, stoi(value));
+        }else if(key=="topk"){
+            cfg.topk = stoi(value);
+        }else if(key=="alpha"){
+            cfg.alpha = stod(value);
+        }else if(key=="epsillon"){
+            cfg.epsillon = stod(value);
+        }else if(key=="csv"){
+            cfg.csv = value;
+        }else if(key=="json"){
+            cfg.json = value;
+        }else if(key=="perf"){
+            cfg.perf = stoi(value)!=0;
+        }else if(key=="perf_csv"){
+            cfg.perf_csv = value;
+        }else if(key=="solver"){
+            if(value!="ops" && value!="persistent"){
+                return false;
+            }
+            cfg.persistent = value=="persistent";
+        }else{
+            return false;
+        }
+    }catch(const logic_error &){
+        // Known key, value is not a number
+        cout << "Bad value: " << key << "=" << value << endl;
+    }
+    return true;
+}
+
+// Read key=value lines from a config file
+inline bool read_bench_config(const string &filename, BenchConfig &cfg){
+    ifstream in(filename);
+    string line;
+    if(!in.good()){
+        return false;
+    }
+    while(getline(in, line)){
+        line = line.substr(0, line.find('#'));
+        line.erase(remove_if(line.begin(), line.end(), ::isspace), line.end());
+        size_t eq = line.find('=');
+        if(eq==string::npos){
+            continue;
+        }
+        if(!bench_option(cfg, line.substr(0, eq), line.substr(eq+1))){
+            cout << "Unknown bench option: " << line << endl;
+        }
+    }
+    return true;
+}
+
+// OpenMP schedule of a schedule name. Returns false for an unknown name.
+inline bool schedule_kind(const string &name, omp_sched_t &kind){
+    if(name=="static" || name=="nnz" || name=="steal"){
+        kind = omp_sched_static;
+    }else if(name=="dynamic"){
+        kind = omp_sched_dynamic;
+    }else if(name=="guided"){
+        kind = omp_sched_guided;
+    }else if(name=="auto"){
+        kind = omp_sched_auto;
+    }else{
+        return false;
+    }
+    return true;
+}
+
+// Summary of repeated samples, in seconds
+struct BenchStats{
+    int count=0;
+    double median=0, p95=0, mean=0, stddev=0, min=0, max=0;
+};
+
+inline BenchStats summarize(vector<double> samples){
+    BenchStats st;
+    if(samples.empty()){
+        return st;
+    }
+    sort(samples.begin(), samples.end());
+    st.count = samples.size();
+    st.min = samples.front();
+    st.max = samples.back();
+    uint n = samples.size();
+    st.median = n%2 ? samples[n/2] : (samples[n/2-1]+samples[n/2])/2;
+    // Nearest rank percentile
+    st.p95 = samples[(uint)ceil(0.95*n)-1];
+    for(double v : samples){
+        st.mean += v;
+    }
+    st.mean /= n;
+    for(double v : samples){
+        st.stddev += (v-st.mean)*(v-st.mean);
+    }
+    st.stddev = n>1 ? sqrt(st.stddev/(n-1)) : 0;
+    return st;
+}
+
+// Indices of k largest elements, largest first. Single pass with a min heap of size k.
+template<typename A>
+inline vector<uint> top_k(const vector<double, A> &vec, uint k){
+    k = min<uint>(k, vec.size());
+    // Heap top is the smallest of current top k. Ties are broken by lower index.
+    auto greater_rank = [&vec](uint a, uint b){
+        return vec[a]>vec[b] || (vec[a]==vec[b] && a<b);
+    };
+    vector<uint> heap;
+    heap.reserve(k+1);
+    for(uint i=0; i<vec.size(); i++){
+        if(heap.size()<k){
+            heap.push_back(i);
+            push_heap(heap.begin(), heap.end(), greater_rank);
+        }else if(k>0 && greater_rank(i, heap.front())){
+            pop_heap(heap.begin(), heap.end(), greater_rank);
+            heap.back() = i;
+            push_heap(heap.begin(), heap.end(), greater_rank);
+        }
+    }
+    sort_heap(heap.begin(), heap.end(), greater_rank);
+    return heap;
+}
+
+// One timed row of benchmark output
+struct BenchRecord{
+    string phase;     // parse, build, load (once), solve, spmv, topk (per configuration)
+    string format;    // Empty for setup phases
+    string schedule;  // Empty for setup phases
+    int chunk=0, threads=0, iterations=0;
+    BenchStats stats;
+};
+
+// Per thread SpMV profile of one configuration, summed over timed solves
+struct BenchPerfRecord{
+    string format;
+    string schedule;
+    int chunk=0, threads=0;
+    double gbs=0;   // Modeled bytes per ops call / median spmv time
+    vector<SpmvThreadSample> samples;
+};
+
+class Benchmark{
+    private:
+    BenchConfig cfg;
+    vector<BenchRecord> records;
+    vector<BenchPerfRecord> perf_records;
+    page_vector<double> last_result;
+    SpmvProfile profile;
+    double stream_gbs=0;
+
+    // Bytes an ops call has to move at least: values, column indices and the
+    // gathered vector element per nonzero, row_begin, result and old vector per row.
+    static double spmv_bytes(CSR_Matrix<double> *P){
+        return (double)P->get_nnz()*(2*sizeof(double)+sizeof(uint))
+             + (double)P->get_size().first*(sizeof(uint)+2*sizeof(double));
+    }
+
+    // Solve once with current OpenMP settings, recording every ops call
+    int solve(CSR_Matrix<double> *P, vector<double> &spmv_times, double &solve_time){
+        page_vector<double> r_t, r_t1(P->get_size().second, 1);
+        int iterations=0;
+        double tim_st = omp_get_wtime(), t;
+        if(cfg.persistent && !P->nnz_balanced && P->stealer==NULL && P->sell==NULL){
+            iterations = P->solve_persistent(r_t1, cfg.alpha, 1-cfg.alpha, cfg.epsillon);
+            solve_time = omp_get_wtime()-tim_st;
+            // Iterations are not timed one by one, all get the mean
+            spmv_times.insert(spmv_times.end(), iterations, solve_time/iterations);
+            last_result.swap(r_t1);
+            return iterations;
+        }
+        do{
+            r_t.swap(r_t1);
+            t = omp_get_wtime();
+            r_t1 = P->ops(r_t, cfg.alpha, 1-cfg.alpha);
+            spmv_times.push_back(omp_get_wtime()-t);
+            iterations++;
+        } while(P->two_vec_diff > cfg.epsillon);
+        solve_time = omp_get_wtime()-tim_st;
+        last_result.swap(r_t);
+        return iterations;
+    }
+
+    // to_string keeps only 6 decimals, too few for per iteration timings
+    static string fmt(double v){
+        ostringstream out;
+        out.precision(9);
+        out << v;
+        return out.str();
+    }
+
+    public:
+    Benchmark(const BenchConfig &cfg) : cfg(cfg){}
+
+    // Record a phase that is measured once per process (parse, load...)
+    void add_setup(const string &phase, double seconds){
+        BenchRecord rec;
+        rec.phase = phase;
+        rec.stats = summarize({seconds});
+        records.push_back(rec);
+    }
+
+    void run(CSR_Matrix<double> *P){
+        if(cfg.perf){
+            stream_gbs = stream_triad_gbs();
+            cout << "STREAM triad baseline: " << stream_gbs << " GB/s" << endl;
+            P->profile = &profile;
+        }
+        for(const string &format : cfg.formats){
+            if(format=="sell"){
+                double t = omp_get_wtime();
+                P->use_sell(cfg.sell_sigma);
+                cout << "SELL-" << SELL_C << "-" << cfg.sell_sigma << " built in " << omp_get_wtime()-t << " s, "
+                     << P->sell->padding_ratio(P->get_nnz()) << " stored entries per nonzero" << endl;
+            }else if(format!="csr"){
+                cout << "Unknown format, skipped: " << format << endl;
+                continue;
+            }
+            for(const string &schedule : cfg.schedules){
+                omp_sched_t kind;
+                if(!schedule_kind(schedule, kind)){
+                    cout << "Unknown schedule, skipped: " << schedule << endl;
+                    continue;
+                }
+                P->nnz_balanced = (schedule=="nnz");
+                if(P->sell!=NULL && (P->nnz_balanced || schedule=="steal")){
+                    cout << "Schedule " << schedule << " is not run with sell format" << endl;
+                    continue;
+                }
+                for(uint c=0; c<cfg.chunks.size(); c++){
+                    // Chunk size has no effect on nonzero balanced split
+                    if(P->nnz_balanced && c>0){
+                        break;
+                    }
+                    for(int thread_num : cfg.threads){
+                        vector<double> solve_times, spmv_times, topk_times, unused;
+                        double solve_time;
+                        int iterations=0;
+                        omp_set_num_threads(thread_num);
+                        omp_set_schedule(kind, cfg.chunks[c]);
+                        // Pool lives for all solves of this configuration
+                        unique_ptr<StealExecutor> stealer;
+                        if(schedule=="steal"){
+                            stealer.reset(new StealExecutor(thread_num, cfg.chunks[c]));
+                        }
+                        P->stealer = stealer.get();
+                        cout << "Running benchmark with " << format << " : " << schedule << " : " << cfg.chunks[c] << " : " << thread_num << endl;
+                        for(int rep=0; rep<cfg.warmup+cfg.reps; rep++){
+                            bool timed = rep>=cfg.warmup;
+                            if(rep==cfg.warmup){
+                                profile.clear();
+                            }
+                            iterations = solve(P, timed ? spmv_times : unused, solve_time);
+                            double t = omp_get_wtime();
+                            top_k(last_result, cfg.topk);
+                            if(timed){
+                                topk_times.push_back(omp_get_wtime()-t);
+                                solve_times.push_back(solve_time);
+                            }
+                        }
+                        BenchRecord rec;
+                        rec.format = format;
+                        rec.schedule = schedule;
+                        rec.chunk = P->nnz_balanced ? 0 : cfg.chunks[c];
+                        rec.threads = thread_num;
+                        rec.iterations = iterations;
+                        rec.phase = "solve";
+                        rec.stats = summarize(solve_times);
+                        records.push_back(rec);
+                        rec.phase = "spmv";
+                        rec.stats = summarize(spmv_times);
+                        records.push_back(rec);
+                        rec.phase = "topk";
+                        rec.stats = summarize(topk_times);
+                        records.push_back(rec);
+                        cout << "Median: " << records[records.size()-3].stats.median
+                             << " p95: " << records[records.size()-3].stats.p95 << endl;
+                        if(cfg.perf){
+                            BenchPerfRecord prec;
+                            prec.format = format;
+                            prec.schedule = schedule;
+                            prec.chunk = rec.chunk;
+                            prec.threads = thread_num;
+                            prec.gbs = spmv_bytes(P)/records[records.size()-2].stats.median/1e9;
+                            prec.samples.assign(profile.threads.begin(), profile.threads.begin()+thread_num);
+                            perf_records.push_back(prec);
+                            cout << "SpMV: " << prec.gbs << " GB/s (" << 100*prec.gbs/stream_gbs << "% of STREAM)" << endl;
+                        }
+                        if(stealer){
+                            cout << "Steals: " << stealer->steals() << endl;
+                        }
+                        P->stealer = NULL;
+                    }
+                }
+            }
+            P->use_sell(0);
+        }
+        P->nnz_balanced = false;
+        P->profile = NULL;
+    }
+
+    // Rank vector of the last solve
+    const page_vector<double> &result() const{
+        return last_result;
+    }
+
+    // Long format: one row per phase and configuration, so columns stay stable
+    // when grid dimensions change.
+    void write_csv_file(const string &host) const{
+        vector<string> col_names({"schema", "host", "phase", "format", "schedule", "chunk", "threads", "iterations",
+                                  "count", "median", "p95", "mean", "stddev", "min", "max"});
+        vector<vector<string>> rows;
+        for(const BenchRecord &r : records){
+            rows.push_back(vector<string>({to_string(BENCH_SCHEMA_VERSION), host, r.phase, r.format, r.schedule,
+                    to_string(r.chunk), to_string(r.threads), to_string(r.iterations), to_string(r.stats.count),
+                    fmt(r.stats.median), fmt(r.stats.p95), fmt(r.stats.mean),
+                    fmt(r.stats.stddev), fmt(r.stats.min), fmt(r.stats.max)}));
+        }
+        write_csv(cfg.csv, col_names, rows);
+    }
+
+    // One row per thread and configuration. Counters are -1 if unavailable.
+    void write_perf_csv_file(const string &host) const{
+        vector<string> col_names({"schema", "host", "format", "schedule", "chunk", "threads", "thread", "calls", "busy",
+                                  "rows", "nnz", "cycles", "instructions", "llc_misses", "dtlb_misses", "gbs", "stream_gbs"});
+        vector<vector<string>> rows;
+        for(const BenchPerfRecord &p : perf_records){
+            for(uint t=0; t<p.samples.size(); t++){
+                const SpmvThreadSample &s = p.samples[t];
+                vector<string> row({to_string(BENCH_SCHEMA_VERSION), host, p.format, p.schedule, to_string(p.chunk),
+                        to_string(p.threads), to_string(t), to_string(s.calls), fmt(s.busy),
+                        to_string(s.rows), to_string(s.nnz)});
+                for(int c=0; c<PERF_COUNTER_NUM; c++){
+                    row.push_back(to_string(profile.hardware ? s.counters[c] : -1));
+                }
+                row.push_back(fmt(p.gbs));
+                row.push_back(fmt(stream_gbs));
+                rows.push_back(row);
+            }
+        }
+        write_csv(cfg.perf_csv, col_names, rows);
+    }
+
+    void write_json_file(const string &host) const{
+        ostringstream out;
+        out.precision(9);
+        out << "{\n  \"schema\": " << BENCH_SCHEMA_VERSION << ",\n  \"host\": \"" << host << "\",\n"
+            << "  \"compiler\": \"" << __VERSION__ << "\",\n"
+            << "  \"num_procs\": " << omp_get_num_procs() << ",\n"
+            << "  \"config\": {\"warmup\": " << cfg.warmup << ", \"reps\": " << cfg.reps
+            << ", \"topk\": " << cfg.topk << ", \"alpha\": " << cfg.alpha << ", \"epsillon\": " << cfg.epsillon << "},\n"
+            << "  \"records\": [";
+        for(uint i=0; i<records.size(); i++){
+            const BenchRecord &r = records[i];
+            out << (i ? ",\n" : "\n") << "    {\"phase\": \"" << r.phase << "\", \"format\": \"" << r.format
+                << "\", \"schedule\": \"" << r.schedule
+                << "\", \"chunk\": " << r.chunk << ", \"threads\": " << r.threads << ", \"iterations\": " << r.iterations
+                << ", \"count\": " << r.stats.count << ", \"median\": " << r.stats.median << ", \"p95\": " << r.stats.p95
+                << ", \"mean\": " << r.stats.mean << ", \"stddev\": " << r.stats.stddev
+                << ", \"min\": " << r.stats.min << ", \"max\": " << r.stats.max << "}";
+        }
+        out << "\n  ]";
+        if(cfg.perf){
+            out << ",\n  \"stream_gbs\": " << stream_gbs << ",\n  \"hardware_counters\": " << (profile.hardware ? "true" : "false")
+                << ",\n  \"spmv_threads\": [";
+            for(uint i=0; i<perf_records.size(); i++){
+                const BenchPerfRecord &p = perf_records[i];
+                out << (i ? ",\n" : "\n") << "    {\"format\": \"" << p.format << "\", \"schedule\": \"" << p.schedule
+                    << "\", \"chunk\": " << p.chunk
+                    << ", \"threads\": " << p.threads << ", \"gbs\": " << p.gbs << ", \"per_thread\": [";
+                for(uint t=0; t<p.samples.size(); t++){
+                    const SpmvThreadSample &s = p.samples[t];
+                    out << (t ? ", " : "") << "{\"busy\": " << s.busy << ", \"rows\": " << s.rows << ", \"nnz\": " << s.nnz;
+                    if(profile.hardware){
+                        out << ", \"cycles\": " << s.counters[PERF_CYCLES] << ", \"instructions\": " << s.counters[PERF_INSTRUCTIONS]
+                            << ", \"llc_misses\": " << s.counters[PERF_LLC_MISSES] << ", \"dtlb_misses\": " << s.counters[PERF_DTLB_MISSES];
+                    }
+                    out << "}";
+                }
+                out << "]}";
+            }
+            out << "\n  ]";
+        }
+        out << "\n}\n";
+        ofstream json(cfg.json);
+        json << out.str();
+        json.close();
+    }
+
+    void write(){
+        char host[256] = "unknown";
+        gethostname(host, sizeof(host)-1);
+        write_csv_file(host);
+        write_json_file(host);
+        if(cfg.perf){
+            write_perf_csv_file(host);
+        }
+        cout << "Benchmark written to " << cfg.csv << " and " << cfg.json << endl;
+    }
+};
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef CENTRALITY_H
+#define CENTRALITY_H
+
+#include <string>
+#include <vector>
+#include <cmath>
+#include <iostream>
+#include <omp.h>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+#include "csrmatrix.h"
+#include "alloc.h"
+#include "trace.h"
+
+using namespace std;
+typedef unsigned int uint;
+
+// Iterative centralities on the in-link matrix (row i holds the nodes linking to i):
+//   pagerank:    x = alpha M x + (1-alpha)/n, M is the stored column stochastic matrix
+//   eigenvector: x = A x, normalized every iteration
+//   katz:        x = katz_alpha A x + katz_beta
+//   hits:        authority a = A h, hub h = A^T a, both normalized every iteration
+// A is the adjacency (weights=pattern, default) or the stored values (weights=values).
+enum CentralityKind{
+    CENT_PAGERANK,
+    CENT_EIGENVECTOR,
+    CENT_KATZ,
+    CENT_HITS
+};
+
+enum VectorNorm{
+    NORM_NONE,
+    NORM_L1,
+    NORM_L2,
+    NORM_MAX
+};
+
+struct CentralityConfig{
+    CentralityKind kind = CENT_PAGERANK;
+    // Scaling applied after every update, and norm of difference tested against epsillon
+    VectorNorm normalize = NORM_L2;
+    VectorNorm converge = NORM_L1;
+    bool pattern = true;
+    double alpha = 0.2;         // PageRank damping
+    double katz_alpha = 0.01;   // Must be below 1/(largest eigenvalue of A) to converge
+    double katz_beta = 1;
+    double epsillon = 1e-6;
+    int max_iterations = 1000;
+};
+
+inline bool vector_norm_kind(const string &name, VectorNorm &norm){
+    if(name=="none"){
+        norm = NORM_NONE;
+    }else if(name=="l1"){
+        norm = NORM_L1;
+    }else if(name=="l2"){
+        norm = NORM_L2;
+    }else if(name=="max"){
+        norm = NORM_MAX;
+    }else{
+        return false;
+    }
+    return true;
+}
+
+// Set a single option (algorithm, normalize, converge, weights, katz_alpha,
+// katz_beta, max_iter). Returns false for an unknown key or value.
+inline bool centrality_option(CentralityConfig &cfg, const string &key, const string &value){
+    try{
+        if(key=="algorithm"){
+            if(value=="pagerank") cfg.kind = CENT_PAGERANK;
+            else if(value=="eigenvector") cfg.kind = CENT_EIGENVECTOR;
+            else if(value=="katz") cfg.kind = CENT_KATZ;
+            else if(value=="hits") cfg.kind = CENT_HITS;
+            else return false;
+        }else if(key=="normalize"){
+            return vector_norm_kind(value, cfg.normalize);
+        }else if(key=="converge"){
+            return vector_norm_kind(value, cfg.converge) && cfg.converge!=NORM_NONE;
+        }else if(key=="weights"){
+            if(value!="pattern" && value!="values"){
+                return false;
+            }
+            cfg.pattern = value=="pattern";
+        }else if(key=="katz_alpha"){
+            cfg.katz_alpha = stod(value);
+        }else if(key=="katz_beta"){
+            cfg.katz_beta = stod(value);
+        }else if(key=="max_iter"){
+            cfg.max_iterations = stoi(value);
+        }else{
+            return false;
+        }
+    }catch(const logic_error &){
+        cout << "Bad value: " << key << "=" << value << endl;
+    }
+    return true;
+}
+
+// Norm of a, or of a-b if b is given
+template<typename T>
+inline T vector_norm(const page_vector<T> &a, VectorNorm norm, const page_vector<T> *b=NULL){
+    T sum = 0, top = 0;
+    long long i, n = a.size();
+    #pragma omp parallel for schedule(static) reduction(+: sum) reduction(max: top)
+    for(i=0; i<n; i++){
+        T v = abs(b!=NULL ? a[i]-(*b)[i] : a[i]);
+        sum += norm==NORM_L2 ? v*v : v;
+        top = max(top, v);
+    }
+    if(norm==NORM_L2){
+        return sqrt(sum);
+    }
+    return norm==NORM_MAX ? top : sum;
+}
+
+template<typename T>
+inline void normalize_vector(page_vector<T> &a, VectorNorm norm){
+    if(norm==NORM_NONE){
+        return;
+    }
+    T s = vector_norm(a, norm);
+    if(s==0){
+        return;
+    }
+    long long i, n = a.size();
+    #pragma omp parallel for schedule(static)
+    for(i=0; i<n; i++){
+        a[i] /= s;
+    }
+}
+
+// Runs one centrality on an existing matrix. Transposed matrix (for HITS hubs) is
+// the matrix's out_links if built, otherwise it is built on first use and kept for later runs.
+template<typename T>
+class CentralityEngine{
+    private:
+    CSR_Matrix<T> *in;
+    CSR_Matrix<T> *out = NULL;
+    bool own_out = false;
+
+    public:
+    CentralityConfig cfg;
+    int iterations = 0;
+    T diff = 0;
+    // Scores of every node. HITS: authorities in scores, hubs in hubs.
+    page_vector<T> scores, hubs;
+
+    CentralityEngine(const CentralityEngine &) = delete;
+    CentralityEngine &operator=(const CentralityEngine &) = delete;
+
+    // out may be given if a transposed matrix already exists
+    CentralityEngine(CSR_Matrix<T> *in, const CentralityConfig &cfg, CSR_Matrix<T> *out=NULL)
+        : in(in), out(out), cfg(cfg){}
+
+    ~CentralityEngine(){
+        if(own_out){
+            delete out;
+        }
+    }
+
+    CSR_Matrix<T> *transposed(){
+        if(out==NULL){
+            out = in->out_links;
+        }
+        if(out==NULL){
+            out = in->transpose();
+            own_out = true;
+        }
+        return out;
+    }
+
+    // Iterate until difference is below epsillon. Returns false if max_iterations is reached first.
+    bool run(){
+        uint n = in->get_size().second;
+        page_vector<T> prev, tmp;
+        iterations = 0;
+        scores.assign(n, cfg.kind==CENT_KATZ ? 0 : 1);
+        // PageRank starts from all ones like run_program
+        if(cfg.kind!=CENT_PAGERANK){
+            normalize_vector(scores, cfg.normalize);
+        }
+        if(cfg.kind==CENT_HITS){
+            hubs = scores;
+            transposed();
+        }
+        do{
+            prev.swap(scores);
+            if(cfg.kind==CENT_PAGERANK){
+                scores = in->ops(prev, cfg.alpha, 1-cfg.alpha);
+            }else{
+                // Authority / eigenvector / katz step: in-link sums of previous scores (HITS: hubs)
+                in->multiply(cfg.kind==CENT_HITS ? hubs : prev, scores, cfg.pattern);
+            }
+            if(cfg.kind==CENT_KATZ){
+                long long i;
+                #pragma omp parallel for schedule(static)
+                for(i=0; i<(long long)n; i++){
+                    scores[i] = cfg.katz_alpha*scores[i] + cfg.katz_beta;
+                }
+            }else if(cfg.kind!=CENT_PAGERANK){
+                normalize_vector(scores, cfg.normalize);
+            }
+            diff = vector_norm(scores, cfg.converge, &prev);
+            if(cfg.kind==CENT_HITS){
+                // Hub step: out-link sums of new authorities
+                out->multiply(scores, tmp, cfg.pattern);
+                normalize_vector(tmp, cfg.normalize);
+                diff += vector_norm(tmp, cfg.converge, &hubs);
+                hubs.swap(tmp);
+            }
+            iterations++;
+            trace_counter("diff", diff);
+            trace_log(LOG_PROGRESS) << "Current Diff: " << diff << endl;
+        } while(diff > cfg.epsillon && iterations < cfg.max_iterations);
+        return diff <= cfg.epsillon;
+    }
+};
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef CONTINUATION_H
+#define CONTINUATION_H
+
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+#include "csrmatrix.h"
+#include "bench.h"
+#include "checkpoint.h"
+#include "alloc.h"
+#include "export.h"
+#include "trace.h"
+
+using namespace std;
+typedef unsigned int uint;
+
+// One damping factor of a continuation sweep
+struct ContinuationStep{
+    double alpha = 0;
+    int iterations = 0;
+    // Iterations from the all ones vector, -1 if not measured
+    int cold_iterations = -1;
+    double time = 0, cold_time = 0;
+    vector<uint> top;
+    vector<double> scores;
+};
+
+// Initial rank vector from a checkpoint file (checkpoint mode writes one) or a
+// rank vector export (ranks_out). Vector is used as is, not rescaled. Converged
+// vectors sum to at most 1, only the all ones default start sums to node count.
+template<typename A>
+inline bool read_initial_vector(const string &filename, uint total, vector<double, A> &vec){
+    Checkpoint ck;
+    if(read_rank_binary(filename, ck.vec)){
+        ck.total = ck.vec.size();
+    }else if(!read_checkpoint(filename, ck)){
+        cout << "Cannot read initial vector: " << filename << endl;
+        return false;
+    }
+    if(ck.offset!=0 || ck.total!=total || ck.vec.size()!=total){
+        cout << "Initial vector has " << ck.vec.size() << " of " << ck.total << " elements, matrix has " << total << endl;
+        return false;
+    }
+    vec.assign(ck.vec.begin(), ck.vec.end());
+    return true;
+}
+
+// Power iteration from whatever r holds until the diff is below epsillon.
+// tmp is a work buffer, result is left in r. Returns iterations.
+template<typename T>
+inline int solve_from(CSR_Matrix<T> *P, T alpha, T epsillon, page_vector<T> &r, page_vector<T> &tmp){
+    int iterations = 0;
+    do{
+        P->ops(r, alpha, 1-alpha, tmp);
+        r.swap(tmp);
+        iterations++;
+    } while(P->two_vec_diff > epsillon);
+    return iterations;
+}
+
+// Solves every alpha in increasing order with one matrix. The first starts from
+// r (all ones if empty), every later one from the previous result, since ranks
+// move little between close damping factors. With cold, every alpha is also solved
+// from the all ones vector to measure the savings. Final vector is left in r.
+template<typename T>
+inline vector<ContinuationStep> solve_continuation(CSR_Matrix<T> *P, vector<double> alphas, T epsillon,
+                                                   page_vector<T> &r, bool cold, uint k){
+    uint n = P->get_size().second;
+    page_vector<T> tmp(n), cold_r;
+    vector<ContinuationStep> steps;
+    sort(alphas.begin(), alphas.end());
+    alphas.erase(unique(alphas.begin(), alphas.end()), alphas.end());
+    if(r.size()!=n){
+        r.assign(n, 1);
+    }
+    for(double alpha : alphas){
+        ContinuationStep step;
+        step.alpha = alpha;
+        TraceScope solve_phase("solve");
+        step.iterations = solve_from<T>(P, alpha, epsillon, r, tmp);
+        step.time = solve_phase.stop();
+        if(cold){
+            cold_r.assign(n, 1);
+            TraceScope cold_phase("cold_solve");
+            step.cold_iterations = solve_from<T>(P, alpha, epsillon, cold_r, tmp);
+            step.cold_time = cold_phase.stop();
+        }
+        step.top = top_k(r, k);
+        for(uint i : step.top){
+            step.scores.push_back(r[i]);
+        }
+        cout << "Alpha " << alpha << ": " << step.iterations << " iterations";
+        if(cold){
+            cout << " (" << step.cold_iterations << " from cold start)";
+        }
+        cout << " in " << step.time << " s" << endl;
+        steps.push_back(step);
+    }
+    return steps;
+}
+
+#endif
@@ -5,8 +5,10 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <functional>
 #include <unordered_map>
 #include <limits.h>
+#include <limits>
 #include <omp.h>
 
 // Uncomment when building for production (disables assert)
@@ -14,42 +16,267 @@
 #include <assert.h>
 
 #include "csv.h"
+#include "perfcount.h"
+#include "alloc.h"
+#include "snapshot.h"
+#include "steal.h"
+#include "segment.h"
+#include "pushblock.h"
+#include "sell.h"
 
 using namespace std;
 typedef unsigned int uint;
 
+// Third field of the first line of csv backups. Files of older builds have
+// only row and col, and zero rows in their own formats.
+#define CSR_CSV_VERSION 2
+
 template<typename T>
 class CSR_Matrix{
     private:
     uint row, col;
-    // Value indices. Must be ordered
-    vector<uint> row_begin;
-    vector<uint> col_indices;
+    // Value indices. Monotone, row+1 elements, zero rows have equal begin and end.
+    page_vector<uint> row_begin;
+    page_vector<uint> col_indices;
     //Non zero values in the matrix
-    vector<T> values;
+    page_vector<T> values;
+    // Indices of non zero rows in order (DCSR style), for sparse row blocks
+    vector<uint> nz_rows;
+    // Per node copies of the vector for numa=replicate
+    NumaReplica<T> vec_copies;
+
+    // Vector to gather from in the calling thread. Node local copy if replicated.
+    const T *gather_source(const page_vector<T> &vec) const{
+        if(memory_policy().numa==NUMA_REPLICATE){
+            return vec_copies.local();
+        }
+        return &vec[0];
+    }
+
+    // Nonzeros are split evenly between threads instead of rows. A row may be split
+    // between threads, so rows that are not entirely in a thread's range are summed
+    // into carry slots (first and last row of each thread), then added serially.
+    // Keeps hub rows of power-law graphs from serializing on a single thread.
+    void ops_balanced(const page_vector<T> &vec, T sca, page_vector<T> &ret){
+        uint nnz = values.size();
+        int nthreads = omp_get_max_threads();
+        // Carry rows and partial sums, two per thread
+        vector<uint> carry_row(2*nthreads, UINT_MAX);
+        vector<T> carry_sum(2*nthreads, 0);
+
+        #pragma omp parallel shared(vec, ret, carry_row, carry_sum)
+        {
+            int tid = omp_get_thread_num(), nt = omp_get_num_threads();
+            const T *x = gather_source(vec);
+            uint beg = (unsigned long long)nnz*tid/nt, end = (unsigned long long)nnz*(tid+1)/nt;
+            uint i=0, l, first, last, i0=0;
+            T sum;
+            if(profile!=NULL){
+                profile->begin(tid);
+            }
+            if(beg<end){
+                // Row containing beg, and row containing end-1
+                i = upper_bound(row_begin.begin(), row_begin.end(), beg) - row_begin.begin() - 1;
+                i0 = i;
+                for(; i<this->row && row_begin[i]<end; i++){
+                    first = max(row_begin[i], beg);
+                    last = min(row_begin[i+1], end);
+                    sum = 0;
+                    for(l=first; l<last; l++){
+                        sum += values[l] * x[col_indices[l]];
+                    }
+                    if(row_begin[i]>=beg && row_begin[i+1]<=end){
+                        ret[i] += sum * sca;
+                    }else if(row_begin[i]<beg){
+                        carry_row[2*tid] = i;
+                        carry_sum[2*tid] = sum;
+                    }else{
+                        carry_row[2*tid+1] = i;
+                        carry_sum[2*tid+1] = sum;
+                    }
+                }
+            }
+            if(profile!=NULL){
+                profile->end(tid, beg<end ? i-i0 : 0, end-beg);
+            }
+        }
+        // Fix up rows split between threads
+        for(int t=0; t<2*nthreads; t++){
+            if(carry_row[t]!=UINT_MAX){
+                ret[carry_row[t]] += carry_sum[t] * sca;
+            }
+        }
+    }
+
+    // Same loop as ops, but every thread also counts its rows and nonzeros, and
+    // reports them to profile. nowait keeps barrier time out of busy time.
+    void ops_profiled(const page_vector<T> &vec, T sca, T init, page_vector<T> &ret){
+        #pragma omp parallel shared(row_begin, values, vec, col_indices, ret) reduction(+: two_vec_diff)
+        {
+            int tid = omp_get_thread_num();
+            const T *x = gather_source(vec);
+            unsigned long long rows=0, nnz=0;
+            uint i, l;
+            profile->begin(tid);
+            #pragma omp for schedule(runtime) nowait
+            for(i=0; i<this->row; i++){
+                ret[i] = init;
+                for(l=row_begin[i]; l<row_begin[i+1]; l++){
+                    ret[i] += (values[l] * x[col_indices[l]] * sca);
+                }
+                two_vec_diff+=abs(ret[i]-vec[i]);
+                rows++;
+                nnz += row_begin[i+1]-row_begin[i];
+            }
+            profile->end(tid, rows, nnz);
+        }
+    }
+
+    // Same update as ops, run on the work stealing pool
+    void ops_stolen(const page_vector<T> &vec, T sca, T init, page_vector<T> &ret){
+        // Per thread counts for profile
+        vector<unsigned long long> rows(stealer->threads()), nnz(stealer->threads());
+        function<void(int, bool)> hook;
+        if(profile!=NULL){
+            hook = [this, &rows, &nnz](int tid, bool done){
+                if(done){
+                    profile->end(tid, rows[tid], nnz[tid]);
+                }else{
+                    profile->begin(tid);
+                }
+            };
+        }
+        two_vec_diff = stealer->run(&row_begin[0], this->row, [&](uint tid, uint begin, uint end){
+            const T *x = gather_source(vec);
+            rows[tid] += end-begin;
+            nnz[tid] += row_begin[end]-row_begin[begin];
+            double diff = 0;
+            for(uint i=begin; i<end; i++){
+                T sum = init;
+                for(uint l=row_begin[i]; l<row_begin[i+1]; l++){
+                    sum += values[l] * x[col_indices[l]] * sca;
+                }
+                ret[i] = sum;
+                diff += abs(sum-vec[i]);
+            }
+            return diff;
+        }, hook);
+    }
+
+    // Empty matrix, arrays are filled by the caller (transpose)
+    CSR_Matrix(uint row, uint col) : row(row), col(col){}
 
     public:
     // Those values are non essential to CSR matrix's runtime.
     // But if they shouldn't be changed without caution.
     double two_vec_diff=0;
     vector<string> arr_dict;
+    // Split work by nonzeros instead of rows in ops (ignores runtime schedule)
+    bool nnz_balanced=false;
+    // Transposed matrix (row i holds the nodes i links to), if built. Owned by this
+    // matrix and shares its arr_dict, its own arr_dict stays empty.
+    CSR_Matrix<T> *out_links=NULL;
+    // Column segmented copy used by ops if set (segment_columns)
+    ColumnSegments<T> *segments=NULL;
+    // Segment width stored in the snapshot this matrix was read from, 0 if none
+    uint stored_segment_cols=0;
+    // False if the file given to the constructor could not be read
+    bool loaded=true;
+    // Push kernel on out_links used by ops if set (use_push)
+    PushBlocking<T> *push=NULL;
+    // SELL-C-sigma copy used by ops if set (use_sell)
+    SELL_Matrix<T> *sell=NULL;
+
+    CSR_Matrix(const CSR_Matrix &) = delete;
+    CSR_Matrix &operator=(const CSR_Matrix &) = delete;
+
+    ~CSR_Matrix(){
+        delete out_links;
+        delete segments;
+        delete push;
+        delete sell;
+    }
+
+    // Run ops on a SELL-C-sigma copy sorted in windows of sigma rows. 0 removes it.
+    void use_sell(uint sigma){
+        delete sell;
+        sell = sigma>0 ? new SELL_Matrix<T>(this->row, &row_begin[0], &col_indices[0], &values[0], sigma) : NULL;
+    }
+
+    // Run ops as a propagation blocking push over out_links (built if missing),
+    // with bins of width destinations. 0 goes back to the pull kernel.
+    void use_push(uint width){
+        delete push;
+        push = NULL;
+        if(width>0){
+            build_out_links();
+            // More blocks than threads, so any thread count divides work well
+            push = new PushBlocking<T>(out_links->row, out_links->col, &out_links->row_begin[0],
+                                       &out_links->col_indices[0], width, 4*omp_get_max_threads());
+        }
+    }
+
+    // Build the column segmented copy with segments of width columns, 0 removes it
+    void segment_columns(uint width){
+        delete segments;
+        segments = width>0 ? new ColumnSegments<T>(this->row, this->col, &row_begin[0], &col_indices[0], &values[0], width) : NULL;
+    }
+
+    // Time a few ops calls without segments and with every given width, and keep
+    // the fastest. Returns the chosen width, 0 if plain CSR was fastest.
+    uint tune_segments(const vector<uint> &widths, int reps=3){
+        page_vector<T> x(this->col, 1.0/this->col);
+        auto time_ops = [&](){
+            double best = numeric_limits<double>::max();
+            ops(x, 0.8, 0.2);
+            for(int r=0; r<reps; r++){
+                double t = omp_get_wtime();
+                ops(x, 0.8, 0.2);
+                best = min(best, omp_get_wtime()-t);
+            }
+            return best;
+        };
+        segment_columns(0);
+        double best_time = time_ops();
+        uint best = 0;
+        cout << "Segment width none: " << best_time << endl;
+        for(uint w : widths){
+            segment_columns(w);
+            double t = time_ops();
+            cout << "Segment width " << w << " (" << segments->segments << " segments): " << t << endl;
+            if(t<best_time){
+                best_time = t;
+                best = w;
+            }
+        }
+        segment_columns(best);
+        return best;
+    }
+
+    // If set, ops records per thread time, rows, nonzeros and hardware counters
+    SpmvProfile *profile=NULL;
+    // If set, ops runs on this work stealing pool instead of an OpenMP loop
+    StealExecutor *stealer=NULL;
     // Write matrix to file
     void write(const string &filename){
         string buffer;
         // Write row
-        buffer += to_string(this->row);
+        append_number(buffer, this->row);
         buffer += ",";
         // Write col
-        buffer += to_string(this->col);
+        append_number(buffer, this->col);
+        // Write format version (row_begin is monotone)
+        buffer += ",";
+        append_number(buffer, CSR_CSV_VERSION);
         buffer += "\n";
         // Write row_begin array
-        buffer += join(vector_to_string(row_begin), ",");
+        append_joined(buffer, row_begin, ',');
         buffer += "\n";
-        // Write values array
-        buffer += join(vector_to_string(values), ",");
+        // Write values array (shortest text that reads back exactly)
+        append_joined(buffer, values, ',');
         buffer += "\n";
         // Write col_indices array
-        buffer += join(vector_to_string(col_indices), ",");
+        append_joined(buffer, col_indices, ',');
         buffer += "\n";
         // Write arr_dict array
         buffer += join(arr_dict, ",");
@@ -60,93 +287,491 @@ class CSR_Matrix{
         csv.close();
     }
 
+    // Split rows into shards of about shard_bytes each, and pass them to add
+    template<typename Add>
+    void for_each_shard(unsigned long long shard_bytes, Add add) const{
+        uint first = 0;
+        while(first<this->row){
+            // Grow shard by rows until it reaches shard_bytes, at least one row
+            uint last = first+1;
+            while(last<this->row && snapshot_shard_bytes(last+1-first, row_begin[last+1]-row_begin[first])<=shard_bytes){
+                last++;
+            }
+            add(first, last-first, &row_begin[first], &col_indices[row_begin[first]], &values[row_begin[first]]);
+            first = last;
+        }
+    }
+
+    // Write matrix as a binary snapshot, split into shards of about shard_bytes each.
+    // Out-link view is stored too if it was built.
+    bool write_snapshot(const string &filename, unsigned long long shard_bytes) const{
+        SnapshotWriter out(filename, this->row, this->col);
+        out.set_segment_cols(segments!=NULL ? segments->width : 0);
+        for_each_shard(shard_bytes, [&out](uint first, uint rows, const uint *rb, const uint *ci, const T *v){
+            out.add_shard(first, rows, rb, ci, v);
+        });
+        if(out_links!=NULL){
+            out_links->for_each_shard(shard_bytes, [&out](uint first, uint rows, const uint *rb, const uint *ci, const T *v){
+                out.add_out_shard(first, rows, rb, ci, v);
+            });
+        }
+        return out.finish(arr_dict);
+    }
+
     // Get matrix size
     pair<uint, uint> get_size() const{
         return {row, col};
     }
 
-    // Initialize matrix from file
+    // Number of stored nonzeros
+    uint get_nnz() const{
+        return values.size();
+    }
+
+    // Initialize matrix from file, either a binary snapshot or the csv written by write.
+    // Check loaded afterwards, it is false if the file could not be read.
     CSR_Matrix(const string &filename){
+        if(is_snapshot(filename)){
+            loaded = read_snapshot(filename);
+            return;
+        }
         ifstream csv(filename);
         string str_init, str_row, str_val, str_col, str_maps;
 
         // Read file rows
         csv >> str_init >> str_row >> str_val >> str_col >> str_maps;
+        if(str_init.empty()){
+            loaded = false;
+            return;
+        }
         cout << "Read file" << endl;
 
         // Now parse them accordingly
-        vector<uint>temp = string_to_uivector(str_init, ",");
+        vector<uint> temp, row_str, col_str;
+        vector<double> val_str;
+        if(!parse_numbers(str_init, ',', temp) || temp.size()<2 || !parse_numbers(str_row, ',', row_str) ||
+           !parse_numbers(str_val, ',', val_str) || !parse_numbers(str_col, ',', col_str) ||
+           row_str.size()!=(size_t)temp[0]+1 || val_str.size()!=col_str.size()){
+            loaded = false;
+            return;
+        }
         this->row = temp[0];
         this->col = temp[1];
-        row_begin = string_to_uivector(str_row, ",");
-        values = string_to_dvector(str_val, ",");
-        col_indices = string_to_uivector(str_col, ",");
+        row_begin.assign(row_str.begin(), row_str.end());
+        values.assign(val_str.begin(), val_str.end());
+        col_indices.assign(col_str.begin(), col_str.end());
         arr_dict = string_to_svector(str_maps, ",");
 
+        // Files without a version mark zero rows with UINT_MAX, and those of the
+        // MPI build repeat the begin of the row before (a run of equal begins is
+        // one row and zero rows after it). Make them monotone, from the end so
+        // every zero row takes the begin of the next non-zero row.
+        if(temp.size()<3){
+            for(uint i=this->row; i>0; i--){
+                if(row_begin[i-1]==UINT_MAX || (i>1 && row_begin[i-1]==row_begin[i-2])){
+                    row_begin[i-1] = row_begin[i];
+                }
+            }
+        }
+        index_rows();
+    }
+
+    // Move CSR arrays to fresh pages allocated with current memory_policy().
+    // Pages are first touched in parallel with the runtime schedule, so with a
+    // static schedule each thread's rows end up on its own NUMA node.
+    void place_pages(){
+        uint nnz = values.size();
+        page_vector<uint> new_row_begin(this->row+1), new_col_indices(nnz);
+        page_vector<T> new_values(nnz);
+        uint i, l;
+        #pragma omp parallel for private(i, l) schedule(runtime)
+        for(i=0; i<this->row; i++){
+            new_row_begin[i] = row_begin[i];
+            for(l=row_begin[i]; l<row_begin[i+1]; l++){
+                new_col_indices[l] = col_indices[l];
+                new_values[l] = values[l];
+            }
+        }
+        new_row_begin[this->row] = row_begin[this->row];
+        row_begin.swap(new_row_begin);
+        col_indices.swap(new_col_indices);
+        values.swap(new_values);
+        // Rebuilt, so its pages get the policy too
+        if(segments!=NULL){
+            segment_columns(segments->width);
+        }
+    }
+
+    // Fill arrays from the given shards of a snapshot
+    bool read_shards(const SnapshotFile &snap, const vector<SnapshotShard> &table, unsigned long long nnz){
+        row_begin.resize(this->row+1);
+        col_indices.resize(nnz);
+        values.resize(nnz);
+        row_begin[0] = 0;
+        vector<char> buf;
+        for(uint k=0; k<table.size(); k++){
+            // Short or failed read, buffer must not be used
+            if(!snap.read_shard(table[k], buf)){
+                return false;
+            }
+            ShardView v(table[k], buf.data());
+            uint base = row_begin[v.first_row];
+            for(uint i=0; i<v.rows; i++){
+                row_begin[v.first_row+i+1] = base+v.row_begin[i+1];
+            }
+            copy(v.col_indices, v.col_indices+table[k].nnz, col_indices.begin()+base);
+            copy(v.values, v.values+table[k].nnz, values.begin()+base);
+        }
+        index_rows();
+        return true;
+    }
+
+    // Read all shards of a binary snapshot, and the out-link view if stored.
+    // Returns false if the file is missing, truncated or not a snapshot.
+    bool read_snapshot(const string &filename){
+        SnapshotFile snap;
+        if(!snap.open(filename)){
+            return false;
+        }
+        this->row = snap.header.row;
+        this->col = snap.header.col;
+        stored_segment_cols = snap.header.segment_cols;
+        if(!read_shards(snap, snap.table, snap.header.nnz)){
+            return false;
+        }
+        if(!snap.out_table.empty()){
+            out_links = new CSR_Matrix<T>(this->col, this->row);
+            if(!out_links->read_shards(snap, snap.out_table, snap.header.out_nnz)){
+                return false;
+            }
+        }
+        arr_dict = snap.names();
+        return true;
+    }
+
+    // Rebuild non zero row list from row_begin
+    void index_rows(){
+        nz_rows.clear();
+        for(uint i=0; i<this->row; i++){
+            if(row_begin[i]!=row_begin[i+1]){
+                nz_rows.push_back(i);
+            }
+        }
     }
 
     // Special array initializator optimised for double node matrices.
     // Needs approximately 3secs to run. No need to parallelise.
+    // With with_out_links, the transposed matrix is also built from link_to.
     CSR_Matrix( vector<vector<int>> &link_to,
                 vector<vector<int>> &link_by,
                 unordered_map<string, int> &name_dict,
-                vector<string> &arr_dict){
+                vector<string> &arr_dict,
+                bool with_out_links=false){
         // Set basic variables
         this->arr_dict = arr_dict;
         this->col = arr_dict.size();
         this->row = arr_dict.size();
 
+        row_begin.push_back(0);
         for(int i=0; i<this->col; i++){
             // Set array structure variables
             uint old_size = values.size();
             values.resize(values.size()+link_by[i].size());
             col_indices.resize(values.size());
-            // If it is a zero row, then set according row_begin index to UINT_MAX
-            if(values.size()==old_size){
-                row_begin.push_back(UINT_MAX);
-            }else{
-                row_begin.push_back(old_size);
+            if(values.size()!=old_size){
+                nz_rows.push_back(i);
             }
 
             // Set values and according column indices.
             for(int l=0; l<link_by[i].size(); l++){
                 assert(link_to[link_by[i][l]].size()!=0);
-                values[old_size+l]=1/(link_to[link_by[i][l]].size());
+                values[old_size+l]=1.0/(link_to[link_by[i][l]].size());
                 col_indices[old_size+l]=link_by[i][l];
             }
             // Sorting is not required
             //sort(col_indices.begin()+old_size, col_indices.end());
+            row_begin.push_back(values.size());
         }
-        row_begin.push_back(values.size());
         assert(values.size()==col_indices.size());
+        if(with_out_links){
+            out_links = from_out_lists(link_to);
+        }
     }
 
-    vector<T> ops(const vector<T> &vec, T sca, T add){
-        assert(vec.size()==this->col);
-        uint i, end, l, beg;
-        // Initialize with multiplied C vector
-        vector<T> ret(this->row, add/this->col);
+    // Out-link matrix straight from the out-link lists: row i is link_to[i], all
+    // values 1/|link_to[i]| like the matching entries of the in-link matrix.
+    static CSR_Matrix<T> *from_out_lists(const vector<vector<int>> &link_to){
+        uint n = link_to.size();
+        long long i;
+        CSR_Matrix<T> *t = new CSR_Matrix<T>(n, n);
+        t->row_begin.resize(n+1);
+        t->row_begin[0] = 0;
+        for(i=0; i<n; i++){
+            t->row_begin[i+1] = t->row_begin[i]+link_to[i].size();
+        }
+        t->col_indices.resize(t->row_begin[n]);
+        t->values.resize(t->row_begin[n]);
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for(i=0; i<n; i++){
+            uint beg = t->row_begin[i];
+            T val = 1.0/link_to[i].size();
+            for(uint l=0; l<link_to[i].size(); l++){
+                t->col_indices[beg+l] = link_to[i][l];
+                t->values[beg+l] = val;
+            }
+            // Sorted like the rows of transpose
+            sort(t->col_indices.begin()+beg, t->col_indices.begin()+t->row_begin[i+1]);
+        }
+        t->index_rows();
+        return t;
+    }
 
-        // Skip zero rows
-        for(beg=0; row_begin[beg]==UINT_MAX; beg++);
-        two_vec_diff=0;
+    // Build out_links by transposing, unless it already exists
+    CSR_Matrix<T> *build_out_links(){
+        if(out_links==NULL){
+            out_links = transpose();
+        }
+        return out_links;
+    }
+
+    // Transposed matrix (rows become columns) by parallel counting sort on columns.
+    // For the in-link matrix, rows of the result are out-links.
+    // Columns are counted and scattered with atomics, then every result row is
+    // sorted, so the result does not depend on thread timing.
+    CSR_Matrix<T> *transpose() const{
+        CSR_Matrix<T> *t = new CSR_Matrix<T>(this->col, this->row);
+        uint nnz = values.size(), i, l;
+        // Count entries of every column, then prefix sum
+        t->row_begin.assign(this->col+1, 0);
+        #pragma omp parallel for private(l) schedule(static)
+        for(l=0; l<nnz; l++){
+            #pragma omp atomic
+            t->row_begin[col_indices[l]+1]++;
+        }
+        for(i=0; i<this->col; i++){
+            t->row_begin[i+1] += t->row_begin[i];
+        }
+        // Scatter
+        page_vector<uint> next(t->row_begin.begin(), t->row_begin.end()-1);
+        t->col_indices.resize(nnz);
+        t->values.resize(nnz);
+        #pragma omp parallel for private(i, l) schedule(runtime)
+        for(i=0; i<this->row; i++){
+            for(l=row_begin[i]; l<row_begin[i+1]; l++){
+                uint dst;
+                #pragma omp atomic capture
+                dst = next[col_indices[l]]++;
+                t->col_indices[dst] = i;
+                t->values[dst] = values[l];
+            }
+        }
+        // Sort every row by column, values along
+        #pragma omp parallel private(i, l)
+        {
+            vector<pair<uint, T>> entries;
+            #pragma omp for schedule(dynamic, 1024)
+            for(i=0; i<this->col; i++){
+                uint beg = t->row_begin[i], end = t->row_begin[i+1];
+                if(end-beg<2){
+                    continue;
+                }
+                entries.clear();
+                for(l=beg; l<end; l++){
+                    entries.push_back({t->col_indices[l], t->values[l]});
+                }
+                sort(entries.begin(), entries.end());
+                for(l=beg; l<end; l++){
+                    t->col_indices[l] = entries[l-beg].first;
+                    t->values[l] = entries[l-beg].second;
+                }
+            }
+        }
+        t->index_rows();
+        return t;
+    }
+
+    // y = A x, without the PageRank terms. With pattern, every stored entry counts
+    // as 1 (plain adjacency) instead of its value.
+    void multiply(const page_vector<T> &x, page_vector<T> &y, bool pattern) const{
+        assert(x.size()==this->col);
+        y.resize(this->row);
+        uint i, l;
+        #pragma omp parallel for shared(x, y) private(i, l) schedule(runtime)
+        for(i=0; i<this->row; i++){
+            T sum = 0;
+            if(pattern){
+                for(l=row_begin[i]; l<row_begin[i+1]; l++){
+                    sum += x[col_indices[l]];
+                }
+            }else{
+                for(l=row_begin[i]; l<row_begin[i+1]; l++){
+                    sum += values[l] * x[col_indices[l]];
+                }
+            }
+            y[i] = sum;
+        }
+    }
 
-        // Parallelised for loop
-        #pragma omp parallel for shared(row_begin, values, vec, col_indices, ret) \
-                private(i, end, l) schedule(runtime) reduction(+: two_vec_diff)
-        for(i=beg; i<this->row; i++){
-            // Skip zero rows
-            for(end=i+1; row_begin[end]==UINT_MAX; end++);
-            // Matrix multiplication
-            for(l=row_begin[i]; l<row_begin[end]; l++){
-                // While multiplying, also multiply with the scaler
-                ret[i] += (values[l] * vec[col_indices[l]] * sca);
+    // Whole solve (r = sca*M r + add/col until the difference is below epsillon) in
+    // one parallel region: no fork/join per iteration and a single barrier per
+    // iteration. Difference is summed from per thread padded slots instead of a
+    // reduction, every thread adds them in the same order so all stop together.
+    // Slots alternate between iterations, so they are never written while read.
+    // progress(iteration, diff, ranks) is called by thread 0 only, while the other
+    // threads already run the next iteration (which only reads ranks).
+    // Uses the runtime schedule, ignores nnz_balanced, stealer, sell, segments, push, profile and numa=replicate.
+    // Returns iterations, r holds the result.
+    int solve_persistent(page_vector<T> &r, T sca, T add, T epsillon, int max_iterations=INT_MAX,
+                         function<void(int, T, const page_vector<T> &)> progress=nullptr){
+        assert(r.size()==this->col && this->row==this->col);
+        struct alignas(64) PaddedSum{
+            T v;
+        };
+        int nthreads = omp_get_max_threads();
+        vector<PaddedSum> slots(2*nthreads);
+        page_vector<T> other(this->row);
+        T init = add/this->col;
+        int iterations = 0;
+        T total = 0;
+
+        #pragma omp parallel shared(slots, other, r, iterations, total)
+        {
+            int tid = omp_get_thread_num(), nt = omp_get_num_threads();
+            page_vector<T> *src = &r, *dst = &other;
+            int it = 0;
+            T sum;
+            while(true){
+                T diff = 0;
+                uint i, l;
+                #pragma omp for schedule(runtime) nowait
+                for(i=0; i<this->row; i++){
+                    T acc = init;
+                    for(l=row_begin[i]; l<row_begin[i+1]; l++){
+                        acc += values[l] * (*src)[col_indices[l]] * sca;
+                    }
+                    (*dst)[i] = acc;
+                    diff += abs(acc-(*src)[i]);
+                }
+                PaddedSum *mine = &slots[(it%2)*nthreads];
+                mine[tid].v = diff;
+                #pragma omp barrier
+                sum = 0;
+                for(int t=0; t<nt; t++){
+                    sum += mine[t].v;
+                }
+                it++;
+                swap(src, dst);
+                if(tid==0 && progress){
+                    progress(it, sum, *src);
+                }
+                if(sum<=epsillon || it>=max_iterations){
+                    break;
+                }
+            }
+            if(tid==0){
+                iterations = it;
+                total = sum;
             }
-            // Log vector difference
-            two_vec_diff+=abs(ret[i]-vec[i]);
         }
+        // Result is in other after an odd number of iterations
+        if(iterations%2==1){
+            r.swap(other);
+        }
+        two_vec_diff = total;
+        return iterations;
+    }
+
+    page_vector<T> ops(const page_vector<T> &vec, T sca, T add){
+        // Filled in parallel, so its pages are first touched by the threads writing them
+        page_vector<T> ret(this->row);
+        ops(vec, sca, add, ret);
         return ret;
     }
+
+    // Same, writing into ret, so a caller can keep reusing the same buffers
+    void ops(const page_vector<T> &vec, T sca, T add, page_vector<T> &ret){
+        assert(vec.size()==this->col && &vec!=&ret);
+        uint i, l;
+        ret.resize(this->row);
+        // Multiplied C vector
+        T init = add/this->col;
+
+        if(memory_policy().numa==NUMA_REPLICATE){
+            vec_copies.update(&vec[0], vec.size());
+        }
+
+        if(nnz_balanced){
+            #pragma omp parallel for shared(ret) schedule(static)
+            for(i=0; i<this->row; i++){
+                ret[i] = init;
+            }
+            ops_balanced(vec, sca, ret);
+            two_vec_diff=0;
+            #pragma omp parallel for shared(vec, ret) schedule(static) reduction(+: two_vec_diff)
+            for(i=0; i<this->row; i++){
+                two_vec_diff+=abs(ret[i]-vec[i]);
+            }
+            return;
+        }
+
+        two_vec_diff=0;
+
+        if(stealer!=NULL){
+            ops_stolen(vec, sca, init, ret);
+            return;
+        }
+
+        if(sell!=NULL){
+            two_vec_diff = sell->multiply(gather_source(vec), &vec[0], sca, init, ret);
+            return;
+        }
+
+        if(push!=NULL){
+            two_vec_diff = push->multiply(&out_links->row_begin[0], &out_links->col_indices[0],
+                                          &out_links->values[0], &vec[0], sca, init, ret);
+            return;
+        }
+
+        if(segments!=NULL){
+            #pragma omp parallel shared(vec, ret) private(i) reduction(+: two_vec_diff)
+            {
+                const T *x = gather_source(vec);
+                #pragma omp for schedule(runtime)
+                for(i=0; i<this->row; i++){
+                    ret[i] = init;
+                }
+                segments->multiply_add(x, sca, ret);
+                #pragma omp for schedule(runtime)
+                for(i=0; i<this->row; i++){
+                    two_vec_diff += abs(ret[i]-vec[i]);
+                }
+            }
+            return;
+        }
+
+        if(profile!=NULL){
+            ops_profiled(vec, sca, init, ret);
+            return;
+        }
+
+        // Parallelised for loop. Zero rows have an empty range, no need to skip them.
+        #pragma omp parallel shared(row_begin, values, vec, col_indices, ret) \
+                private(i, l) reduction(+: two_vec_diff)
+        {
+            const T *x = gather_source(vec);
+            #pragma omp for schedule(runtime)
+            for(i=0; i<this->row; i++){
+                ret[i] = init;
+                // Matrix multiplication
+                for(l=row_begin[i]; l<row_begin[i+1]; l++){
+                    // While multiplying, also multiply with the scaler
+                    ret[i] += (values[l] * x[col_indices[l]] * sca);
+                }
+                // Log vector difference
+                two_vec_diff+=abs(ret[i]-vec[i]);
+            }
+        }
+    }
 };
 
 #endif
\ No newline at end of file
@@ -5,6 +5,8 @@
 #include <vector>
 #include <string>
 #include <sstream>
+#include <charconv>
+#include <algorithm>
 
 // Uncomment when building for production (disables assert)
 // #define NDEBUG
@@ -13,15 +15,106 @@
 using namespace std;
 typedef unsigned int uint;
 
-// Convert a vector to vector of strings
+// Longest text to_chars writes for a number (shortest round trip double is 24)
+#define CSV_NUMBER_MAX 32
+// Numbers formatted between buffer size checks
+#define CSV_FORMAT_BLOCK 4096
+// Bytes of text parsed by a single task
+#define CSV_PARSE_CHUNK (1<<20)
+
+// Append shortest text that reads back as exactly the same value
+// (to_string keeps only 6 decimals of a double)
 template<typename T>
-inline vector<string> vector_to_string(const vector<T> &vec){
-    vector<string> ret;
-    transform(vec.begin(), vec.end(), back_inserter(ret),
-                   [&](T d) { return to_string(d); } );
+inline void append_number(string &buf, T v){
+    char tmp[CSV_NUMBER_MAX];
+    char *end = to_chars(tmp, tmp+CSV_NUMBER_MAX, v).ptr;
+    buf.append(tmp, end);
+}
+
+template<typename T>
+inline string number_to_string(T v){
+    string ret;
+    append_number(ret, v);
     return ret;
 }
 
+// Append vector elements separated by delim. Numbers are formatted in place
+// at the end of buf, without a string per element.
+template<typename T, typename A>
+inline void append_joined(string &buf, const vector<T, A> &vec, char delim){
+    size_t used = buf.size();
+    for(size_t b=0; b<vec.size(); b+=CSV_FORMAT_BLOCK){
+        size_t e = min(vec.size(), b+CSV_FORMAT_BLOCK);
+        // Room for the whole block, trimmed to the written size afterwards
+        buf.resize(used+(e-b)*(CSV_NUMBER_MAX+1));
+        char *p = &buf[used];
+        for(size_t i=b; i<e; i++){
+            if(i>0){
+                *p++ = delim;
+            }
+            p = to_chars(p, p+CSV_NUMBER_MAX, vec[i]).ptr;
+        }
+        used = p-&buf[0];
+        buf.resize(used);
+    }
+}
+
+// Parse numbers separated by delim into ret. Text is split into chunks at
+// delimiters, values of every chunk are counted, then chunks are parsed in
+// parallel straight into their own range of ret. Returns false on text that
+// is not a number or a missing delimiter.
+template<typename T>
+inline bool parse_numbers(const string &str, char delim, vector<T> &ret){
+    ret.clear();
+    if(str.empty()){
+        return true;
+    }
+    long long n = str.size(), chunks = n/CSV_PARSE_CHUNK+1, k;
+    vector<size_t> bounds(chunks+1, n), first(chunks+1, 0);
+    bounds[0] = 0;
+    for(k=1; k<chunks; k++){
+        // Chunks start after a delimiter
+        size_t b = str.find(delim, max<size_t>(n*k/chunks, bounds[k-1]));
+        bounds[k] = b==string::npos ? n : b+1;
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for(k=0; k<chunks; k++){
+        first[k+1] = count(str.begin()+bounds[k], str.begin()+bounds[k+1], delim);
+    }
+    // Every delimiter ends a value, and the last value has none
+    for(k=0; k<chunks; k++){
+        first[k+1] += first[k];
+    }
+    ret.resize(first[chunks]+1);
+    vector<char> chunk_ok(chunks, 1);
+    #pragma omp parallel for schedule(dynamic)
+    for(k=0; k<chunks; k++){
+        const char *p = str.data()+bounds[k], *end = str.data()+bounds[k+1];
+        size_t idx = first[k], last = k==chunks-1 ? first[k+1]+1 : first[k+1];
+        // Chunk stops at its first error
+        while(p<end && idx<last){
+            from_chars_result r = from_chars(p, end, ret[idx]);
+            if(r.ec!=errc()){
+                chunk_ok[k] = 0;
+                break;
+            }
+            idx++;
+            p = r.ptr;
+            if(p<end){
+                if(*p!=delim){
+                    chunk_ok[k] = 0;
+                    break;
+                }
+                p++;
+            }
+        }
+        if(p<end){
+            chunk_ok[k] = 0;
+        }
+    }
+    return count(chunk_ok.begin(), chunk_ok.end(), 0)==0;
+}
+
 // Convert string to vector of strings by dividing with delimeter
 inline vector<string> string_to_svector(const string &str, const string &delimiter){
     vector<string> ret;
@@ -37,33 +130,21 @@ inline vector<string> string_to_svector(const string &str, const string &delimit
     return ret;
 }
 
-// Convert string to vector of doubles by dividing with delimeter
+// Convert string to vector of doubles by dividing with delimeter, empty if malformed
 inline vector<double> string_to_dvector(const string &str, const string &delimiter){
     vector<double> ret;
-    size_t last = 0;
-    size_t next = 0;
-    while ((next = str.find(delimiter, last)) != string::npos) {
-        string temp = str.substr(last, next-last);
-        ret.push_back(stod(temp));
-        last = next + 1;
+    if(!parse_numbers<double>(str, delimiter[0], ret)){
+        ret.clear();
     }
-    string temp = str.substr(last);
-    ret.push_back(stod(temp));
     return ret;
 }
 
-// Convert string to vector of unsigned integers by dividing with delimeter
+// Convert string to vector of unsigned integers by dividing with delimeter, empty if malformed
 inline vector<unsigned int> string_to_uivector(const string &str, const string &delimiter){
     vector<unsigned int> ret;
-    size_t last = 0;
-    size_t next = 0;
-    while ((next = str.find(delimiter, last)) != string::npos) {
-        string temp = str.substr(last, next-last);
-        ret.push_back(stoul(temp));
-        last = next + 1;
+    if(!parse_numbers<unsigned int>(str, delimiter[0], ret)){
+        ret.clear();
     }
-    string temp = str.substr(last);
-    ret.push_back(stoi(temp));
     return ret;
 }
 
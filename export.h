@@ -0,0 +1,239 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <numeric>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+#include <omp.h>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+#include "csv.h"
+#include "trace.h"
+
+using namespace std;
+typedef unsigned int uint;
+
+// Binary rank vector layout (native endianness):
+// char[4] magic "PRRV", uint version, uint count, uint element size (8),
+// then count doubles. Element i is the score of node i, in the order of node
+// ids of the matrix (names of a snapshot or a csv written by save).
+#define RANKS_MAGIC "PRRV"
+#define RANKS_VERSION 1
+// Lines of the sorted csv formatted between writes
+#define EXPORT_CSV_BLOCK (1<<20)
+
+inline bool write_rank_binary(const string &filename, const vector<double> &ranks){
+    string tmp = filename + ".tmp";
+    uint header[3] = {RANKS_VERSION, (uint)ranks.size(), sizeof(double)};
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if(f==NULL){
+        return false;
+    }
+    bool ok = fwrite(RANKS_MAGIC, 1, 4, f)==4
+        && fwrite(header, sizeof(uint), 3, f)==3
+        && fwrite(ranks.data(), sizeof(double), ranks.size(), f)==ranks.size();
+    ok = (fclose(f)==0) && ok;
+    return ok && rename(tmp.c_str(), filename.c_str())==0;
+}
+
+// Returns false if file is missing or not a rank vector
+inline bool read_rank_binary(const string &filename, vector<double> &ranks){
+    char magic[4];
+    uint header[3];
+    FILE *f = fopen(filename.c_str(), "rb");
+    if(f==NULL){
+        return false;
+    }
+    bool ok = fread(magic, 1, 4, f)==4 && memcmp(magic, RANKS_MAGIC, 4)==0
+        && fread(header, sizeof(uint), 3, f)==3 && header[0]==RANKS_VERSION && header[2]==sizeof(double);
+    if(ok){
+        ranks.resize(header[1]);
+        ok = fread(ranks.data(), sizeof(double), ranks.size(), f)==ranks.size();
+    }
+    fclose(f);
+    return ok;
+}
+
+// Node ids by decreasing score (ties by id). Every thread sorts a block, then
+// blocks are merged pairwise, merges of a round in parallel.
+inline vector<uint> sorted_by_score(const vector<double> &ranks){
+    vector<uint> order(ranks.size());
+    iota(order.begin(), order.end(), 0);
+    auto higher = [&ranks](uint a, uint b){
+        return ranks[a]>ranks[b] || (ranks[a]==ranks[b] && a<b);
+    };
+    int parts = max(1, min<int>(omp_get_max_threads(), ranks.size()/65536+1));
+    vector<size_t> bound(parts+1);
+    for(int p=0; p<=parts; p++){
+        bound[p] = order.size()*p/parts;
+    }
+    int p;
+    #pragma omp parallel for schedule(static, 1) num_threads(parts)
+    for(p=0; p<parts; p++){
+        sort(order.begin()+bound[p], order.begin()+bound[p+1], higher);
+    }
+    for(int width=1; width<parts; width*=2){
+        #pragma omp parallel for schedule(static, 1)
+        for(p=0; p<parts; p+=2*width){
+            if(p+width<parts){
+                inplace_merge(order.begin()+bound[p], order.begin()+bound[p+width],
+                              order.begin()+bound[min(p+2*width, parts)], higher);
+            }
+        }
+    }
+    return order;
+}
+
+// Full vector as "No.,Nodes,Scores" lines by decreasing score, like result.csv.
+// Lines are formatted in blocks, every thread formats a slice of the block into
+// its own buffer, then the buffers are written in order.
+inline bool write_sorted_csv(const string &filename, const vector<string> &names, const vector<double> &ranks){
+    assert(names.size()==ranks.size());
+    vector<uint> order = sorted_by_score(ranks);
+    FILE *f = fopen(filename.c_str(), "wb");
+    if(f==NULL){
+        return false;
+    }
+    bool ok = fputs("No.,Nodes,Scores\n", f)>=0;
+    int nthreads = omp_get_max_threads();
+    vector<string> bufs(nthreads);
+    for(size_t b=0; b<order.size() && ok; b+=EXPORT_CSV_BLOCK){
+        size_t e = min(order.size(), b+EXPORT_CSV_BLOCK);
+        #pragma omp parallel num_threads(nthreads)
+        {
+            int tid = omp_get_thread_num(), nt = omp_get_num_threads();
+            string &buf = bufs[tid];
+            buf.clear();
+            for(size_t k=b+(e-b)*tid/nt; k<b+(e-b)*(tid+1)/nt; k++){
+                append_number(buf, k+1);
+                buf += ',';
+                buf += names[order[k]];
+                buf += ',';
+                append_number(buf, ranks[order[k]]);
+                buf += '\n';
+            }
+        }
+        for(const string &buf : bufs){
+            ok = ok && fwrite(buf.data(), 1, buf.size(), f)==buf.size();
+        }
+    }
+    ok = (fclose(f)==0) && ok;
+    return ok;
+}
+
+// One export request. Names are shared, so the matrix can be deleted (or the
+// next job started) before the export is written.
+struct RankExport{
+    shared_ptr<const vector<string>> names;
+    vector<double> ranks;
+    string binary;     // Rank vector file, empty to skip
+    string sorted_csv; // Sorted csv, empty to skip (needs names)
+};
+
+// Files of a full rank vector export, empty ones are skipped
+struct ExportOptions{
+    string binary;
+    string sorted_csv;
+
+    bool enabled() const{
+        return !binary.empty() || !sorted_csv.empty();
+    }
+};
+
+// Writes exports on a background thread in order of submission, so the solver
+// can go on (next batch job) while output is formatted and flushed. At most
+// max_pending exports wait, submit blocks beyond that to bound memory.
+class ResultWriter{
+    private:
+    thread worker;
+    mutex mtx;
+    condition_variable cv;
+    deque<RankExport> queue;
+    bool busy=false, stop=false;
+    uint max_pending;
+    uint failures=0;
+
+    void loop(){
+        unique_lock<mutex> lock(mtx);
+        while(true){
+            cv.wait(lock, [this]{ return !queue.empty() || stop; });
+            if(queue.empty()){
+                break;
+            }
+            RankExport job = move(queue.front());
+            queue.pop_front();
+            busy = true;
+            cv.notify_all();
+            lock.unlock();
+            bool ok = true;
+            {
+                TraceScope export_phase("export");
+                if(!job.binary.empty() && !write_rank_binary(job.binary, job.ranks)){
+                    cerr << "Cannot write " << job.binary << endl;
+                    ok = false;
+                }
+                if(!job.sorted_csv.empty() && (job.names==NULL || !write_sorted_csv(job.sorted_csv, *job.names, job.ranks))){
+                    cerr << "Cannot write " << job.sorted_csv << endl;
+                    ok = false;
+                }
+            }
+            lock.lock();
+            failures += !ok;
+            busy = false;
+            cv.notify_all();
+        }
+    }
+
+    public:
+    ResultWriter(uint max_pending=2) : max_pending(max(max_pending, 1u)){
+        worker = thread(&ResultWriter::loop, this);
+    }
+
+    // Writes everything submitted before returning
+    ~ResultWriter(){
+        {
+            lock_guard<mutex> lock(mtx);
+            stop = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    template<typename A>
+    void submit(const ExportOptions &opt, const shared_ptr<const vector<string>> &names, const vector<double, A> &ranks){
+        RankExport job;
+        job.names = names;
+        job.ranks.assign(ranks.begin(), ranks.end());
+        job.binary = opt.binary;
+        job.sorted_csv = opt.sorted_csv;
+        submit(move(job));
+    }
+
+    void submit(RankExport &&job){
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [this]{ return queue.size()<max_pending; });
+        queue.push_back(move(job));
+        cv.notify_all();
+    }
+
+    // Block until every submitted export is written. Returns false if any failed.
+    bool flush(){
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [this]{ return queue.empty() && !busy; });
+        return failures==0;
+    }
+};
+
+#endif
@@ -0,0 +1,594 @@
+#ifndef EXTBUILD_H
+#define EXTBUILD_H
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+#include <omp.h>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+#include "snapshot.h"
+#include "input.h"
+#include "trace.h"
+
+using namespace std;
+typedef unsigned int uint;
+
+// External memory graph builder. graph.txt is read in chunks that fit in the
+// memory budget, and every chunk is sorted and written to disk as a run:
+//   1. Names, as (hash, name) sorted by hash. Merged to give each unique name a
+//      dense id, which is its position in hash order.
+//   2. Edges, as (row hash, column hash) sorted by column. Merged to drop self
+//      loops and (optionally) duplicate edges, replace column hashes with ids
+//      and count column degrees, which gives matrix values.
+//   3. Entries (row hash, column id, value) sorted by row. Merged to replace row
+//      hashes with ids, and written directly as snapshot shards.
+// Every merge reads runs sequentially, so only buffers are kept in memory.
+// A line "a b" is an entry in row a, column b, like parse().
+
+// Names are identified by a 64 bit hash until ids are assigned (FNV-1a, then mixed)
+inline unsigned long long name_hash(const string &s){
+    unsigned long long h = 1469598103934665603ULL;
+    for(uint i=0; i<s.size(); i++){
+        h = (h ^ (unsigned char)s[i]) * 1099511628211ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+struct ExtEdge{
+    unsigned long long row, col;   // Name hashes
+};
+
+struct ExtEntry{
+    unsigned long long row;        // Name hash
+    uint col;                      // Node id
+    double value;
+};
+
+// Run orders: edges by column, entries by row
+inline bool edge_col_less(const ExtEdge &a, const ExtEdge &b){
+    return a.col<b.col || (a.col==b.col && a.row<b.row);
+}
+
+inline bool entry_row_less(const ExtEntry &a, const ExtEntry &b){
+    return a.row<b.row || (a.row==b.row && a.col<b.col);
+}
+
+struct ExtBuildOptions{
+    unsigned long long budget = 1ULL<<30;     // Bytes for buffers of every phase
+    unsigned long long shard_bytes = 64ULL<<20;
+    bool collapse = true;                     // Drop repeated edges (keep multi edges otherwise)
+    string tmp_prefix;                        // Run files are named tmp_prefix + number
+};
+
+struct ExtBuildStats{
+    unsigned long long lines=0, nodes=0, edges=0;
+    unsigned long long self_loops=0, duplicates=0, collisions=0;
+    uint runs=0;
+};
+
+// Buffered sequential reader of a run of fixed size records
+template<typename T>
+class RunReader{
+    private:
+    FILE *f;
+    vector<T> buf;
+    size_t pos=0, len=0;
+
+    void fill(){
+        len = f!=NULL ? fread(buf.data(), sizeof(T), buf.size(), f) : 0;
+        pos = 0;
+    }
+
+    public:
+    // Buffer holds up to "records", but never more than the run
+    RunReader(const string &filename, size_t records){
+        f = fopen(filename.c_str(), "rb");
+        if(f!=NULL && fseek(f, 0, SEEK_END)==0){
+            records = min<size_t>(records, ftell(f)/sizeof(T));
+            rewind(f);
+        }
+        buf.resize(max<size_t>(records, 1));
+        fill();
+    }
+
+    ~RunReader(){
+        if(f!=NULL){
+            fclose(f);
+        }
+    }
+
+    bool empty() const{
+        return pos>=len;
+    }
+
+    const T &top() const{
+        return buf[pos];
+    }
+
+    void pop(){
+        if(++pos>=len){
+            fill();
+        }
+    }
+};
+
+template<typename T>
+inline bool write_run(const string &filename, const vector<T> &recs){
+    FILE *f = fopen(filename.c_str(), "wb");
+    if(f==NULL){
+        return false;
+    }
+    bool ok = fwrite(recs.data(), sizeof(T), recs.size(), f)==recs.size();
+    return (fclose(f)==0) && ok;
+}
+
+// K-way merge of sorted runs. out is called for every record in less order.
+// Budget is split between the read buffers of all runs.
+template<typename T, typename Less, typename Out>
+inline void merge_runs(const vector<string> &files, unsigned long long budget, Less less, Out out){
+    size_t per_run = budget/sizeof(T)/max<size_t>(files.size(), 1);
+    vector<unique_ptr<RunReader<T>>> readers;
+    for(uint r=0; r<files.size(); r++){
+        readers.emplace_back(new RunReader<T>(files[r], per_run));
+    }
+    // Min heap of run numbers by their current record
+    auto greater_top = [&readers, &less](uint a, uint b){
+        return less(readers[b]->top(), readers[a]->top());
+    };
+    priority_queue<uint, vector<uint>, decltype(greater_top)> heap(greater_top);
+    for(uint r=0; r<readers.size(); r++){
+        if(!readers[r]->empty()){
+            heap.push(r);
+        }
+    }
+    while(!heap.empty()){
+        uint r = heap.top();
+        heap.pop();
+        out(readers[r]->top());
+        readers[r]->pop();
+        if(!readers[r]->empty()){
+            heap.push(r);
+        }
+    }
+}
+
+// Most runs merged at once, more would exhaust file descriptors and buffers
+#define EXT_MAX_FANIN 128
+
+// Name runs hold variable length records: hash, length, characters
+class NameRunReader{
+    private:
+    FILE *f;
+    vector<char> io_buf;
+    bool has=false;
+
+    public:
+    unsigned long long hash;
+    string name;
+
+    NameRunReader(const string &filename, size_t bytes){
+        f = fopen(filename.c_str(), "rb");
+        if(f!=NULL && fseek(f, 0, SEEK_END)==0){
+            bytes = min<size_t>(bytes, ftell(f));
+            rewind(f);
+        }
+        io_buf.resize(max<size_t>(bytes, 4096));
+        if(f!=NULL){
+            setvbuf(f, io_buf.data(), _IOFBF, io_buf.size());
+        }
+        pop();
+    }
+
+    ~NameRunReader(){
+        if(f!=NULL){
+            fclose(f);
+        }
+    }
+
+    bool empty() const{
+        return !has;
+    }
+
+    void pop(){
+        uint len;
+        has = f!=NULL && fread(&hash, sizeof(hash), 1, f)==1 && fread(&len, sizeof(len), 1, f)==1;
+        if(has){
+            name.resize(len);
+            has = len==0 || fread(&name[0], 1, len, f)==len;
+        }
+    }
+};
+
+class ExtGraphBuilder{
+    private:
+    ExtBuildOptions opt;
+    vector<string> name_runs, edge_runs, entry_runs;
+    string hash_file, names_file;
+
+    string run_name(){
+        return opt.tmp_prefix + to_string(stats.runs++);
+    }
+
+    // Chunk names are kept unique in a map, sorted when written
+    bool flush_names(unordered_map<unsigned long long, string> &names){
+        vector<pair<unsigned long long, const string *>> sorted;
+        sorted.reserve(names.size());
+        for(auto it=names.begin(); it!=names.end(); ++it){
+            sorted.push_back({it->first, &it->second});
+        }
+        sort(sorted.begin(), sorted.end());
+        string file = run_name();
+        FILE *f = fopen(file.c_str(), "wb");
+        if(f==NULL){
+            return false;
+        }
+        bool ok = true;
+        for(uint i=0; i<sorted.size() && ok; i++){
+            uint len = sorted[i].second->size();
+            ok = fwrite(&sorted[i].first, sizeof(unsigned long long), 1, f)==1
+                && fwrite(&len, sizeof(len), 1, f)==1
+                && fwrite(sorted[i].second->data(), 1, len, f)==len;
+        }
+        ok = (fclose(f)==0) && ok;
+        name_runs.push_back(file);
+        names.clear();
+        return ok;
+    }
+
+    // Merge groups of runs until at most EXT_MAX_FANIN are left
+    template<typename T, typename Less>
+    bool limit_runs(vector<string> &runs, Less less){
+        bool ok = true;
+        while(ok && runs.size()>EXT_MAX_FANIN){
+            vector<string> merged;
+            for(size_t g=0; g<runs.size() && ok; g+=EXT_MAX_FANIN){
+                vector<string> group(runs.begin()+g, runs.begin()+min(runs.size(), g+EXT_MAX_FANIN));
+                string file = run_name();
+                FILE *f = fopen(file.c_str(), "wb");
+                ok = f!=NULL;
+                if(ok){
+                    vector<T> out;
+                    size_t out_cap = max<size_t>(opt.budget/2/sizeof(T), 1);
+                    merge_runs<T>(group, opt.budget/2, less, [&](const T &rec){
+                        out.push_back(rec);
+                        if(out.size()>=out_cap){
+                            ok = ok && fwrite(out.data(), sizeof(T), out.size(), f)==out.size();
+                            out.clear();
+                        }
+                    });
+                    ok = ok && fwrite(out.data(), sizeof(T), out.size(), f)==out.size();
+                    ok = (fclose(f)==0) && ok;
+                }
+                for(uint r=0; r<group.size(); r++){
+                    remove(group[r].c_str());
+                }
+                merged.push_back(file);
+            }
+            runs.swap(merged);
+        }
+        return ok;
+    }
+
+    bool flush_edges(vector<ExtEdge> &edges){
+        sort(edges.begin(), edges.end(), edge_col_less);
+        string file = run_name();
+        edge_runs.push_back(file);
+        bool ok = write_run(file, edges);
+        edges.clear();
+        return ok;
+    }
+
+    bool flush_entries(vector<ExtEntry> &entries){
+        sort(entries.begin(), entries.end(), entry_row_less);
+        string file = run_name();
+        entry_runs.push_back(file);
+        bool ok = write_run(file, entries);
+        entries.clear();
+        return ok;
+    }
+
+    // Phase 1: read input, write name and edge runs
+    bool read_runs(const string &filename){
+        TokenReader in(filename);
+        // Half of the budget for edges, half for names (with map overhead)
+        size_t edge_cap = max<size_t>(opt.budget/2/sizeof(ExtEdge), 1);
+        unsigned long long name_cap = opt.budget/2, name_bytes = 0;
+        vector<ExtEdge> edges;
+        unordered_map<unsigned long long, string> names;
+        string t[2];
+        bool ok = true;
+        while(ok && in.next(t[0]) && in.next(t[1])){
+            if(stats.lines%1000000==0){
+                trace_log(LOG_PROGRESS) << stats.lines << endl;
+            }
+            stats.lines++;
+            ExtEdge e;
+            e.row = name_hash(t[0]);
+            e.col = name_hash(t[1]);
+            for(int k=0; k<2; k++){
+                unsigned long long h = k==0 ? e.row : e.col;
+                auto it = names.find(h);
+                if(it==names.end()){
+                    names.emplace(h, t[k]);
+                    name_bytes += t[k].size()+64;
+                }else if(it->second!=t[k]){
+                    stats.collisions++;
+                }
+            }
+            edges.push_back(e);
+            if(edges.size()>=edge_cap){
+                ok = flush_edges(edges);
+            }
+            if(ok && name_bytes>=name_cap){
+                ok = flush_names(names);
+                name_bytes = 0;
+            }
+        }
+        if(ok && !edges.empty()){
+            ok = flush_edges(edges);
+        }
+        if(ok && !names.empty()){
+            ok = flush_names(names);
+        }
+        if(in.failed()){
+            cout << "Cannot read graph: " << filename << endl;
+            return false;
+        }
+        return ok;
+    }
+
+    // Merge name runs, calling out(hash, name) once per hash in hash order
+    template<typename Out>
+    bool merge_name_runs(const vector<string> &runs, Out out){
+        vector<unique_ptr<NameRunReader>> readers;
+        for(uint r=0; r<runs.size(); r++){
+            readers.emplace_back(new NameRunReader(runs[r], opt.budget/max<size_t>(runs.size(), 1)));
+        }
+        auto greater_top = [&readers](uint a, uint b){
+            return readers[a]->hash>readers[b]->hash;
+        };
+        priority_queue<uint, vector<uint>, decltype(greater_top)> heap(greater_top);
+        for(uint r=0; r<readers.size(); r++){
+            if(!readers[r]->empty()){
+                heap.push(r);
+            }
+        }
+        bool ok = true, has_last = false;
+        unsigned long long last = 0;
+        string last_name;
+        while(ok && !heap.empty()){
+            uint r = heap.top();
+            heap.pop();
+            NameRunReader &rd = *readers[r];
+            if(!has_last || rd.hash!=last){
+                ok = out(rd.hash, rd.name);
+                last = rd.hash;
+                last_name = rd.name;
+                has_last = true;
+            }else if(rd.name!=last_name){
+                // Different names with equal hashes share a node
+                stats.collisions++;
+            }
+            rd.pop();
+            if(!rd.empty()){
+                heap.push(r);
+            }
+        }
+        return ok;
+    }
+
+    // Phase 2: merge name runs into sorted unique hashes (id order) and names
+    bool merge_names(){
+        bool ok = true;
+        // Too many runs are first merged into fewer, larger name runs
+        while(ok && name_runs.size()>EXT_MAX_FANIN){
+            vector<string> merged;
+            for(size_t g=0; g<name_runs.size() && ok; g+=EXT_MAX_FANIN){
+                vector<string> group(name_runs.begin()+g, name_runs.begin()+min(name_runs.size(), g+EXT_MAX_FANIN));
+                string file = run_name();
+                FILE *f = fopen(file.c_str(), "wb");
+                ok = f!=NULL && merge_name_runs(group, [f](unsigned long long hash, const string &name){
+                    uint len = name.size();
+                    return fwrite(&hash, sizeof(hash), 1, f)==1 && fwrite(&len, sizeof(len), 1, f)==1
+                        && fwrite(name.data(), 1, len, f)==len;
+                });
+                ok = f!=NULL && (fclose(f)==0) && ok;
+                for(uint r=0; r<group.size(); r++){
+                    remove(group[r].c_str());
+                }
+                merged.push_back(file);
+            }
+            name_runs.swap(merged);
+        }
+
+        hash_file = run_name();
+        names_file = run_name();
+        FILE *fh = fopen(hash_file.c_str(), "wb"), *fn = fopen(names_file.c_str(), "wb");
+        ok = ok && fh!=NULL && fn!=NULL && merge_name_runs(name_runs, [this, fh, fn](unsigned long long hash, const string &name){
+            stats.nodes++;
+            return fwrite(&hash, sizeof(hash), 1, fh)==1
+                && fwrite(name.data(), 1, name.size(), fn)==name.size() && fputc('\n', fn)!=EOF;
+        });
+        ok = fh!=NULL && (fclose(fh)==0) && ok;
+        ok = fn!=NULL && (fclose(fn)==0) && ok;
+        return ok;
+    }
+
+    // Phase 3: merge edges by column, drop self loops and duplicates, assign
+    // column ids and values, write entry runs
+    bool merge_edges(){
+        if(!limit_runs<ExtEdge>(edge_runs, edge_col_less)){
+            return false;
+        }
+        RunReader<unsigned long long> ids(hash_file, opt.budget/4/sizeof(unsigned long long));
+        uint col_id = 0;
+        size_t entry_cap = max<size_t>(opt.budget/2/sizeof(ExtEntry), 1);
+        vector<ExtEntry> entries;
+        // Entries of current column start here. Runs are only written between columns.
+        size_t group = 0;
+        bool has_last = false, ok = true;
+        ExtEdge last;
+
+        auto close_group = [&](){
+            for(size_t j=group; j<entries.size(); j++){
+                entries[j].value = 1.0/(entries.size()-group);
+            }
+            if(entries.size()>=entry_cap){
+                ok = ok && flush_entries(entries);
+            }
+            group = entries.size();
+        };
+
+        merge_runs<ExtEdge>(edge_runs, opt.budget/4, edge_col_less,
+            [&](const ExtEdge &e){
+                if(e.row==e.col){
+                    stats.self_loops++;
+                    return;
+                }
+                if(has_last && e.col==last.col && e.row==last.row){
+                    stats.duplicates++;
+                    if(opt.collapse){
+                        return;
+                    }
+                }
+                if(!has_last || e.col!=last.col){
+                    close_group();
+                    // Ids are positions in hash order
+                    while(!ids.empty() && ids.top()<e.col){
+                        ids.pop();
+                        col_id++;
+                    }
+                    assert(!ids.empty() && ids.top()==e.col);
+                }
+                entries.push_back({e.row, col_id, 0});
+                stats.edges++;
+                last = e;
+                has_last = true;
+            });
+        close_group();
+        if(ok && !entries.empty()){
+            ok = flush_entries(entries);
+        }
+        return ok;
+    }
+
+    // Phase 4: merge entries by row, assign row ids and write snapshot shards
+    bool write_shards(const string &output){
+        if(!limit_runs<ExtEntry>(entry_runs, entry_row_less)){
+            return false;
+        }
+        SnapshotWriter out(output, stats.nodes, stats.nodes);
+        RunReader<unsigned long long> ids(hash_file, opt.budget/4/sizeof(unsigned long long));
+        uint row_id = 0, first_row = 0;
+        vector<uint> row_begin(1, 0), col_indices;
+        vector<double> values;
+
+        // Close rows up to (not including) row id "until", then write shard if full
+        auto close_rows = [&](uint until){
+            while(row_id<until){
+                row_begin.push_back(col_indices.size());
+                row_id++;
+                if(snapshot_shard_bytes(row_id-first_row, col_indices.size())>=opt.shard_bytes){
+                    out.add_shard(first_row, row_id-first_row, row_begin.data(), col_indices.data(), values.data());
+                    first_row = row_id;
+                    row_begin.assign(1, 0);
+                    col_indices.clear();
+                    values.clear();
+                }
+            }
+        };
+
+        // Whether ids.top() is the hash of current row
+        bool first = true;
+        merge_runs<ExtEntry>(entry_runs, opt.budget/2, entry_row_less,
+            [&](const ExtEntry &e){
+                uint id = row_id;
+                if(first || ids.top()!=e.row){
+                    // Find id of this row, rows before it are closed (possibly empty)
+                    while(!ids.empty() && ids.top()<e.row){
+                        ids.pop();
+                        id++;
+                    }
+                    assert(!ids.empty() && ids.top()==e.row);
+                    close_rows(id);
+                    first = false;
+                }
+                col_indices.push_back(e.col);
+                values.push_back(e.value);
+            });
+        close_rows(stats.nodes);
+        if(row_id>first_row){
+            out.add_shard(first_row, row_id-first_row, row_begin.data(), col_indices.data(), values.data());
+        }
+
+        // Names are already in id order
+        ifstream names(names_file);
+        string name;
+        while(getline(names, name)){
+            out.add_name(name);
+        }
+        return out.finish();
+    }
+
+    void remove_runs(){
+        for(const vector<string> *runs : {&name_runs, &edge_runs, &entry_runs}){
+            for(uint r=0; r<runs->size(); r++){
+                remove((*runs)[r].c_str());
+            }
+        }
+        remove(hash_file.c_str());
+        remove(names_file.c_str());
+    }
+
+    public:
+    ExtBuildStats stats;
+
+    ExtGraphBuilder(const ExtBuildOptions &opt) : opt(opt){}
+
+    // Build snapshot output from edge list file. Temporary runs are removed afterwards.
+    bool build(const string &filename, const string &output){
+        TraceScope runs_phase("runs");
+        trace_log(LOG_INFO) << "Writing sorted runs..." << endl;
+        bool ok = read_runs(filename);
+        trace_log(LOG_INFO) << "Time passed: " << runs_phase.stop() << endl;
+
+        TraceScope names_phase("merge_names");
+        trace_log(LOG_INFO) << "Merging names..." << endl;
+        ok = ok && merge_names();
+        trace_log(LOG_INFO) << "Total unique sites: " << stats.nodes << endl;
+        trace_log(LOG_INFO) << "Time passed: " << names_phase.stop() << endl;
+
+        TraceScope edges_phase("merge_edges");
+        trace_log(LOG_INFO) << "Merging edges..." << endl;
+        ok = ok && merge_edges();
+        trace_log(LOG_INFO) << "Time passed: " << edges_phase.stop() << endl;
+
+        TraceScope shards_phase("write_shards");
+        trace_log(LOG_INFO) << "Writing shards..." << endl;
+        ok = ok && write_shards(output);
+        trace_log(LOG_INFO) << "Time passed: " << shards_phase.stop() << endl;
+
+        remove_runs();
+        cout << "Lines: " << stats.lines << ", edges: " << stats.edges << ", self loops dropped: " << stats.self_loops
+             << ", duplicates " << (opt.collapse ? "dropped: " : "kept: ") << stats.duplicates << endl;
+        if(stats.collisions>0){
+            cout << "Warning: " << stats.collisions << " names share a hash with another name" << endl;
+        }
+        return ok;
+    }
+};
+
+#endif
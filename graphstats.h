@@ -0,0 +1,167 @@
+#ifndef GRAPHSTATS_H
+#define GRAPHSTATS_H
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <omp.h>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+using namespace std;
+typedef unsigned int uint;
+
+// Degree histogram bins: bin 0 is degree 0, bin b is [2^(b-1), 2^b)
+#define STATS_BINS 33
+
+inline uint degree_bin(unsigned long long d){
+    uint b = 0;
+    while(d>0){
+        d >>= 1;
+        b++;
+    }
+    return b;
+}
+
+// Degree and structure statistics of the adjacency lists built by parse.
+// link_to[i] holds the nodes i links to, link_by[i] the nodes linking to i
+// (row i of the matrix). Every thread accumulates its own counters and
+// histograms over a range of nodes, which are summed at the end.
+class GraphStats{
+    public:
+    unsigned long long nodes = 0, edges = 0;
+    unsigned long long self_loops = 0, duplicates = 0;
+    // No out-links (rank leaks from these)
+    unsigned long long dangling = 0;
+    // No links from or to another node (self loops only)
+    unsigned long long isolated = 0;
+    unsigned long long max_out = 0, max_in = 0;
+    vector<unsigned long long> out_hist, in_hist;
+    // Nonzeros of equal row blocks, as the static schedule splits rows
+    vector<unsigned long long> part_nnz;
+    double time = 0;
+
+    void collect(const vector<vector<int>> &link_to, const vector<vector<int>> &link_by, uint parts){
+        double tim_st = omp_get_wtime();
+        int nthreads = omp_get_max_threads();
+        long long i;
+        nodes = link_to.size();
+        out_hist.assign(STATS_BINS, 0);
+        in_hist.assign(STATS_BINS, 0);
+        vector<vector<unsigned long long>> t_out(nthreads, vector<unsigned long long>(STATS_BINS, 0));
+        vector<vector<unsigned long long>> t_in(nthreads, vector<unsigned long long>(STATS_BINS, 0));
+        unsigned long long e = 0, loops = 0, dup = 0, dang = 0, iso = 0, mo = 0, mi = 0;
+
+        #pragma omp parallel num_threads(nthreads) reduction(+: e, loops, dup, dang, iso) reduction(max: mo, mi)
+        {
+            int tid = omp_get_thread_num();
+            vector<int> sorted;
+            #pragma omp for schedule(dynamic, 4096)
+            for(i=0; i<(long long)nodes; i++){
+                const vector<int> &out = link_to[i];
+                unsigned long long d_out = out.size(), d_in = link_by[i].size(), self = 0;
+                // Duplicates are found in a sorted copy, the lists keep their order
+                sorted.assign(out.begin(), out.end());
+                sort(sorted.begin(), sorted.end());
+                for(uint l=0; l<sorted.size(); l++){
+                    self += sorted[l]==i;
+                    dup += l>0 && sorted[l]==sorted[l-1];
+                }
+                e += d_out;
+                loops += self;
+                dang += d_out==0;
+                iso += d_out==self && d_in==self;
+                mo = max(mo, d_out);
+                mi = max(mi, d_in);
+                t_out[tid][degree_bin(d_out)]++;
+                t_in[tid][degree_bin(d_in)]++;
+            }
+        }
+        edges = e;
+        self_loops = loops;
+        duplicates = dup;
+        dangling = dang;
+        isolated = iso;
+        max_out = mo;
+        max_in = mi;
+        for(int t=0; t<nthreads; t++){
+            for(uint b=0; b<STATS_BINS; b++){
+                out_hist[b] += t_out[t][b];
+                in_hist[b] += t_in[t][b];
+            }
+        }
+
+        parts = max(parts, 1u);
+        part_nnz.assign(parts, 0);
+        #pragma omp parallel for schedule(static)
+        for(i=0; i<parts; i++){
+            unsigned long long first = nodes*i/parts, last = nodes*(i+1)/parts;
+            for(unsigned long long r=first; r<last; r++){
+                part_nnz[i] += link_by[r].size();
+            }
+        }
+        time = omp_get_wtime()-tim_st;
+    }
+
+    double mean_degree() const{
+        return nodes==0 ? 0 : (double)edges/nodes;
+    }
+
+    // Largest partition over the mean, 1 is perfectly balanced
+    double part_imbalance() const{
+        if(part_nnz.empty() || edges==0){
+            return 1;
+        }
+        return (double)*max_element(part_nnz.begin(), part_nnz.end())*part_nnz.size()/edges;
+    }
+
+    void print() const{
+        cout << "Nodes: " << nodes << ", edges: " << edges << ", mean degree: " << mean_degree()
+             << ", max out/in degree: " << max_out << "/" << max_in << endl;
+        cout << "Dangling: " << dangling << ", isolated: " << isolated << ", self loops: " << self_loops
+             << ", duplicate edges: " << duplicates << endl;
+        cout << "Partition imbalance (" << part_nnz.size() << " parts): " << part_imbalance() << endl;
+    }
+
+    bool write_json(const string &filename) const{
+        ostringstream out;
+        out.precision(9);
+        // Trailing empty bins are left out
+        auto hist = [&out](const vector<unsigned long long> &h){
+            uint last = h.size();
+            while(last>1 && h[last-1]==0){
+                last--;
+            }
+            out << "[";
+            for(uint b=0; b<last; b++){
+                out << (b ? ", " : "") << "{\"min\": " << (b==0 ? 0 : 1ULL<<(b-1))
+                    << ", \"max\": " << (b==0 ? 0 : (1ULL<<b)-1) << ", \"count\": " << h[b] << "}";
+            }
+            out << "]";
+        };
+        out << "{\n  \"nodes\": " << nodes << ",\n  \"edges\": " << edges
+            << ",\n  \"mean_degree\": " << mean_degree() << ",\n  \"max_out_degree\": " << max_out
+            << ",\n  \"max_in_degree\": " << max_in << ",\n  \"dangling\": " << dangling
+            << ",\n  \"isolated\": " << isolated << ",\n  \"self_loops\": " << self_loops
+            << ",\n  \"duplicate_edges\": " << duplicates << ",\n  \"out_degree_histogram\": ";
+        hist(out_hist);
+        out << ",\n  \"in_degree_histogram\": ";
+        hist(in_hist);
+        out << ",\n  \"partition_nnz\": [";
+        for(uint p=0; p<part_nnz.size(); p++){
+            out << (p ? ", " : "") << part_nnz[p];
+        }
+        out << "],\n  \"partition_imbalance\": " << part_imbalance() << ",\n  \"seconds\": " << time << "\n}\n";
+        ofstream json(filename);
+        json << out.str();
+        json.close();
+        return json.good();
+    }
+};
+
+#endif
@@ -0,0 +1,299 @@
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <string>
+#include <deque>
+#include <cstdio>
+#include <cstring>
+#include <cctype>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+
+// Compressed inputs need their library at build time:
+// -DHAVE_ZLIB -lz for gzip, -DHAVE_ZSTD -lzstd for zstd
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+using namespace std;
+typedef unsigned int uint;
+
+// Decompressed bytes handed over at once, and most chunks waiting to be parsed
+#define INPUT_CHUNK (1<<20)
+#define INPUT_QUEUE 4
+
+enum InputFormat{
+    INPUT_PLAIN,
+    INPUT_GZIP,
+    INPUT_ZSTD
+};
+
+// Detect format by magic bytes, not by extension
+inline InputFormat detect_input_format(const string &filename){
+    unsigned char magic[4] = {0};
+    FILE *f = fopen(filename.c_str(), "rb");
+    if(f==NULL){
+        return INPUT_PLAIN;
+    }
+    size_t n = fread(magic, 1, 4, f);
+    fclose(f);
+    if(n>=2 && magic[0]==0x1f && magic[1]==0x8b){
+        return INPUT_GZIP;
+    }
+    if(n==4 && magic[0]==0x28 && magic[1]==0xb5 && magic[2]==0x2f && magic[3]==0xfd){
+        return INPUT_ZSTD;
+    }
+    return INPUT_PLAIN;
+}
+
+// Reads (and decompresses) a file on a background thread. Chunks are passed
+// through a bounded queue, so decompression overlaps with parsing, and memory
+// stays at INPUT_QUEUE chunks however large the file is.
+class InputStream{
+    private:
+    string filename;
+    InputFormat format;
+    thread worker;
+    mutex mtx;
+    condition_variable cv;
+    deque<string> ready, spare;
+    bool done=false, stop=false;
+
+    // Give a filled chunk to the consumer, waits while queue is full.
+    // Returns false if the consumer is gone.
+    bool push(string &chunk){
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [this]{ return ready.size()<INPUT_QUEUE || stop; });
+        if(stop){
+            return false;
+        }
+        ready.push_back(string());
+        ready.back().swap(chunk);
+        if(!spare.empty()){
+            chunk.swap(spare.front());
+            spare.pop_front();
+        }
+        cv.notify_all();
+        return true;
+    }
+
+    // Read with fn(buf, size) returning bytes read, 0 at end, negative on error
+    template<typename Read>
+    bool pump(Read fn){
+        string chunk;
+        while(true){
+            chunk.resize(INPUT_CHUNK);
+            long n = fn(&chunk[0], chunk.size());
+            if(n<0){
+                return false;
+            }
+            if(n==0){
+                return true;
+            }
+            chunk.resize(n);
+            if(!push(chunk)){
+                return true;
+            }
+        }
+    }
+
+    bool read_plain(){
+        FILE *f = fopen(filename.c_str(), "rb");
+        if(f==NULL){
+            return false;
+        }
+        bool ok = pump([f](char *buf, size_t size){
+            size_t n = fread(buf, 1, size, f);
+            return n==0 && ferror(f) ? -1L : (long)n;
+        });
+        fclose(f);
+        return ok;
+    }
+
+    bool read_gzip(){
+#ifdef HAVE_ZLIB
+        // gzread also continues over concatenated members (pigz, cat a.gz b.gz)
+        gzFile f = gzopen(filename.c_str(), "rb");
+        if(f==NULL){
+            return false;
+        }
+        gzbuffer(f, 1<<18);
+        bool ok = pump([f](char *buf, size_t size){
+            long n = gzread(f, buf, size);
+            // Truncated input ends with 0 and Z_BUF_ERROR, not a clean end
+            int err = Z_OK;
+            if(n==0){
+                gzerror(f, &err);
+            }
+            return err==Z_OK ? n : -1L;
+        });
+        gzclose(f);
+        return ok;
+#else
+        cerr << "gzip input needs a build with -DHAVE_ZLIB -lz" << endl;
+        return false;
+#endif
+    }
+
+    bool read_zstd(){
+#ifdef HAVE_ZSTD
+        FILE *f = fopen(filename.c_str(), "rb");
+        if(f==NULL){
+            return false;
+        }
+        ZSTD_DStream *ds = ZSTD_createDStream();
+        ZSTD_initDStream(ds);
+        string in(ZSTD_DStreamInSize(), '\0');
+        ZSTD_inBuffer input = {in.data(), 0, 0};
+        bool eof = false;
+        // Last result of ZSTD_decompressStream, 0 once a frame is complete
+        size_t left = 0;
+        bool ok = pump([&](char *buf, size_t size){
+            ZSTD_outBuffer output = {buf, size, 0};
+            while(output.pos==0){
+                if(input.pos==input.size){
+                    if(eof){
+                        break;
+                    }
+                    input.size = fread(&in[0], 1, in.size(), f);
+                    input.pos = 0;
+                    if(ferror(f)){
+                        return -1L;
+                    }
+                    eof = input.size==0;
+                    continue;
+                }
+                left = ZSTD_decompressStream(ds, &output, &input);
+                if(ZSTD_isError(left)){
+                    return -1L;
+                }
+            }
+            // End of file inside a frame (truncated input)
+            if(output.pos==0 && left!=0){
+                return -1L;
+            }
+            return (long)output.pos;
+        });
+        ZSTD_freeDStream(ds);
+        fclose(f);
+        return ok;
+#else
+        cerr << "zstd input needs a build with -DHAVE_ZSTD -lzstd" << endl;
+        return false;
+#endif
+    }
+
+    void loop(){
+        bool ok;
+        if(format==INPUT_GZIP){
+            ok = read_gzip();
+        }else if(format==INPUT_ZSTD){
+            ok = read_zstd();
+        }else{
+            ok = read_plain();
+        }
+        lock_guard<mutex> lock(mtx);
+        failed = !ok;
+        done = true;
+        cv.notify_all();
+    }
+
+    public:
+    // Set when the file could not be opened or decompressed, or ends early
+    bool failed=false;
+
+    InputStream(const string &filename) : filename(filename){
+        format = detect_input_format(filename);
+        worker = thread(&InputStream::loop, this);
+    }
+
+    ~InputStream(){
+        {
+            lock_guard<mutex> lock(mtx);
+            stop = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    InputFormat get_format() const{
+        return format;
+    }
+
+    // Next chunk of decompressed bytes, swapped into chunk (its old buffer is
+    // reused by the reader). Returns false at end of input.
+    bool next(string &chunk){
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [this]{ return !ready.empty() || done; });
+        if(ready.empty()){
+            return false;
+        }
+        string old;
+        old.swap(chunk);
+        chunk.swap(ready.front());
+        ready.pop_front();
+        if(spare.size()<INPUT_QUEUE){
+            spare.push_back(string());
+            spare.back().swap(old);
+        }
+        cv.notify_all();
+        return true;
+    }
+};
+
+// Whitespace separated tokens of a (possibly compressed) file
+class TokenReader{
+    private:
+    InputStream in;
+    string chunk;
+    size_t pos=0;
+
+    public:
+    TokenReader(const string &filename) : in(filename){}
+
+    // Read next token. Returns false at end of input.
+    bool next(string &token){
+        token.clear();
+        while(true){
+            if(pos>=chunk.size()){
+                pos = 0;
+                if(!in.next(chunk)){
+                    chunk.clear();
+                    return !token.empty();
+                }
+            }
+            if(token.empty()){
+                while(pos<chunk.size() && isspace((unsigned char)chunk[pos])){
+                    pos++;
+                }
+                if(pos>=chunk.size()){
+                    continue;
+                }
+            }
+            size_t beg = pos;
+            while(pos<chunk.size() && !isspace((unsigned char)chunk[pos])){
+                pos++;
+            }
+            token.append(chunk, beg, pos-beg);
+            // Otherwise token may continue in next chunk
+            if(pos<chunk.size()){
+                return true;
+            }
+        }
+    }
+
+    bool failed() const{
+        return in.failed;
+    }
+};
+
+#endif
@@ -14,130 +14,624 @@
 #include "parser.h"
 #include "csrmatrix.h"
 #include "csv.h"
+#include "checkpoint.h"
+#include "bench.h"
+#include "stream.h"
+#include "extbuild.h"
+#include "centrality.h"
+#include "service.h"
+#include "progress.h"
+#include "batch.h"
+#include "continuation.h"
+#include "trace.h"
+#include "export.h"
 
 using namespace std;
 #define uint unsigned int
 
-pair<double, int> run_program(CSR_Matrix<double> *P, int thread_num, int block_size, omp_sched_t _type){
+// Print highest ranked nodes (in order) and write them to a csv file
+void write_top(const vector<string> &names, const vector<double> &scores, const string &filename="result.csv"){
+    vector<vector<string>>high;
+
+    cout << "First " << names.size() << " elements:\n";
+    for(uint i=0; i<names.size(); i++){
+        cout << i+1 << ": " << names[i] << " : "<< scores[i] << endl;
+        // Push elements in order.
+        high.push_back(vector<string>({to_string(i+1), names[i], number_to_string(scores[i])}));
+    }
+    // Write result.csv
+    write_csv(filename, vector<string>({"No.", "Nodes", "Scores"}), high);
+}
+
+// Print k highest ranked nodes and write them to result.csv (or filename)
+void write_results(CSR_Matrix<double> *P, const page_vector<double> &r_t, uint k, const string &filename="result.csv"){
+    vector<string> names;
+    vector<double> scores;
+    vector<uint> top = top_k(r_t, k);
+    for(uint i=0; i<top.size(); i++){
+        names.push_back(P->arr_dict[top[i]]);
+        scores.push_back(r_t[top[i]]);
+    }
+    write_top(names, scores, filename);
+}
+
+// Queues the full rank vector on the background writer (ranks_out=, sorted_out=).
+// Names are moved out of the matrix, so call it after the last use of P->arr_dict.
+template<typename A>
+void export_ranks(ResultWriter *writer, const ExportOptions &opt, CSR_Matrix<double> *P, const vector<double, A> &r){
+    if(writer!=NULL){
+        writer->submit(opt, make_shared<const vector<string>>(move(P->arr_dict)), r);
+    }
+}
+
+// Single run of a centrality from centrality.h. HITS hubs go to result_hubs.csv.
+int centrality_program(CSR_Matrix<double> *P, const CentralityConfig &cfg, uint k,
+                       ResultWriter *writer, const ExportOptions &export_opt){
+    CentralityEngine<double> engine(P, cfg);
+    TraceScope solve_phase("solve");
+    bool converged = engine.run();
+    double tim = solve_phase.stop();
+    trace_log(LOG_INFO) << (converged ? "Completed in " : "Stopped without converging after ") << engine.iterations << " iterations..." << endl;
+    trace_log(LOG_INFO) << "Time passed: " << tim << endl;
+    if(cfg.kind==CENT_HITS){
+        cout << "Authorities:" << endl;
+    }
+    write_results(P, engine.scores, k);
+    if(cfg.kind==CENT_HITS){
+        cout << "Hubs:" << endl;
+        write_results(P, engine.hubs, k, "result_hubs.csv");
+    }
+    export_ranks(writer, export_opt, P, engine.scores);
+    return converged ? 0 : 1;
+}
+
+// Continuation over damping factors (damping=...), every alpha starts from the
+// previous result. Summary and top k of every alpha go to continuation.csv.
+int continuation_program(CSR_Matrix<double> *P, const vector<double> &alphas, double epsillon, uint k,
+                         const string &init, bool cold, const string &final_file,
+                         ResultWriter *writer, const ExportOptions &export_opt){
+    page_vector<double> r;
+    if(!init.empty() && !read_initial_vector(init, P->get_size().second, r)){
+        return 1;
+    }
+    cout << "Matrix in size: " << P->get_size().first << " " << P->get_size().second << endl;
+    vector<ContinuationStep> steps = solve_continuation<double>(P, alphas, epsillon, r, cold, k);
+
+    vector<vector<string>> rows;
+    int warm = 0, cold_total = 0;
+    for(const ContinuationStep &step : steps){
+        warm += step.iterations;
+        cold_total += step.cold_iterations;
+        for(uint i=0; i<step.top.size(); i++){
+            rows.push_back(vector<string>({number_to_string(step.alpha), to_string(step.iterations),
+                    to_string(step.cold_iterations), number_to_string(step.time), number_to_string(step.cold_time),
+                    to_string(i+1), P->arr_dict[step.top[i]], number_to_string(step.scores[i])}));
+        }
+    }
+    write_csv("continuation.csv", vector<string>({"alpha", "iterations", "cold_iterations", "time", "cold_time",
+                                                  "No.", "Nodes", "Scores"}), rows);
+    cout << "Total iterations: " << warm;
+    if(cold && warm>0){
+        cout << ", " << cold_total << " from cold starts (" << (double)cold_total/warm << "x)";
+    }
+    cout << endl;
+    // Final vector can start a later run (init=...)
+    if(!final_file.empty()){
+        Checkpoint ck;
+        ck.total = r.size();
+        ck.iteration = warm;
+        ck.diff = P->two_vec_diff;
+        ck.vec.assign(r.begin(), r.end());
+        if(!write_checkpoint(final_file, ck)){
+            cout << "Cannot write " << final_file << endl;
+        }
+    }
+    write_results(P, r, k);
+    export_ranks(writer, export_opt, P, r);
+    return 0;
+}
+
+// Out-of-core solve of a binary snapshot. Matrix is never built in memory,
+// budget_mb bounds the shard buffers.
+int stream_program(const string &filename, unsigned long long budget_mb){
+    SnapshotFile snap;
+    StreamResult res;
+    if(!snap.open(filename)){
+        cout << "Cannot read snapshot: " << filename << endl;
+        return 1;
+    }
+    cout << "Matrix in size: " << snap.header.row << " " << snap.header.col << endl;
+    if(!stream_pagerank(snap, budget_mb<<20, 0.2, 1e-6, res)){
+        return 1;
+    }
+    trace_log(LOG_INFO) << "Completed in "<< res.iterations << " iterations..."<<endl;
+    trace_log(LOG_INFO) << "Time passed: " << res.time << endl;
+    cout << "Read " << res.bytes_read/1e9 << " GB at " << res.bytes_read/1e9/res.time << " GB/s" << endl;
+
+    // Only names of the top nodes are read
+    vector<uint> top = top_k(res.rank, 5);
+    vector<double> scores;
+    for(uint i=0; i<top.size(); i++){
+        scores.push_back(res.rank[top[i]]);
+    }
+    write_top(snap.names(top), scores);
+    return 0;
+}
+
+// If ckpt is given, rank vector is checkpointed every ckpt->interval iterations.
+// If start is given, solve continues from that checkpoint instead of all ones vector.
+// With persistent, all iterations run in a single parallel region (solve_persistent).
+// If result is given, final rank vector is also stored there.
+pair<double, int> run_program(CSR_Matrix<double> *P, int thread_num, int block_size, omp_sched_t _type,
+                              Checkpointer *ckpt=NULL, const Checkpoint *start=NULL, bool persistent=false,
+                              page_vector<double> *result=NULL){
     // Set initial values
     int iterations=0;
     double alpha = 0.2;
     double epsillon = 1e-6;
-    double tim_st, tim_end;
     double last_tim;
-    vector<double> r_t, r_t1(P->get_size().second, 1);
+    page_vector<double> r_t, r_t1(P->get_size().second, 1);
+
+    if(start!=NULL){
+        assert(start->total==P->get_size().second && start->vec.size()==start->total);
+        r_t1.assign(start->vec.begin(), start->vec.end());
+        iterations = start->iteration;
+        cout << "Resuming from iteration " << iterations << " with diff " << start->diff << endl;
+    }
 
     // Set runtime scheduling method
 	omp_set_num_threads(thread_num);
     omp_set_schedule(_type, block_size);
     
-    cout << "Matrix in size: " << P->get_size().first << " " << P->get_size().second <<endl;
-    tim_st = omp_get_wtime( );
+    trace_log(LOG_INFO) << "Matrix in size: " << P->get_size().first << " " << P->get_size().second <<endl;
+    TraceScope solve_phase("solve");
     
-    // Begin operation. Keep going until vector diff is below epsilon
-    // P->ops function is parallelised, this loop only performs minor operations.
-    do{
+    if(persistent){
+        // Thread 0 only queues the diff and copies checkpoints, others keep going
+        ProgressLog log;
+        int base = iterations;
+        iterations += P->solve_persistent(r_t1, alpha, 1-alpha, epsillon, INT_MAX,
+            [&](int it, double diff, const page_vector<double> &r){
+                log.post(diff);
+                if(ckpt!=NULL && (base+it)%ckpt->interval==0){
+                    ckpt->save(r, r.size(), 0, base+it, diff);
+                }
+            });
         r_t = r_t1;
-        r_t1 = P->ops(r_t, alpha, 1-alpha);
-        iterations++;
-        cout << "Current Diff: "<<P->two_vec_diff<< endl;
-    } while(P->two_vec_diff > epsillon);
+    }else{
+        // Begin operation. Keep going until vector diff is below epsilon
+        // P->ops function is parallelised, this loop only performs minor operations.
+        do{
+            TraceScope iteration_phase("iteration");
+            r_t = r_t1;
+            r_t1 = P->ops(r_t, alpha, 1-alpha);
+            iterations++;
+            trace_counter("diff", P->two_vec_diff);
+            trace_log(LOG_PROGRESS) << "Current Diff: "<<P->two_vec_diff<< endl;
+            // Copy is taken here, writing happens on checkpoint thread
+            if(ckpt!=NULL && iterations%ckpt->interval==0){
+                ckpt->save(r_t1, r_t1.size(), 0, iterations, P->two_vec_diff);
+            }
+        } while(P->two_vec_diff > epsillon);
+    }
+    if(ckpt!=NULL){
+        // Final state is always saved
+        ckpt->save(r_t1, r_t1.size(), 0, iterations, P->two_vec_diff);
+        ckpt->flush();
+    }
 
-    // Print passed time. Also, this value will be used on schedule_program function.
-    tim_end = omp_get_wtime();
-    last_tim = tim_end - tim_st;
-    cout << "Completed in "<< iterations << " iterations..."<<endl;
-    cout << "Time passed: " << last_tim << endl;
+    // Print passed time. Also, this value is returned for logging.
+    last_tim = solve_phase.stop();
+    trace_log(LOG_INFO) << "Completed in "<< iterations << " iterations..."<<endl;
+    trace_log(LOG_INFO) << "Time passed: " << last_tim << endl;
 
-    vector<vector<string>>high;
-    double maxi, last = numeric_limits<double>::max();
-
-    cout << "First 5 elements:\n";
-    // Find max 5 elements with simple n*5 iteration
-    for(int i=0; i<5; i++){
-        int ind=0;
-        maxi = numeric_limits<double>::min();
-        for (int l=0; l<r_t.size(); l++){
-            if(maxi<r_t[l] && r_t[l]<last){
-                maxi = r_t[l];
-                ind = l;
-            }
-        }
-        cout << i+1 << ": " <<P->arr_dict[ind] << " : "<< maxi << endl;
-        last = maxi;
-        // Push elements in order.
-        high.push_back(vector<string>({to_string(high.size()+1), P->arr_dict[ind], to_string(maxi)}));
+    write_results(P, r_t, 5);
+    if(result!=NULL){
+        result->swap(r_t);
     }
-    // Write result.csv
-    write_csv("result.csv", vector<string>({"No.", "Nodes", "Scores"}), high);
     // Return values for logging.
     return {last_tim, iterations};
 }
 
-// Another function to schedule testcases. Also prepares csv log file.
-void schedule_program(CSR_Matrix<double> *P, vector<vector<string>> *logs, omp_sched_t _type, string schedule){
-    static int csv_iter=1;
-    // Block size iteration
-    for(int block_size=1; block_size<=1000000; block_size*=100){
-        vector<string> last_row;
-        last_row.push_back(to_string(csv_iter));
-        last_row.push_back(schedule); //Schedule method
-        last_row.push_back(to_string(block_size)); //Chunk size
-        last_row.push_back(""); // Total iterations (index: 3)
-        pair<double, int>retval;
-        // Thread number iteration
-        for(int i=1; i<=8; i++){
-            cout << "Running program with "<< schedule << " : " << block_size << " : " << i << endl;
-            retval = run_program(P, i, block_size, _type);
-            // First value returned is passed time
-            last_row.push_back(to_string(retval.first));
-        }
-        // Second value returned is iteration number
-        last_row[3]=to_string(retval.second);
-        logs->push_back(last_row);
-        csv_iter++;
-    }
-}
-
 // Autonomously run different testcases, and parse CSR Matrix
 int main(int argc, char** argv){
     ios::sync_with_stdio(false); // Comment if stdio has been used!!!
     CSR_Matrix<double> *P;
-    double tim_st, tim_end;
+    ParseTimes parse_times;
+    bool loaded = false;
+    // Chrome trace and phase summary written at exit (trace=trace.json),
+    // console output level (verbosity=quiet|info|progress|debug). Removed from arguments.
+    TraceSession trace;
+    int kept = 1;
+    for(int i=1; i<argc; i++){
+        if(strncmp(argv[i], "trace=", 6)==0){
+            trace.filename = argv[i]+6;
+        }else if(strncmp(argv[i], "verbosity=", 10)==0){
+            if(!set_verbosity(argv[i]+10)){
+                cout << "Unknown verbosity: " << argv[i]+10 << endl;
+            }
+        }else{
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+    TraceScope program_phase("program");
+
+    // External memory build of a snapshot from an edge list
+    // (build graph.txt snap.bin [budget_mb=1024] [shard_mb=64] [multi=collapse|keep])
+    if(argc>=4 && strcmp(argv[1], "build")==0){
+        ExtBuildOptions opt;
+        opt.tmp_prefix = string(argv[3]) + ".run";
+        for(int i=4; i<argc; i++){
+            string arg = argv[i];
+            try{
+                if(arg.compare(0, 10, "budget_mb=")==0){
+                    opt.budget = stod(arg.substr(10))*(1<<20);
+                }else if(arg.compare(0, 9, "shard_mb=")==0){
+                    opt.shard_bytes = stod(arg.substr(9))*(1<<20);
+                }else if(arg=="multi=collapse" || arg=="multi=keep"){
+                    opt.collapse = arg=="multi=collapse";
+                }else{
+                    cout << "Unknown argument: " << arg << endl;
+                }
+            }catch(const logic_error &){
+                cout << "Bad value: " << arg << endl;
+            }
+        }
+        ExtGraphBuilder builder(opt);
+        bool ok = builder.build(argv[2], argv[3]);
+        if(!ok){
+            cout << "Build failed" << endl;
+        }
+        trace_log(LOG_INFO) << "Program finished in: " << program_phase.elapsed() << endl;
+        return ok ? 0 : 1;
+    }
 
-    tim_st = omp_get_wtime( );
+    // Streamed solve of a snapshot bigger than memory (stream snap.bin [budget_mb=256])
+    if(argc>=3 && strcmp(argv[1], "stream")==0){
+        unsigned long long budget_mb = 256;
+        for(int i=3; i<argc; i++){
+            string arg = argv[i];
+            try{
+                if(arg.compare(0, 10, "budget_mb=")==0){
+                    budget_mb = stoull(arg.substr(10));
+                }else{
+                    cout << "Unknown argument: " << arg << endl;
+                }
+            }catch(const logic_error &){
+                cout << "Bad value: " << arg << endl;
+            }
+        }
+        int ret = stream_program(argv[2], budget_mb);
+        trace_log(LOG_INFO) << "Program finished in: " << program_phase.elapsed() << endl;
+        return ret;
+    }
+
+    // Query server over a snapshot (serve snap.bin [socket=pagerank.sock] [ranks=ckpt.bin] [budget_mb=256])
+    if(argc>=3 && strcmp(argv[1], "serve")==0){
+        string socket_path = "pagerank.sock", ranks;
+        unsigned long long budget_mb = 256;
+        for(int i=3; i<argc; i++){
+            string arg = argv[i];
+            try{
+                if(arg.compare(0, 7, "socket=")==0){
+                    socket_path = arg.substr(7);
+                }else if(arg.compare(0, 6, "ranks=")==0){
+                    ranks = arg.substr(6);
+                }else if(arg.compare(0, 10, "budget_mb=")==0){
+                    budget_mb = stoull(arg.substr(10));
+                }else{
+                    cout << "Unknown argument: " << arg << endl;
+                }
+            }catch(const logic_error &){
+                cout << "Bad value: " << arg << endl;
+            }
+        }
+        RankService service(argv[2], socket_path, budget_mb<<20);
+        if(!service.start(ranks) || !service.serve()){
+            cout << "Cannot start service" << endl;
+            return 1;
+        }
+        trace_log(LOG_INFO) << "Program finished in: " << program_phase.elapsed() << endl;
+        return 0;
+    }
+
+    // Many graphs and parameter sets in one process (batch manifest.txt [out=batch.csv] [groups=1] [large_mb=64] [topk=5]
+    // [export=dir] [export_csv=0|1])
+    if(argc>=3 && strcmp(argv[1], "batch")==0){
+        BatchOptions opt;
+        for(int i=3; i<argc; i++){
+            string arg = argv[i];
+            try{
+                if(arg.compare(0, 4, "out=")==0){
+                    opt.out = arg.substr(4);
+                }else if(arg.compare(0, 7, "groups=")==0){
+                    opt.groups = stoul(arg.substr(7));
+                }else if(arg.compare(0, 9, "large_mb=")==0){
+                    opt.large_bytes = stoull(arg.substr(9))<<20;
+                }else if(arg.compare(0, 5, "topk=")==0){
+                    opt.topk = stoul(arg.substr(5));
+                }else if(arg.compare(0, 7, "export=")==0){
+                    opt.export_dir = arg.substr(7);
+                }else if(arg=="export_csv=1" || arg=="export_csv=0"){
+                    opt.export_csv = arg=="export_csv=1";
+                }else{
+                    cout << "Unknown argument: " << arg << endl;
+                }
+            }catch(const logic_error &){
+                cout << "Bad value: " << arg << endl;
+            }
+        }
+        vector<BatchJob> jobs;
+        if(!read_manifest(argv[2], jobs)){
+            cout << "Cannot read manifest " << argv[2] << endl;
+            return 1;
+        }
+        BatchRunner runner(jobs, opt);
+        if(!runner.run()){
+            return 1;
+        }
+        bool ok = runner.write();
+        cout << "Results written to " << opt.out << endl;
+        trace_log(LOG_INFO) << "Program finished in: " << program_phase.elapsed() << endl;
+        return ok ? 0 : 1;
+    }
     
+    // Edge list to parse, plain, gzip or zstd (graph=path)
+    string graph_file = "graph.txt";
+    // Also build the out-link (transposed) matrix (out_links=1)
+    bool out_links = false;
+    // Graph statistics collected while parsing, written as json (stats=graph_stats.json)
+    string stats_file;
+    // Full rank vector written on a background thread after the solve, as a binary
+    // array by node id (ranks_out=ranks.bin) and/or a csv sorted by score (sorted_out=ranks.csv)
+    ExportOptions export_opt;
+    for(int i=1; i<argc; i++){
+        if(strncmp(argv[i], "graph=", 6)==0){
+            graph_file = argv[i]+6;
+        }else if(strncmp(argv[i], "out_links=", 10)==0){
+            out_links = strcmp(argv[i]+10, "0")!=0;
+        }else if(strncmp(argv[i], "stats=", 6)==0){
+            stats_file = argv[i]+6;
+        }else if(strncmp(argv[i], "ranks_out=", 10)==0){
+            export_opt.binary = argv[i]+10;
+        }else if(strncmp(argv[i], "sorted_out=", 11)==0){
+            export_opt.sorted_csv = argv[i]+11;
+        }
+    }
+    unique_ptr<ResultWriter> writer(export_opt.enabled() ? new ResultWriter() : NULL);
+
     // Initialize CSR matrix. Either parse from file,
-    // or load from dumped csv file if requested. (load filename)
-    if(argc>=3 && strcmp(argv[1], "load")==0){
+    // or load from dumped csv file or binary snapshot if requested. (load filename)
+    if((argc>=3 && strcmp(argv[1], "load")==0) ||
+       (argc>=4 && (strcmp(argv[1], "checkpoint")==0 || strcmp(argv[1], "resume")==0 ||
+                    strcmp(argv[1], "snapshot")==0))){
+        TraceScope load_phase("load");
         P = new CSR_Matrix<double>(string(argv[2]));
+        if(!P->loaded){
+            cout << (is_snapshot(argv[2]) ? "Cannot read snapshot: " : "Cannot read matrix: ") << argv[2] << endl;
+            delete P;
+            return 1;
+        }
+        loaded = true;
+        // Snapshots may already hold it
+        if(out_links && P->out_links==NULL){
+            P->build_out_links();
+            cout << "Out-link matrix built" << endl;
+        }
     }
     else{
-        P = parse("graph.txt");
+        GraphStats stats;
+        P = parse(graph_file, &parse_times, out_links, stats_file.empty() ? NULL : &stats);
+        if(P==NULL){
+            return 1;
+        }
+        if(!stats_file.empty()){
+            stats.print();
+            if(!stats.write_json(stats_file)){
+                cout << "Cannot write " << stats_file << endl;
+            }
+        }
         // If requested, dump file to csv file (save filename)
         if(argc>=3 && strcmp(argv[1], "save")==0){
             P->write(argv[2]);
         }
     }
+    double init_time = program_phase.elapsed();
 
     cout << "CSR Matrix Initialized" << endl;
 
-    vector<vector<string>> logs;
+    // Huge pages and NUMA placement (pages=none|thp|hugetlb, numa=firsttouch|interleave|replicate).
+    // Matrix is already built, so its arrays are moved to pages with the new policy.
+    for(int i=1; i<argc; i++){
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        if(eq!=string::npos){
+            memory_option(arg.substr(0, eq), arg.substr(eq+1));
+        }
+    }
+    if(!memory_policy().is_default()){
+        P->place_pages();
+        cout << "Matrix moved to " << numa_node_count() << " node(s) with requested page policy" << endl;
+    }
 
-    // Run for 4 different schedules
-    schedule_program(P, &logs, omp_sched_static, "static");
-    schedule_program(P, &logs, omp_sched_dynamic, "dynamic");
-    schedule_program(P, &logs, omp_sched_guided, "guided");
-    schedule_program(P, &logs, omp_sched_auto, "auto");
+    // Column segmented SpMV (segment=auto|off|columns). Without the argument, the
+    // width stored in a loaded snapshot is used.
+    uint segment_cols = P->stored_segment_cols;
+    for(int i=1; i<argc; i++){
+        if(strncmp(argv[i], "segment=", 8)==0){
+            string value = argv[i]+8;
+            try{
+                if(value=="auto"){
+                    segment_cols = P->tune_segments(segment_width_candidates(P->get_size().second, sizeof(double)));
+                }else{
+                    segment_cols = value=="off" ? 0 : stoul(value);
+                }
+            }catch(const logic_error &){
+                cout << "Bad value: " << argv[i] << endl;
+            }
+        }
+    }
+    if(segment_cols>0 && P->segments==NULL){
+        P->segment_columns(segment_cols);
+    }
+    if(P->segments!=NULL){
+        cout << "Columns segmented by " << P->segments->width << " into " << P->segments->segments
+             << " segments (" << P->segments->bytes()/double(1<<20) << " MiB)" << endl;
+    }
+
+    // Propagation blocking push kernel (push=on|off|bin columns), replaces the pull kernel in ops
+    for(int i=1; i<argc; i++){
+        if(strncmp(argv[i], "push=", 5)==0 && strcmp(argv[i]+5, "off")!=0){
+            try{
+                P->use_push(strcmp(argv[i]+5, "on")==0 ? push_bin_width(sizeof(double)) : stoul(argv[i]+5));
+                cout << "Push kernel with " << P->push->bins << " bins of " << P->push->width << " nodes ("
+                     << P->push->bytes()/double(1<<20) << " MiB)" << endl;
+            }catch(const logic_error &){
+                cout << "Bad value: " << argv[i] << endl;
+            }
+        }
+    }
+
+    // Convert to a binary snapshot of shard_mb sized shards
+    // (snapshot backup.csv snap.bin [shard_mb=64] [out_links=1] [segment=auto|off|columns])
+    if(argc>=4 && strcmp(argv[1], "snapshot")==0){
+        unsigned long long shard_mb = 64;
+        for(int i=4; i<argc; i++){
+            if(strncmp(argv[i], "shard_mb=", 9)==0){
+                try{
+                    shard_mb = stoull(argv[i]+9);
+                }catch(const logic_error &){
+                    cout << "Bad value: " << argv[i] << endl;
+                }
+            }
+        }
+        if(!P->write_snapshot(argv[3], shard_mb<<20)){
+            cout << "Cannot write snapshot: " << argv[3] << endl;
+        }
+        trace_log(LOG_INFO) << "Snapshot written in: " << program_phase.elapsed() << endl;
+        delete P;
+        return 0;
+    }
 
-    // Write log to CSV file.
-    vector<string>col_names({"Test No.", "Scheduling Method", "Chunk Size", "No of Iterations", "1", "2", "3", "4", "5", "6", "7", "8"});
-    cout << "Now write" << endl;
-    write_csv("log.csv", col_names, logs);
+    // Single solve with periodic checkpoints (checkpoint backup.csv ckpt.bin [solver=persistent]),
+    // or continue a solve from such a checkpoint (resume backup.csv ckpt.bin).
+    // Runs once with all threads, guided schedule and chunk size 100, instead of scheduling all testcases.
+    if(argc>=4 && (strcmp(argv[1], "checkpoint")==0 || strcmp(argv[1], "resume")==0)){
+        bool persistent = false;
+        string init;
+        for(int i=4; i<argc; i++){
+            if(strcmp(argv[i], "solver=persistent")==0){
+                persistent = true;
+            }else if(strncmp(argv[i], "init=", 5)==0){
+                init = argv[i]+5;
+            }
+        }
+        Checkpoint start;
+        bool resume = strcmp(argv[1], "resume")==0;
+        // Checkpoint must hold the whole vector of this matrix
+        if(resume && (!read_checkpoint(argv[3], start) || start.offset!=0 ||
+                      start.total!=P->get_size().second || start.vec.size()!=start.total)){
+            cout << "Cannot read checkpoint: " << argv[3] << endl;
+            delete P;
+            return 1;
+        }
+        // Warm start from another vector, iterations are counted from zero
+        if(!resume && !init.empty()){
+            if(!read_initial_vector(init, P->get_size().second, start.vec)){
+                delete P;
+                return 1;
+            }
+            start.total = start.vec.size();
+            start.iteration = 0;
+            start.diff = 0;
+        }
+        Checkpointer ckpt(argv[3]);
+        page_vector<double> result;
+        run_program(P, omp_get_max_threads(), 100, omp_sched_guided, &ckpt, (resume || !init.empty()) ? &start : NULL,
+                    persistent, &result);
+        export_ranks(writer.get(), export_opt, P, result);
+
+        trace_log(LOG_INFO) << "Program finished in: " << program_phase.elapsed() << endl;
+        delete P;
+        return 0;
+    }
+
+    // Benchmark all testcases. Remaining key=value arguments (or config=file)
+    // override the default grid, see bench.h
+    BenchConfig cfg;
+    // algorithm=... runs that centrality once instead of the benchmark
+    CentralityConfig centrality;
+    bool run_centrality = false;
+    // damping=a,b,... runs a continuation over these alphas instead (init=ckpt.bin, cold=0|1, final=ckpt.bin)
+    vector<double> dampings;
+    string init, final_file;
+    bool cold = true;
+    for(int i=(argc>=3 && (strcmp(argv[1], "load")==0 || strcmp(argv[1], "save")==0)) ? 3 : 1; i<argc; i++){
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        if(eq!=string::npos && arg.substr(0, eq)=="config"){
+            if(!read_bench_config(arg.substr(eq+1), cfg)){
+                cout << "Cannot read bench config: " << arg.substr(eq+1) << endl;
+            }
+        }else if(eq!=string::npos && centrality_option(centrality, arg.substr(0, eq), arg.substr(eq+1))){
+            run_centrality = true;
+        }else if(eq!=string::npos && arg.substr(0, eq)=="damping"){
+            try{
+                vector<double> values;
+                for(const string &v : string_to_svector(arg.substr(eq+1), ",")){
+                    values.push_back(stod(v));
+                }
+                dampings.insert(dampings.end(), values.begin(), values.end());
+            }catch(const logic_error &){
+                cout << "Bad value: " << arg << endl;
+            }
+        }else if(eq!=string::npos && arg.substr(0, eq)=="init"){
+            init = arg.substr(eq+1);
+        }else if(eq!=string::npos && arg.substr(0, eq)=="final"){
+            final_file = arg.substr(eq+1);
+        }else if(eq!=string::npos && arg.substr(0, eq)=="cold"){
+            cold = arg.substr(eq+1)!="0";
+        }else if(eq==string::npos || (!bench_option(cfg, arg.substr(0, eq), arg.substr(eq+1)) &&
+                                      !memory_option(arg.substr(0, eq), arg.substr(eq+1)) &&
+                                      arg.substr(0, eq)!="graph" && arg.substr(0, eq)!="out_links" &&
+                                      arg.substr(0, eq)!="segment" && arg.substr(0, eq)!="push" &&
+                                      arg.substr(0, eq)!="stats" && arg.substr(0, eq)!="ranks_out" &&
+                                      arg.substr(0, eq)!="sorted_out")){
+            cout << "Unknown argument: " << arg << endl;
+        }
+    }
+    if(run_centrality){
+        centrality.alpha = cfg.alpha;
+        centrality.epsillon = cfg.epsillon;
+        int ret = centrality_program(P, centrality, cfg.topk, writer.get(), export_opt);
+        trace_log(LOG_INFO) << "Program finished in: " << program_phase.elapsed() << endl;
+        delete P;
+        return ret;
+    }
+    if(!dampings.empty()){
+        int ret = continuation_program(P, dampings, cfg.epsillon, cfg.topk, init, cold, final_file,
+                                       writer.get(), export_opt);
+        trace_log(LOG_INFO) << "Program finished in: " << program_phase.elapsed() << endl;
+        delete P;
+        return ret;
+    }
+    Benchmark bench(cfg);
+    if(loaded){
+        bench.add_setup("load", init_time);
+    }else{
+        bench.add_setup("parse", parse_times.read+parse_times.enumerate+parse_times.nodes);
+        bench.add_setup("build", parse_times.build);
+    }
+    bench.run(P);
+    bench.write();
+    if(!bench.result().empty()){
+        write_results(P, bench.result(), cfg.topk);
+        export_ranks(writer.get(), export_opt, P, bench.result());
+    }
 
     // Print runtime and exit.
-    tim_end = omp_get_wtime();
-    cout << "Program finished in: " << tim_end-tim_st << endl;
+    trace_log(LOG_INFO) << "Program finished in: " << program_phase.elapsed() << endl;
 
     delete P;
     return 0;
@@ -0,0 +1,321 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+#include <vector>
+#include <string>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <unordered_map>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+using namespace std;
+typedef unsigned int uint;
+
+// Memory placement for large arrays (CSR arrays and rank vectors).
+// Huge pages cut TLB misses of the random vec[col_indices[l]] gather.
+// On multi socket machines, NUMA interleave spreads pages over every node,
+// and replicate keeps a copy of the read only vector on each node.
+enum HugePageMode{
+    HUGE_NONE,      // Regular 4 KiB pages
+    HUGE_THP,       // 2 MiB aligned, madvise(MADV_HUGEPAGE) for transparent huge pages
+    HUGE_HUGETLB    // MAP_HUGETLB from the reserved pool, falls back to THP if it is empty
+};
+
+enum NumaMode{
+    NUMA_FIRST_TOUCH,   // Pages go to the node of the thread touching them first
+    NUMA_INTERLEAVE,    // Pages are spread round robin over every node
+    NUMA_REPLICATE      // First touch, and rank vector is copied to every node each iteration
+};
+
+struct MemoryPolicy{
+    HugePageMode huge = HUGE_NONE;
+    NumaMode numa = NUMA_FIRST_TOUCH;
+
+    bool is_default() const{
+        return huge==HUGE_NONE && numa==NUMA_FIRST_TOUCH;
+    }
+};
+
+// Policy used by new allocations. Change it before building or placing arrays.
+inline MemoryPolicy &memory_policy(){
+    static MemoryPolicy policy;
+    return policy;
+}
+
+// Set pages=none|thp|hugetlb or numa=firsttouch|interleave|replicate.
+// Returns false for an unknown key or value.
+inline bool memory_option(const string &key, const string &value){
+    MemoryPolicy &p = memory_policy();
+    if(key=="pages"){
+        if(value=="none") p.huge = HUGE_NONE;
+        else if(value=="thp") p.huge = HUGE_THP;
+        else if(value=="hugetlb") p.huge = HUGE_HUGETLB;
+        else return false;
+    }else if(key=="numa"){
+        if(value=="firsttouch") p.numa = NUMA_FIRST_TOUCH;
+        else if(value=="interleave") p.numa = NUMA_INTERLEAVE;
+        else if(value=="replicate") p.numa = NUMA_REPLICATE;
+        else return false;
+    }else{
+        return false;
+    }
+    return true;
+}
+
+#define HUGE_PAGE_SIZE (2UL<<20)
+// Smaller allocations use malloc, mmap is not worth it for them
+#define PAGE_ALLOC_MIN (1UL<<20)
+
+// Linux mbind modes (from numaif.h, which needs libnuma headers)
+#define PAGE_MPOL_BIND 2
+#define PAGE_MPOL_INTERLEAVE 3
+
+// Online NUMA nodes as a bit mask, read once from sysfs. Single node if unknown.
+inline unsigned long numa_node_mask(){
+    static unsigned long mask = 0;
+    if(mask==0){
+        ifstream in("/sys/devices/system/node/online");
+        string ranges;
+        if(in >> ranges){
+            // Format: 0-1,3
+            size_t pos = 0;
+            while(pos<ranges.size()){
+                size_t next = ranges.find(',', pos);
+                string part = ranges.substr(pos, next==string::npos ? string::npos : next-pos);
+                size_t dash = part.find('-');
+                int lo = stoi(part.substr(0, dash));
+                int hi = dash==string::npos ? lo : stoi(part.substr(dash+1));
+                for(int n=lo; n<=hi && n<(int)(8*sizeof(mask)); n++){
+                    mask |= 1UL<<n;
+                }
+                if(next==string::npos){
+                    break;
+                }
+                pos = next+1;
+            }
+        }
+        if(mask==0){
+            mask = 1;
+        }
+    }
+    return mask;
+}
+
+inline int numa_node_count(){
+    return __builtin_popcountl(numa_node_mask());
+}
+
+// Node of the cpu calling thread runs on. Threads should be pinned
+// (OMP_PROC_BIND=true) for this to stay valid.
+inline int current_numa_node(){
+    unsigned cpu = 0, node = 0;
+    if(syscall(SYS_getcpu, &cpu, &node, NULL)!=0){
+        return 0;
+    }
+    return node;
+}
+
+// Lengths of mmap allocations, needed by munmap
+inline mutex &page_registry_mutex(){
+    static mutex mtx;
+    return mtx;
+}
+
+inline unordered_map<void *, size_t> &page_registry(){
+    static unordered_map<void *, size_t> registry;
+    return registry;
+}
+
+// Apply a NUMA policy to a range. Errors are ignored, placement is only a hint.
+inline void page_bind(void *p, size_t len, int mode, unsigned long mask){
+    syscall(SYS_mbind, p, len, mode, &mask, 8*sizeof(mask), 0);
+}
+
+// Allocate bytes with current memory_policy. Memory is not touched here, so
+// pages are placed when the filling threads first write them.
+inline void *page_alloc(size_t bytes){
+    const MemoryPolicy &policy = memory_policy();
+    if(bytes<PAGE_ALLOC_MIN){
+        void *p = malloc(bytes ? bytes : 1);
+        if(p==NULL){
+            throw bad_alloc();
+        }
+        return p;
+    }
+    void *p = MAP_FAILED;
+    size_t len = (bytes+HUGE_PAGE_SIZE-1) & ~(HUGE_PAGE_SIZE-1);
+    if(policy.huge==HUGE_HUGETLB){
+        p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+    }
+    if(p==MAP_FAILED && policy.huge!=HUGE_NONE){
+        // Over allocate, then trim to a 2 MiB aligned range so THP can back all of it
+        char *raw = (char *)mmap(NULL, len+HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if(raw!=MAP_FAILED){
+            char *aligned = (char *)(((uintptr_t)raw+HUGE_PAGE_SIZE-1) & ~(HUGE_PAGE_SIZE-1));
+            if(aligned>raw){
+                munmap(raw, aligned-raw);
+            }
+            munmap(aligned+len, raw+HUGE_PAGE_SIZE-aligned);
+            madvise(aligned, len, MADV_HUGEPAGE);
+            p = aligned;
+        }
+    }
+    if(p==MAP_FAILED && policy.huge==HUGE_NONE){
+        len = (bytes+getpagesize()-1) & ~((size_t)getpagesize()-1);
+        p = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    }
+    if(p==MAP_FAILED){
+        throw bad_alloc();
+    }
+    if(policy.numa==NUMA_INTERLEAVE && numa_node_count()>1){
+        page_bind(p, len, PAGE_MPOL_INTERLEAVE, numa_node_mask());
+    }
+    lock_guard<mutex> lock(page_registry_mutex());
+    page_registry()[p] = len;
+    return p;
+}
+
+inline void page_free(void *p, size_t bytes){
+    if(p==NULL){
+        return;
+    }
+    if(bytes<PAGE_ALLOC_MIN){
+        free(p);
+        return;
+    }
+    size_t len;
+    {
+        lock_guard<mutex> lock(page_registry_mutex());
+        auto it = page_registry().find(p);
+        assert(it!=page_registry().end());
+        len = it->second;
+        page_registry().erase(it);
+    }
+    munmap(p, len);
+}
+
+// STL allocator using page_alloc. Elements constructed without a value are
+// left uninitialised, so vector(n) and resize(n) do not touch memory on the
+// allocating thread. Small blocks come from malloc and hold garbage, so never
+// rely on zeros: fill elements before reading.
+template<typename T>
+struct PageAllocator{
+    typedef T value_type;
+
+    PageAllocator() noexcept {}
+    template<typename U> PageAllocator(const PageAllocator<U> &) noexcept {}
+
+    T *allocate(size_t n){
+        return (T *)page_alloc(n*sizeof(T));
+    }
+
+    void deallocate(T *p, size_t n){
+        page_free(p, n*sizeof(T));
+    }
+
+    template<typename U>
+    void construct(U *p){
+        ::new((void *)p) U;
+    }
+
+    template<typename U, typename... Args>
+    void construct(U *p, Args&&... args){
+        ::new((void *)p) U(std::forward<Args>(args)...);
+    }
+};
+
+template<typename T, typename U>
+inline bool operator==(const PageAllocator<T> &, const PageAllocator<U> &){
+    return true;
+}
+
+template<typename T, typename U>
+inline bool operator!=(const PageAllocator<T> &, const PageAllocator<U> &){
+    return false;
+}
+
+template<typename T>
+using page_vector = vector<T, PageAllocator<T>>;
+
+// One copy of a read only vector per NUMA node. Copies are bound to their node,
+// so threads gather from local memory whoever wrote them.
+template<typename T>
+class NumaReplica{
+    private:
+    vector<T *> copies;
+    vector<size_t> bytes;
+    size_t n = 0;
+
+    void release(){
+        for(uint k=0; k<copies.size(); k++){
+            page_free(copies[k], bytes[k]);
+        }
+        copies.clear();
+        bytes.clear();
+    }
+
+    public:
+    NumaReplica(){}
+    NumaReplica(const NumaReplica &) = delete;
+    NumaReplica &operator=(const NumaReplica &) = delete;
+
+    ~NumaReplica(){
+        release();
+    }
+
+    // Copy src to every node. Runs in parallel, threads copy a slice each.
+    void update(const T *src, size_t count){
+        unsigned long mask = numa_node_mask();
+        if(count!=n){
+            release();
+            n = count;
+            for(int node=0; node<(int)(8*sizeof(mask)); node++){
+                if(!(mask & (1UL<<node))){
+                    copies.push_back(NULL);
+                    bytes.push_back(0);
+                    continue;
+                }
+                // Always mmap, so the copy can be bound to its node
+                size_t len = max(n*sizeof(T), (size_t)PAGE_ALLOC_MIN);
+                T *p = (T *)page_alloc(len);
+                page_bind(p, len, PAGE_MPOL_BIND, 1UL<<node);
+                copies.push_back(p);
+                bytes.push_back(len);
+            }
+        }
+        long long i;
+        #pragma omp parallel for schedule(static)
+        for(i=0; i<(long long)n; i++){
+            for(uint k=0; k<copies.size(); k++){
+                if(copies[k]!=NULL){
+                    copies[k][i] = src[i];
+                }
+            }
+        }
+    }
+
+    // Copy on node of the calling thread
+    const T *local() const{
+        int node = current_numa_node();
+        if(node<(int)copies.size() && copies[node]!=NULL){
+            return copies[node];
+        }
+        for(uint k=0; k<copies.size(); k++){
+            if(copies[k]!=NULL){
+                return copies[k];
+            }
+        }
+        return NULL;
+    }
+};
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+using namespace std;
+typedef unsigned int uint;
+
+// Binary checkpoint file layout (native endianness):
+// char[4] magic "PRCK", uint version, uint total, uint offset, uint count,
+// int iteration, double diff, then count doubles of the rank vector.
+// offset/count allow a process to store only its own piece of the vector.
+#define CHECKPOINT_MAGIC "PRCK"
+#define CHECKPOINT_VERSION 1
+
+struct Checkpoint{
+    uint total=0;  // Full vector size (matrix column count)
+    uint offset=0; // Index of vec[0] in the full vector
+    int iteration=0;
+    double diff=0;
+    vector<double> vec;
+};
+
+// Write checkpoint to a temporary file, then rename it, so a crash during
+// write never destroys the previous checkpoint.
+inline bool write_checkpoint(const string &filename, const Checkpoint &ck){
+    string tmp = filename + ".tmp";
+    uint header[4] = {CHECKPOINT_VERSION, ck.total, ck.offset, (uint)ck.vec.size()};
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if(f==NULL){
+        return false;
+    }
+    bool ok = fwrite(CHECKPOINT_MAGIC, 1, 4, f)==4
+        && fwrite(header, sizeof(uint), 4, f)==4
+        && fwrite(&ck.iteration, sizeof(int), 1, f)==1
+        && fwrite(&ck.diff, sizeof(double), 1, f)==1
+        && fwrite(ck.vec.data(), sizeof(double), ck.vec.size(), f)==ck.vec.size();
+    ok = (fclose(f)==0) && ok;
+    return ok && rename(tmp.c_str(), filename.c_str())==0;
+}
+
+// Read checkpoint. Returns false if file is missing or malformed.
+inline bool read_checkpoint(const string &filename, Checkpoint &ck){
+    char magic[4];
+    uint header[4];
+    FILE *f = fopen(filename.c_str(), "rb");
+    if(f==NULL){
+        return false;
+    }
+    bool ok = fread(magic, 1, 4, f)==4 && memcmp(magic, CHECKPOINT_MAGIC, 4)==0
+        && fread(header, sizeof(uint), 4, f)==4 && header[0]==CHECKPOINT_VERSION
+        && fread(&ck.iteration, sizeof(int), 1, f)==1
+        && fread(&ck.diff, sizeof(double), 1, f)==1;
+    if(ok){
+        ck.total = header[1];
+        ck.offset = header[2];
+        ck.vec.resize(header[3]);
+        ok = fread(ck.vec.data(), sizeof(double), ck.vec.size(), f)==ck.vec.size();
+    }
+    fclose(f);
+    return ok;
+}
+
+// Writes checkpoints on a background thread so iterations are not stalled by disk.
+// save() only copies the vector. If a write is still in progress, the newest
+// pending checkpoint replaces the older one.
+class Checkpointer{
+    private:
+    string filename;
+    thread worker;
+    mutex mtx;
+    condition_variable cv;
+    Checkpoint pending;
+    bool has_pending=false, busy=false, stop=false;
+
+    void loop(){
+        Checkpoint ck;
+        unique_lock<mutex> lock(mtx);
+        while(true){
+            cv.wait(lock, [this]{ return has_pending || stop; });
+            if(!has_pending){
+                break;
+            }
+            swap(ck, pending);
+            has_pending = false;
+            busy = true;
+            lock.unlock();
+            if(!write_checkpoint(filename, ck)){
+                cerr << "Checkpoint write failed: " << filename << endl;
+            }
+            lock.lock();
+            busy = false;
+            cv.notify_all();
+        }
+    }
+
+    public:
+    // Checkpoint every "interval" iterations. Public for solvers to check.
+    int interval;
+
+    Checkpointer(const string &filename, int interval=5) : filename(filename), interval(interval){
+        worker = thread(&Checkpointer::loop, this);
+    }
+
+    ~Checkpointer(){
+        {
+            lock_guard<mutex> lock(mtx);
+            stop = true;
+        }
+        cv.notify_all();
+        worker.join();
+    }
+
+    template<typename A>
+    void save(const vector<double, A> &vec, uint total, uint offset, int iteration, double diff){
+        lock_guard<mutex> lock(mtx);
+        pending.total = total;
+        pending.offset = offset;
+        pending.iteration = iteration;
+        pending.diff = diff;
+        pending.vec.assign(vec.begin(), vec.end());
+        has_pending = true;
+        cv.notify_all();
+    }
+
+    // Block until every requested checkpoint is on disk
+    void flush(){
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [this]{ return !has_pending && !busy; });
+    }
+};
+
+#endif
@@ -13,42 +13,54 @@
 #include <assert.h>
 
 #include "csv.h"
+#include "alloc.h"
 
 using namespace std;
 typedef unsigned int uint;
 
+// Third field of the first line of csv backups. Files of older builds have
+// only row and col, and zero rows in their own formats.
+#define CSR_CSV_VERSION 2
+
 template<typename T>
 class CSR_Matrix{
     private:
 
     public:
     uint row, col;
-    // Value indices. Must be ordered
-    vector<uint> row_begin;
-    vector<uint> col_indices;
+    // Value indices. Monotone, row+1 elements, zero rows have equal begin and end.
+    page_vector<uint> row_begin;
+    page_vector<uint> col_indices;
     //Non zero values in the matrix
-    vector<T> values;
+    page_vector<T> values;
+    // Indices of non zero rows in order (DCSR style), for sparse row blocks
+    vector<uint> nz_rows;
     // Those values are non essential to CSR matrix's runtime.
     // But if they shouldn't be changed without caution.
     double two_vec_diff=0;
     vector<string> arr_dict;
+    // False if the file given to the constructor could not be read
+    bool loaded=true;
     // Write matrix to file
     void write(const string &filename){
         string buffer;
         // Write row
-        buffer += to_string(this->row);
+        append_number(buffer, this->row);
         buffer += ",";
         // Write col
-        buffer += to_string(this->col);
+        append_number(buffer, this->col);
+        // Write format version (row_begin is monotone)
+        buffer += ",";
+        append_number(buffer, CSR_CSV_VERSION);
         buffer += "\n";
         // Write row_begin array
-        buffer += join(vector_to_string(row_begin), ",");
+        append_joined(buffer, row_begin, ',');
         buffer += "\n";
-        // Write values array
-        buffer += join(vector_to_string(values), ",");
+        // Write values array (shortest text that reads back exactly)
+        append_joined(buffer, values, ',');
         buffer += "\n";
         // Write col_indices array
-        buffer += join(vector_to_string(col_indices), ",");
+        append_joined(buffer, col_indices, ',');
         buffer += "\n";
         // Write arr_dict array
         buffer += join(arr_dict, ",");
@@ -80,14 +92,43 @@ class CSR_Matrix{
         cout << "Read file" << endl;
 
         // Now parse them accordingly
-        vector<uint>temp = string_to_uivector(str_init, ",");
+        vector<uint> temp, row_str, col_str;
+        vector<double> val_str;
+        if(!parse_numbers(str_init, ',', temp) || temp.size()<2 || !parse_numbers(str_row, ',', row_str) ||
+           !parse_numbers(str_val, ',', val_str) || !parse_numbers(str_col, ',', col_str) ||
+           row_str.size()!=(size_t)temp[0]+1 || val_str.size()!=col_str.size()){
+            loaded = false;
+            return;
+        }
         this->row = temp[0];
         this->col = temp[1];
-        row_begin = string_to_uivector(str_row, ",");
-        values = string_to_dvector(str_val, ",");
-        col_indices = string_to_uivector(str_col, ",");
+        row_begin.assign(row_str.begin(), row_str.end());
+        values.assign(val_str.begin(), val_str.end());
+        col_indices.assign(col_str.begin(), col_str.end());
         arr_dict = string_to_svector(str_maps, ",");
 
+        // Files without a version mark zero rows with UINT_MAX, and those of the
+        // MPI build repeat the begin of the row before (a run of equal begins is
+        // one row and zero rows after it). Make them monotone, from the end so
+        // every zero row takes the begin of the next non-zero row.
+        if(temp.size()<3){
+            for(uint i=this->row; i>0; i--){
+                if(row_begin[i-1]==UINT_MAX || (i>1 && row_begin[i-1]==row_begin[i-2])){
+                    row_begin[i-1] = row_begin[i];
+                }
+            }
+        }
+        index_rows();
+    }
+
+    // Rebuild non zero row list from row_begin
+    void index_rows(){
+        nz_rows.clear();
+        for(uint i=0; i<this->row; i++){
+            if(row_begin[i]!=row_begin[i+1]){
+                nz_rows.push_back(i);
+            }
+        }
     }
 
     // Special array initializator optimised for double node matrices.
@@ -101,49 +142,83 @@ class CSR_Matrix{
         this->col = arr_dict.size();
         this->row = arr_dict.size();
 
+        row_begin.push_back(0);
         for(int i=0; i<this->col; i++){
             // Set array structure variables
             uint old_size = values.size();
             values.resize(values.size()+link_by[i].size());
             col_indices.resize(values.size());
-            // If it is a zero row, then set according row_begin index to UINT_MAX
-            if(values.size()==old_size){
-                if(old_size==0)
-                    row_begin.push_back(UINT_MAX);
-                else
-                    row_begin.push_back(row_begin.back());
-            }else{
-                row_begin.push_back(old_size);
+            if(values.size()!=old_size){
+                nz_rows.push_back(i);
             }
 
             // Set values and according column indices.
             for(int l=0; l<link_by[i].size(); l++){
                 assert(link_to[link_by[i][l]].size()!=0);
-                values[old_size+l]=1/(link_to[link_by[i][l]].size());
+                values[old_size+l]=1.0/(link_to[link_by[i][l]].size());
                 col_indices[old_size+l]=link_by[i][l];
             }
             // Sorting is not required
             //sort(col_indices.begin()+old_size, col_indices.end());
+            row_begin.push_back(values.size());
         }
-        row_begin.push_back(values.size());
         assert(values.size()==col_indices.size());
     }
 
+    // Split rows [rbeg, rend) into one block per column range of col_par
+    // (col_par[c] to col_par[c+1]). Used for 2D checkerboard partitioning.
+    // Blocks hold local column indices.
+    vector<CSR_Matrix<T>*> split_blocks(uint rbeg, uint rend, const vector<uint> &col_par) const{
+        uint nblk = col_par.size()-1, c, i, l;
+        vector<CSR_Matrix<T>*> ret(nblk);
+        for(c=0; c<nblk; c++){
+            ret[c] = new CSR_Matrix<T>(rend-rbeg, col_par[c+1]-col_par[c]);
+            ret[c]->row_begin.push_back(0);
+        }
+        for(i=rbeg; i<rend; i++){
+            for(l=row_begin[i]; l<row_begin[i+1]; l++){
+                // Find owning column block
+                c = upper_bound(col_par.begin(), col_par.end(), col_indices[l]) - col_par.begin() - 1;
+                ret[c]->col_indices.push_back(col_indices[l]-col_par[c]);
+                ret[c]->values.push_back(values[l]);
+            }
+            for(c=0; c<nblk; c++){
+                if(ret[c]->values.size()!=ret[c]->row_begin.back()){
+                    ret[c]->nz_rows.push_back(i-rbeg);
+                }
+                ret[c]->row_begin.push_back(ret[c]->values.size());
+            }
+        }
+        return ret;
+    }
+
+    // Scaled product of a block built by split_blocks. No teleport term and no
+    // difference is computed here, as partial results are summed across the process row.
+    // Blocks are hypersparse on large grids, so only non zero rows are visited.
+    vector<T> partial_ops(const vector<T> &vec, T sca) const{
+        assert(vec.size()==this->col);
+        uint i, k, l;
+        vector<T> ret(this->row, 0);
+        for(k=0; k<nz_rows.size(); k++){
+            i = nz_rows[k];
+            for(l=row_begin[i]; l<row_begin[i+1]; l++){
+                ret[i] += (values[l] * vec[col_indices[l]] * sca);
+            }
+        }
+        return ret;
+    }
+
     vector<T> ops(const vector<T> &vec, T sca, T add, uint vecbeg=0){
         assert(vec.size()==this->col);
-        uint i, end, l, beg;
+        uint i, l;
         // Initialize with multiplied C vector
         vector<T> ret(this->row, add/this->col);
 
-        // Skip zero rows
-        for(beg=0; row_begin[beg]==UINT_MAX; beg++);
         two_vec_diff=0;
-        // Parallelised for loop
-        for(i=beg; i<this->row; i++){
-            // Skip zero rows
-            for(end=i+1; end<=this->row && row_begin[end]==row_begin[end-1] ; end++);
+        // Zero rows have an empty range, no need to skip them.
+        for(i=0; i<this->row; i++){
             // Matrix multiplication
-            for(l=row_begin[i]; l<row_begin[end]; l++){
+            for(l=row_begin[i]; l<row_begin[i+1]; l++){
                 // While multiplying, also multiply with the scaler
                 ret[i] += (values[l] * vec[col_indices[l]] * sca);
             }
@@ -5,7 +5,6 @@
 #include <limits>
 #include <fstream>
 #include <iostream>
-#include <time.h>  //For clock_gettime
 #include <mpi.h>
 
 #define row_num 1850065
@@ -20,13 +19,41 @@ uint par_rows[4] = {0, 616688, 1233376, 1850065};
 #include "parser.h"
 #include "csrmatrix.h"
 #include "csv.h"
+#include "checkpoint.h"
+#include "trace.h"
 
 using namespace std;
 #define uint unsigned int
 
 int mypid, numprocs;
 
-void run_program(CSR_Matrix<double> *P){
+// Print top 5 elements and write them to result.csv. Only called on main thread.
+void write_results(CSR_Matrix<double> *P, const vector<double> &r_t){
+    vector<vector<string>>high;
+    double maxi, last = numeric_limits<double>::max();
+
+    cout << "First 5 elements:\n";
+    // Find max 5 elements with simple n*5 iteration
+    for(int i=0; i<5; i++){
+        int ind=0;
+        maxi = numeric_limits<double>::min();
+        for (int l=0; l<r_t.size(); l++){
+            if(maxi<r_t[l] && r_t[l]<last){
+                maxi = r_t[l];
+                ind = l;
+            }
+        }
+        cout << i+1 << ": " <<P->arr_dict[ind] << " : "<< maxi << endl;
+        last = maxi;
+        // Push elements in order.
+        high.push_back(vector<string>({to_string(high.size()+1), P->arr_dict[ind], number_to_string(maxi)}));
+    }
+    // Write result.csv
+    write_csv("result.csv", vector<string>({"No.", "Nodes", "Scores"}), high);
+}
+
+// Checkpoint and start are only used by main thread, which holds the whole vector.
+void run_program(CSR_Matrix<double> *P, Checkpointer *ckpt=NULL, const Checkpoint *start=NULL){
     // Set initial values
     int iterations=0;
     double alpha = 0.2;
@@ -34,17 +61,21 @@ void run_program(CSR_Matrix<double> *P){
     double difference = 0; // Keep it for MPI difference calculation
     vector<double> r_t(P->get_size().second, 1), r_t1, r_recv[numprocs-1];
 
-    // Time measure
-    struct timespec mt1, mt2;
-    long int tt;
-    
-    cout << "Matrix in size: " << P->get_size().first << " " << P->get_size().second <<endl;
-    clock_gettime (CLOCK_REALTIME, &mt1);
+    if(mypid==0 && start!=NULL){
+        assert(start->offset==0 && start->vec.size()==r_t.size());
+        r_t = start->vec;
+        iterations = start->iteration;
+        cout << "Resuming from iteration " << iterations << " with diff " << start->diff << endl;
+    }
+
+    trace_log(LOG_INFO) << "Matrix in size: " << P->get_size().first << " " << P->get_size().second <<endl;
+    TraceScope solve_phase("solve");
     
     if(mypid==0){
         // Begin operation. Keep going until vector diff is below epsilon
         // P->ops function is parallelised, this loop only performs minor operations.
         do{
+            TraceScope iteration_phase("iteration");
             // Send vector
             MPI_Barrier(MPI_COMM_WORLD);
             for(uint i=1; i<numprocs; i++){
@@ -67,15 +98,26 @@ void run_program(CSR_Matrix<double> *P){
             // Two vec diff is already 0 for main as it never run ops function
             MPI_Allreduce(&P->two_vec_diff, &difference, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
             iterations++;
-            cout << "Current Diff: "<<difference<< endl;
+            trace_counter("diff", difference);
+            trace_log(LOG_PROGRESS) << "Current Diff: "<<difference<< endl;
+            if(ckpt!=NULL && iterations%ckpt->interval==0){
+                ckpt->save(r_t, r_t.size(), 0, iterations, difference);
+            }
         } while(difference > epsillon);
+        if(ckpt!=NULL){
+            ckpt->save(r_t, r_t.size(), 0, iterations, difference);
+            ckpt->flush();
+        }
     }else{
         do{
+            TraceScope iteration_phase("iteration");
             // Receive vector
             MPI_Barrier(MPI_COMM_WORLD);
             MPI_Recv(&r_t[0], r_t.size(), MPI_DOUBLE, 0, mypid, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
             // Calculate partial vector
+            TraceScope ops_phase("ops");
             r_t1 = P->ops(r_t, alpha, 1-alpha, par_rows[mypid-1]);
+            ops_phase.stop();
             // Send it back to main thread for it to unite
             MPI_Barrier(MPI_COMM_WORLD);
             MPI_Send(&r_t1[0], par_rows[mypid]-par_rows[mypid-1], MPI_DOUBLE, 0, mypid, MPI_COMM_WORLD);
@@ -88,43 +130,160 @@ void run_program(CSR_Matrix<double> *P){
     if(mypid==0){
 
         // Print passed time. Also, this value will be used on schedule_program function.
-        clock_gettime (CLOCK_REALTIME, &mt2);
-        tt=1000000000*(mt2.tv_sec - mt1.tv_sec)+(mt2.tv_nsec - mt1.tv_nsec);
-        cout << "Completed in "<< iterations << " iterations..."<<endl;
-        cout << "Time passed: " << tt/1000000 << "msecs" << endl;
-
-        vector<vector<string>>high;
-        double maxi, last = numeric_limits<double>::max();
-
-        cout << "First 5 elements:\n";
-        // Find max 5 elements with simple n*5 iteration
-        for(int i=0; i<5; i++){
-            int ind=0;
-            maxi = numeric_limits<double>::min();
-            for (int l=0; l<r_t.size(); l++){
-                if(maxi<r_t[l] && r_t[l]<last){
-                    maxi = r_t[l];
-                    ind = l;
+        double tim = solve_phase.stop();
+        trace_log(LOG_INFO) << "Completed in "<< iterations << " iterations..."<<endl;
+        trace_log(LOG_INFO) << "Time passed: " << tim*1000 << "msecs" << endl;
+
+        write_results(P, r_t);
+    }
+}
+
+// Split n elements into parts nearly equal blocks. Returns parts+1 bounds.
+vector<uint> block_bounds(uint n, uint parts){
+    vector<uint> ret(parts+1);
+    for(uint i=0; i<=parts; i++){
+        ret[i] = (unsigned long long)n*i/parts;
+    }
+    return ret;
+}
+
+// 2D checkerboard partitioning on a q*q process grid. Process (r, c) has id r*q+c,
+// and holds the block of rows in row block r and columns in column block c.
+// Main thread splits its matrix and sends every block to its owner.
+CSR_Matrix<double> *distribute_2d(CSR_Matrix<double> *P, uint n, uint q){
+    vector<uint> par = block_bounds(n, q);
+    uint r = mypid/q, c = mypid%q;
+    uint header[3];
+    CSR_Matrix<double> *A = NULL;
+
+    if(mypid==0){
+        cout << "Starting 2D matrix partitioning on " << q << "x" << q << " grid..." << endl;
+        for(uint br=0; br<q; br++){
+            vector<CSR_Matrix<double>*> blocks = P->split_blocks(par[br], par[br+1], par);
+            for(uint bc=0; bc<q; bc++){
+                uint dest = br*q+bc;
+                if(dest==0){
+                    A = blocks[bc];
+                    continue;
                 }
+                header[0] = blocks[bc]->row;
+                header[1] = blocks[bc]->col;
+                header[2] = blocks[bc]->values.size();
+                MPI_Send(header, 3, MPI_UNSIGNED, dest, dest, MPI_COMM_WORLD);
+                MPI_Send(&blocks[bc]->row_begin[0], header[0]+1, MPI_UNSIGNED, dest, dest, MPI_COMM_WORLD);
+                MPI_Send(blocks[bc]->col_indices.data(), header[2], MPI_UNSIGNED, dest, dest, MPI_COMM_WORLD);
+                MPI_Send(blocks[bc]->values.data(), header[2], MPI_DOUBLE, dest, dest, MPI_COMM_WORLD);
+                delete blocks[bc];
+            }
+        }
+        cout << "Sent all blocks to threads" << endl;
+    }else{
+        MPI_Recv(header, 3, MPI_UNSIGNED, 0, mypid, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        A = new CSR_Matrix<double>(header[0], header[1]);
+        assert(A->row==par[r+1]-par[r] && A->col==par[c+1]-par[c]);
+        A->row_begin.resize(header[0]+1);
+        A->col_indices.resize(header[2]);
+        A->values.resize(header[2]);
+        MPI_Recv(&A->row_begin[0], header[0]+1, MPI_UNSIGNED, 0, mypid, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        MPI_Recv(A->col_indices.data(), header[2], MPI_UNSIGNED, 0, mypid, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        MPI_Recv(A->values.data(), header[2], MPI_DOUBLE, 0, mypid, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        A->index_rows();
+        cout << "Block (" << r << ", " << c << ") size for thread #" << mypid << ": " << header[2] << endl;
+    }
+    return A;
+}
+
+// Same algorithm on a 2D process grid. Diagonal process (k, k) owns the k-th piece
+// of the rank vector. Each iteration broadcasts pieces down process columns,
+// multiplies local blocks, and sums partial results along process rows onto
+// the diagonal. Communication per process is O(n/q) instead of O(n).
+// Only diagonal processes checkpoint, each to its own file holding its piece.
+void run_program_2d(CSR_Matrix<double> *A, CSR_Matrix<double> *P, uint n, uint q,
+                    Checkpointer *ckpt=NULL, const Checkpoint *start=NULL){
+    // Set initial values
+    int iterations=0;
+    double alpha = 0.2;
+    double epsillon = 1e-6;
+    double local_diff, difference = 0;
+    vector<uint> par = block_bounds(n, q);
+    uint r = mypid/q, c = mypid%q;
+    bool diag = (r==c);
+    // x holds column block c, y the row block r after reduction (diagonal only)
+    vector<double> x(par[c+1]-par[c], 1), y_part, y(par[r+1]-par[r]);
+    MPI_Comm row_comm, col_comm;
+
+    // Processes in the same grid row share rows, same grid column share columns.
+    // Ranks in sub communicators are c and r respectively, so diagonal is root of both.
+    MPI_Comm_split(MPI_COMM_WORLD, r, c, &row_comm);
+    MPI_Comm_split(MPI_COMM_WORLD, c, r, &col_comm);
+
+    if(diag && start!=NULL){
+        assert(start->total==n && start->offset==par[r] && start->vec.size()==x.size());
+        x = start->vec;
+        iterations = start->iteration;
+    }
+    // Every process counts iterations for checkpoint interval
+    MPI_Bcast(&iterations, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+    TraceScope solve_phase("solve");
+    do{
+        TraceScope iteration_phase("iteration");
+        // Diagonal process broadcasts its piece down the process column
+        MPI_Bcast(x.data(), x.size(), MPI_DOUBLE, c, col_comm);
+        // Local multiplication, then sum partial rows onto the diagonal process
+        TraceScope ops_phase("ops");
+        y_part = A->partial_ops(x, alpha);
+        ops_phase.stop();
+        MPI_Reduce(y_part.data(), y.data(), y.size(), MPI_DOUBLE, MPI_SUM, r, row_comm);
+        local_diff = 0;
+        if(diag){
+            for(uint i=0; i<y.size(); i++){
+                y[i] += (1-alpha)/n;
+                local_diff += abs(y[i]-x[i]);
             }
-            cout << i+1 << ": " <<P->arr_dict[ind] << " : "<< maxi << endl;
-            last = maxi;
-            // Push elements in order.
-            high.push_back(vector<string>({to_string(high.size()+1), P->arr_dict[ind], to_string(maxi)}));
+            x = y;
+        }
+        MPI_Allreduce(&local_diff, &difference, 1, MPI_DOUBLE, MPI_SUM, MPI_COMM_WORLD);
+        iterations++;
+        if(mypid==0){
+            trace_counter("diff", difference);
+            trace_log(LOG_PROGRESS) << "Current Diff: "<<difference<< endl;
+        }
+        if(diag && ckpt!=NULL && iterations%ckpt->interval==0){
+            ckpt->save(x, n, par[r], iterations, difference);
+        }
+    } while(difference > epsillon);
+    if(diag && ckpt!=NULL){
+        ckpt->save(x, n, par[r], iterations, difference);
+        ckpt->flush();
+    }
+
+    // Collect diagonal pieces on main thread
+    vector<double> r_t;
+    if(mypid==0){
+        r_t.resize(n);
+        copy(x.begin(), x.end(), r_t.begin());
+        for(uint k=1; k<q; k++){
+            MPI_Recv(&r_t[par[k]], par[k+1]-par[k], MPI_DOUBLE, k*q+k, k*q+k, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
         }
-        // Write result.csv
-        write_csv("result.csv", vector<string>({"No.", "Nodes", "Scores"}), high);
+    }else if(diag){
+        MPI_Send(x.data(), x.size(), MPI_DOUBLE, 0, mypid, MPI_COMM_WORLD);
+    }
+    MPI_Comm_free(&row_comm);
+    MPI_Comm_free(&col_comm);
+
+    double tim = solve_phase.stop();
+    if(mypid==0){
+        trace_log(LOG_INFO) << "Completed in "<< iterations << " iterations..."<<endl;
+        trace_log(LOG_INFO) << "Time passed: " << tim*1000 << "msecs" << endl;
+        write_results(P, r_t);
     }
 }
 
 // Autonomously run different testcases, and parse CSR Matrix
 int main(int argc, char** argv){
     ios::sync_with_stdio(false); // Comment if stdio has been used!!!
-    CSR_Matrix<double> *P;
-
-    // Time measure
-    struct timespec mt1, mt2;
-    long int tt;
+    CSR_Matrix<double> *P = NULL;
     
     // Initialize mpi
     MPI_Init (&argc, &argv);                        /* starts MPI */
@@ -132,13 +291,89 @@ int main(int argc, char** argv){
     MPI_Comm_rank (MPI_COMM_WORLD, &mypid);        /* get current process id */
     MPI_Comm_size (MPI_COMM_WORLD, &numprocs);     /* get number of processes */
 
-    clock_gettime (CLOCK_REALTIME, &mt1);
+    // Chrome trace of all ranks written by main thread (trace=trace.json) with a
+    // summary of phase times over ranks, console output level
+    // (verbosity=quiet|info|progress|debug). Removed from arguments.
+    string trace_file;
+    int kept_trace = 1;
+    for(int i=1; i<argc; i++){
+        if(strncmp(argv[i], "trace=", 6)==0){
+            trace_file = argv[i]+6;
+        }else if(strncmp(argv[i], "verbosity=", 10)==0){
+            if(!set_verbosity(argv[i]+10) && mypid==0){
+                cout << "Unknown verbosity: " << argv[i]+10 << endl;
+            }
+        }else{
+            argv[kept_trace++] = argv[i];
+        }
+    }
+    argc = kept_trace;
+    Tracer::get().pid = mypid;
+    TraceScope program_phase("program");
+
+    // Huge pages and NUMA placement of matrix arrays (pages=none|thp|hugetlb,
+    // numa=firsttouch|interleave), see alloc.h. Removed from arguments.
+    int kept = 1;
+    for(int i=1; i<argc; i++){
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        if(eq==string::npos || !memory_option(arg.substr(0, eq), arg.substr(eq+1))){
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+
+    // 2D checkerboard partitioning if requested (2d [load|save filename]).
+    // Requires a square number of processes.
+    bool grid_mode = (argc>=2 && strcmp(argv[1], "2d")==0);
+    uint q = 0, n = 0;
+    if(grid_mode){
+        argc--;
+        argv++;
+        while((q+1)*(q+1)<=numprocs) q++;
+        if(q*q!=numprocs){
+            if(mypid==0){
+                cout << "2D partitioning needs a square number of processes, got " << numprocs << endl;
+            }
+            MPI_Finalize();
+            return 1;
+        }
+    }
+
+    // Optional periodic checkpoints (checkpoint ckpt.bin) or continue from them
+    // (resume ckpt.bin) as last arguments. In 2D mode every diagonal process
+    // uses its own file, ckpt.bin.<process id>.
+    string ckpt_file;
+    bool resume = false;
+    if(argc>=3 && (strcmp(argv[argc-2], "checkpoint")==0 || strcmp(argv[argc-2], "resume")==0)){
+        ckpt_file = argv[argc-1];
+        resume = strcmp(argv[argc-2], "resume")==0;
+        argc -= 2;
+    }
+    if(grid_mode && !ckpt_file.empty()){
+        ckpt_file += "." + to_string(mypid);
+    }
+    // Which processes own a part of the rank vector
+    bool owner = grid_mode ? (mypid/q==mypid%q) : (mypid==0);
+    Checkpointer *ckpt = NULL;
+    Checkpoint start;
+    if(owner && !ckpt_file.empty()){
+        if(resume && !read_checkpoint(ckpt_file, start)){
+            cout << "Cannot read checkpoint: " << ckpt_file << endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+        ckpt = new Checkpointer(ckpt_file);
+    }
     
     // Initialize CSR matrix. Either parse from file,
     // or load from dumped csv file if requested. (load filename)
     if(mypid==0){
         if(argc>=3 && strcmp(argv[1], "load")==0){
             P = new CSR_Matrix<double>(string(argv[2]));
+            if(!P->loaded){
+                cout << "Cannot read matrix: " << argv[2] << endl;
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
         }
         else{
             P = parse("graph.txt");
@@ -147,38 +382,52 @@ int main(int argc, char** argv){
                 P->write(argv[2]);
             }
         }
+        n = P->get_size().second;
+        // 1D: main thread's checkpoint must hold the whole vector of this matrix
+        if(!grid_mode && resume && (start.offset!=0 || start.total!=n || start.vec.size()!=n)){
+            cout << "Cannot read checkpoint: " << ckpt_file << endl;
+            MPI_Abort(MPI_COMM_WORLD, 1);
+        }
+    }
+
+    if(grid_mode){
+        // Every process needs the global size for block bounds
+        MPI_Bcast(&n, 1, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
+        // 2D: every diagonal checkpoint must hold its own piece of this matrix's vector
+        if(owner && resume){
+            vector<uint> par = block_bounds(n, q);
+            uint r = mypid/q;
+            if(start.total!=n || start.offset!=par[r] || start.vec.size()!=par[r+1]-par[r]){
+                cout << "Cannot read checkpoint: " << ckpt_file << endl;
+                MPI_Abort(MPI_COMM_WORLD, 1);
+            }
+        }
+        CSR_Matrix<double> *A = distribute_2d(P, n, q);
+        MPI_Barrier(MPI_COMM_WORLD);
+        run_program_2d(A, P, n, q, ckpt, resume ? &start : NULL);
+        delete A;
+    }else if(mypid==0){
         cout << "Starting matrix partitioning without METIS..." << endl;
         MPI_Barrier(MPI_COMM_WORLD);
-        uint last=0;
-        vector<uint>mod_row(P->row_begin.size());
         for(uint i=1; i<numprocs; i++){
-            uint l=par_rows[i-1], beg;
-            for(; l<par_rows[i]; l++){
-                if(l==0 && last==0){
-                    mod_row[l-par_rows[i-1]] = -1;
-                } else if(P->row_begin[l-1]==P->row_begin[l]){
-                    mod_row[l-par_rows[i-1]]=-1;
-                } else{
-                    break;
-                }
-            }
-            beg = P->row_begin[l];
-            for(; l<par_rows[i]; l++){
-                mod_row[l-par_rows[i-1]] = P->row_begin[l]-beg;
+            // row_begin is monotone, so a slice only needs to be rebased to start at 0
+            uint beg = P->row_begin[par_rows[i-1]];
+            vector<uint> mod_row(P->row_begin.begin()+par_rows[i-1], P->row_begin.begin()+par_rows[i]+1);
+            for(uint l=0; l<mod_row.size(); l++){
+                mod_row[l] -= beg;
             }
-            mod_row[l-par_rows[i-1]] = P->row_begin[l]-beg;
-            MPI_Send(&P->row_begin[par_rows[i-1]], par_rows[i]-par_rows[i-1]+1, MPI_UNSIGNED, i, i, MPI_COMM_WORLD);
+            MPI_Send(&mod_row[0], mod_row.size(), MPI_UNSIGNED, i, i, MPI_COMM_WORLD);
         }
         MPI_Barrier(MPI_COMM_WORLD);
         
         for(uint i=1; i<numprocs; i++){
-            uint siz = (P->row_begin[par_rows[i]]==-1 ? 0 : P->row_begin[par_rows[i]])-(P->row_begin[par_rows[i-1]]==-1 ? 0 : P->row_begin[par_rows[i-1]]);
-            MPI_Send(&P->col_indices[P->row_begin[par_rows[i-1]]==-1 ? 0 : P->row_begin[par_rows[i-1]]], siz, MPI_UNSIGNED, i, i, MPI_COMM_WORLD);
+            uint siz = P->row_begin[par_rows[i]]-P->row_begin[par_rows[i-1]];
+            MPI_Send(&P->col_indices[P->row_begin[par_rows[i-1]]], siz, MPI_UNSIGNED, i, i, MPI_COMM_WORLD);
         }
         MPI_Barrier(MPI_COMM_WORLD);
         for(uint i=1; i<numprocs; i++){
-            uint siz = (P->row_begin[par_rows[i]]==-1 ? 0 : P->row_begin[par_rows[i]])-(P->row_begin[par_rows[i-1]]==-1 ? 0 : P->row_begin[par_rows[i-1]]);
-            MPI_Send(&P->values[P->row_begin[par_rows[i-1]]==-1 ? 0 : P->row_begin[par_rows[i-1]]], siz, MPI_DOUBLE, i, i, MPI_COMM_WORLD);
+            uint siz = P->row_begin[par_rows[i]]-P->row_begin[par_rows[i-1]];
+            MPI_Send(&P->values[P->row_begin[par_rows[i-1]]], siz, MPI_DOUBLE, i, i, MPI_COMM_WORLD);
         }
         cout << "Sent all values to threads" << endl;
     }else{
@@ -189,7 +438,7 @@ int main(int argc, char** argv){
         MPI_Barrier(MPI_COMM_WORLD);
         MPI_Recv(&P->row_begin[0], P->row+1, MPI_UNSIGNED, 0, mypid, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
 
-        uint siz = (P->row_begin.back()==-1 ? 0 : P->row_begin.back());
+        uint siz = P->row_begin.back();
         cout << "Actual size for thread #" << mypid <<": " <<siz <<  endl;
 
         // Get col_indices
@@ -201,21 +450,30 @@ int main(int argc, char** argv){
         P->values.resize(siz);
         MPI_Barrier(MPI_COMM_WORLD);
         MPI_Recv(&P->values[0], P->values.size(), MPI_DOUBLE, 0, mypid, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+        P->index_rows();
         cout << "CSR Matrix Initialized for thread #" << mypid<< endl;
     }
-    MPI_Barrier(MPI_COMM_WORLD);
-    
-    // Run program
-    run_program(P);
+    if(!grid_mode){
+        MPI_Barrier(MPI_COMM_WORLD);
+
+        // Run program
+        run_program(P, ckpt, resume ? &start : NULL);
+    }
 
 
+    double tim = program_phase.stop();
     if(mypid==0){
         // Print runtime and exit.
-        clock_gettime (CLOCK_REALTIME, &mt2);
-        tt=1000000000*(mt2.tv_sec - mt1.tv_sec)+(mt2.tv_nsec - mt1.tv_nsec);
-        cout << "Program finished in: " << tt/1000000 << "msecs" << endl;
+        cout << "Program finished in: " << tim*1000 << "msecs" << endl;
+    }
+    if(!trace_file.empty()){
+        print_summary_mpi(MPI_COMM_WORLD);
+        if(!write_chrome_mpi(trace_file, MPI_COMM_WORLD)){
+            cout << "Cannot write trace: " << trace_file << endl;
+        }
     }
 
+    delete ckpt;
     delete P;
     MPI_Finalize();
     return 0;
@@ -12,6 +12,7 @@
 #include <assert.h>
 
 #include "csrmatrix.h"
+#include "trace.h"
 
 using namespace std;
 typedef unsigned int uint;
@@ -34,12 +35,9 @@ CSR_Matrix<double> *parse(const string &filename){
 
     int i=0, p1, p2;
 
-    // Time measure
-    struct timespec mt1, mt2;
-    long int tt;
-    
-    clock_gettime (CLOCK_REALTIME, &mt1);
-    cout << "Reading file..." << endl;
+    TraceScope parse_phase("parse");
+    TraceScope read_phase("read");
+    trace_log(LOG_INFO) << "Reading file..." << endl;
 
     // Approximate size initialization (dropped time from 53 sec to 47 sec)
     temp.reserve(17000000);
@@ -50,7 +48,7 @@ CSR_Matrix<double> *parse(const string &filename){
     string t1, t2;
     while (!in.eof()){
         if(i%1000000==0){
-            cout << i << endl;
+            trace_log(LOG_PROGRESS) << i << endl;
         }
         in >> t1 >> t2;
         temp.push_back({t2, t1});
@@ -60,15 +58,13 @@ CSR_Matrix<double> *parse(const string &filename){
     }
     in.close();
     
-    clock_gettime (CLOCK_REALTIME, &mt2);
-    tt=1000000000*(mt2.tv_sec - mt1.tv_sec)+(mt2.tv_nsec - mt1.tv_nsec);
-    cout << "Time passed: " << tt/1000000 << "msecs" << endl;
+    trace_log(LOG_INFO) << "Time passed: " << read_phase.stop()*1000 << "msecs" << endl;
 
-    cout << "Total unique sites: " << unique_arr.size() << endl;
+    trace_log(LOG_INFO) << "Total unique sites: " << unique_arr.size() << endl;
 
 
-    clock_gettime (CLOCK_REALTIME, &mt1);
-    cout << "Creating numeration..." << endl;
+    TraceScope enumerate_phase("enumerate");
+    trace_log(LOG_INFO) << "Creating numeration..." << endl;
 
     // Time passed: 3sec, but hard to parallelize (No need to parallelize either)
     // Enumerate each unique element
@@ -82,12 +78,10 @@ CSR_Matrix<double> *parse(const string &filename){
     // Resize vectors for parallelisation and performance
     link_to.resize(arr_dict.size());
     link_by.resize(arr_dict.size());
-    clock_gettime (CLOCK_REALTIME, &mt2);
-    tt=1000000000*(mt2.tv_sec - mt1.tv_sec)+(mt2.tv_nsec - mt1.tv_nsec);
-    cout << "Time passed: " << tt/1000000 << "msecs" << endl;
+    trace_log(LOG_INFO) << "Time passed: " << enumerate_phase.stop()*1000 << "msecs" << endl;
 
-    clock_gettime (CLOCK_REALTIME, &mt1);
-    cout << "Creating nodes..." << endl;
+    TraceScope nodes_phase("nodes");
+    trace_log(LOG_INFO) << "Creating nodes..." << endl;
 
     // Parallelization dropped time from 20 sec to 8 sec
     // Unrecorded in csv file as not requested
@@ -103,17 +97,13 @@ CSR_Matrix<double> *parse(const string &filename){
     // Delete unused vectors
     temp.clear();
 
-    clock_gettime (CLOCK_REALTIME, &mt2);
-    tt=1000000000*(mt2.tv_sec - mt1.tv_sec)+(mt2.tv_nsec - mt1.tv_nsec);
-    cout << "Time passed: " << tt/1000000 << "msecs" << endl;
+    trace_log(LOG_INFO) << "Time passed: " << nodes_phase.stop()*1000 << "msecs" << endl;
 
-    clock_gettime (CLOCK_REALTIME, &mt1);
-    cout << "Creating CSR Matrix..." << endl;
+    TraceScope build_phase("build");
+    trace_log(LOG_INFO) << "Creating CSR Matrix..." << endl;
     // Create CSR matrix
     csr = new CSR_Matrix<double>(link_to, link_by, name_dict, arr_dict);
-    clock_gettime (CLOCK_REALTIME, &mt2);
-    tt=1000000000*(mt2.tv_sec - mt1.tv_sec)+(mt2.tv_nsec - mt1.tv_nsec);
-    cout << "Time passed: " << tt/1000000 << "msecs" << endl;
+    trace_log(LOG_INFO) << "Time passed: " << build_phase.stop()*1000 << "msecs" << endl;
     return csr;
 };
 
@@ -13,11 +13,27 @@
 #include <assert.h>
 
 #include "csrmatrix.h"
+#include "input.h"
+#include "graphstats.h"
+#include "trace.h"
 
 using namespace std;
 typedef unsigned int uint;
 
-CSR_Matrix<double> *parse(const string &filename){
+// Seconds spent in each phase of parse
+struct ParseTimes{
+    double read=0;      // Reading file and collecting unique names
+    double enumerate=0; // Assigning indices to names
+    double nodes=0;     // Building adjacency lists
+    double build=0;     // Building CSR matrix
+};
+
+// If times is given, phase timings are also stored there (for benchmarks).
+// With out_links, the transposed (out-link) matrix is built in the same pass.
+// If stats is given, graph statistics are collected from the adjacency lists
+// before they are turned into the matrix.
+// Returns NULL if file cannot be read.
+CSR_Matrix<double> *parse(const string &filename, ParseTimes *times=NULL, bool out_links=false, GraphStats *stats=NULL){
     // CSR matrix pointer
     CSR_Matrix<double> *csr;
     // Right to left unidirectional graph
@@ -28,17 +44,17 @@ CSR_Matrix<double> *parse(const string &filename){
     unordered_map<string, int> name_dict;
     // Index to name dictionary
     vector<string> arr_dict;
-    // Timing variables
-    double tim_st, tim_end;
 
     unordered_set<string> unique_arr;
     vector<pair<string, string>>temp;
-    ifstream in(filename);
+    // Plain, gzip or zstd, decompressed on its own thread
+    TokenReader in(filename);
 
     int i=0, p1, p2;
 
-    tim_st = omp_get_wtime( );
-    cout << "Reading file..." << endl;
+    TraceScope parse_phase("parse");
+    TraceScope read_phase("read");
+    trace_log(LOG_INFO) << "Reading file..." << endl;
 
     // Approximate size initialization (dropped time from 53 sec to 47 sec)
     temp.reserve(17000000);
@@ -47,26 +63,31 @@ CSR_Matrix<double> *parse(const string &filename){
     // Time passed: 53sec, but not parallelizable (Attempts made it worse)
     // Read file, and insert them into unordered_set to keep track of unique elements
     string t1, t2;
-    while (!in.eof()){
+    while (in.next(t1) && in.next(t2)){
         if(i%1000000==0){
-            cout << i << endl;
+            trace_log(LOG_PROGRESS) << i << endl;
         }
-        in >> t1 >> t2;
         temp.push_back({t2, t1});
         unique_arr.insert(t1);
         unique_arr.insert(t2);
         i++;
     }
-    in.close();
+    if(in.failed()){
+        cout << "Cannot read graph: " << filename << endl;
+        return NULL;
+    }
     
-    tim_end = omp_get_wtime( );
-    cout << "Time passed: " << tim_end-tim_st << endl;
+    double tim = read_phase.stop();
+    trace_log(LOG_INFO) << "Time passed: " << tim << endl;
+    if(times!=NULL){
+        times->read = tim;
+    }
 
-    cout << "Total unique sites: " << unique_arr.size() << endl;
+    trace_log(LOG_INFO) << "Total unique sites: " << unique_arr.size() << endl;
 
 
-    tim_st = omp_get_wtime( );
-    cout << "Creating numeration..." << endl;
+    TraceScope enumerate_phase("enumerate");
+    trace_log(LOG_INFO) << "Creating numeration..." << endl;
 
     // Time passed: 3sec, but hard to parallelize (No need to parallelize either)
     // Enumerate each unique element
@@ -80,11 +101,14 @@ CSR_Matrix<double> *parse(const string &filename){
     // Resize vectors for parallelisation and performance
     link_to.resize(arr_dict.size());
     link_by.resize(arr_dict.size());
-    tim_end = omp_get_wtime( );
-    cout << "Time passed: " << tim_end-tim_st << endl;
+    tim = enumerate_phase.stop();
+    trace_log(LOG_INFO) << "Time passed: " << tim << endl;
+    if(times!=NULL){
+        times->enumerate = tim;
+    }
 
-    tim_st = omp_get_wtime( );
-    cout << "Creating nodes..." << endl;
+    TraceScope nodes_phase("nodes");
+    trace_log(LOG_INFO) << "Creating nodes..." << endl;
 
     // Parallelization dropped time from 20 sec to 8 sec
     // Unrecorded in csv file as not requested
@@ -104,15 +128,28 @@ CSR_Matrix<double> *parse(const string &filename){
     // Delete unused vectors
     temp.clear();
 
-    tim_end = omp_get_wtime( );
-    cout << "Time passed: " << tim_end-tim_st << endl;
+    tim = nodes_phase.stop();
+    trace_log(LOG_INFO) << "Time passed: " << tim << endl;
+    if(times!=NULL){
+        times->nodes = tim;
+    }
+
+    if(stats!=NULL){
+        TraceScope stats_phase("stats");
+        trace_log(LOG_INFO) << "Collecting statistics..." << endl;
+        stats->collect(link_to, link_by, omp_get_max_threads());
+        trace_log(LOG_INFO) << "Time passed: " << stats->time << endl;
+    }
 
-    tim_st = omp_get_wtime( );
-    cout << "Creating CSR Matrix..." << endl;
+    TraceScope build_phase("build");
+    trace_log(LOG_INFO) << "Creating CSR Matrix..." << endl;
     // Create CSR matrix
-    csr = new CSR_Matrix<double>(link_to, link_by, name_dict, arr_dict);
-    tim_end = omp_get_wtime( );
-    cout << "Time passed: " << tim_end-tim_st << endl;
+    csr = new CSR_Matrix<double>(link_to, link_by, name_dict, arr_dict, out_links);
+    tim = build_phase.stop();
+    trace_log(LOG_INFO) << "Time passed: " << tim << endl;
+    if(times!=NULL){
+        times->build = tim;
+    }
     return csr;
 };
 
@@ -0,0 +1,214 @@
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+
+#include <vector>
+#include <atomic>
+#include <string>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <omp.h>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+#include "alloc.h"
+
+using namespace std;
+typedef unsigned int uint;
+
+// Highest thread count that can be profiled
+#define SPMV_PROFILE_MAX_THREADS 256
+
+// Hardware counters read around each thread's share of an ops call
+enum PerfCounterId{
+    PERF_CYCLES = 0,
+    PERF_INSTRUCTIONS,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_COUNTER_NUM
+};
+
+// Counters of a single OS thread. Linux perf_event_open with pid=0 only
+// counts the calling thread, so every OpenMP thread opens its own set.
+class PerfThreadCounters{
+    private:
+    int fds[PERF_COUNTER_NUM];
+    pid_t owner = -1;
+
+    static int open_counter(uint32_t type, uint64_t config){
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = type;
+        attr.config = config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    public:
+    PerfThreadCounters(const PerfThreadCounters &) = delete;
+    PerfThreadCounters &operator=(const PerfThreadCounters &) = delete;
+
+    PerfThreadCounters(){
+        for(int c=0; c<PERF_COUNTER_NUM; c++){
+            fds[c] = -1;
+        }
+    }
+
+    ~PerfThreadCounters(){
+        close_all();
+    }
+
+    void close_all(){
+        for(int c=0; c<PERF_COUNTER_NUM; c++){
+            if(fds[c]>=0){
+                close(fds[c]);
+            }
+            fds[c] = -1;
+        }
+        owner = -1;
+    }
+
+    // Open counters for the calling thread, unless already open for it.
+    // OpenMP may run a thread number on another OS thread after team size changes.
+    // Returns false if no counter is available (no PMU, or perf_event_paranoid).
+    bool open_for_current(){
+        pid_t tid = syscall(SYS_gettid);
+        if(tid==owner){
+            return available();
+        }
+        close_all();
+        owner = tid;
+        uint64_t cache_read_miss = (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        fds[PERF_CYCLES] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+        fds[PERF_INSTRUCTIONS] = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+        fds[PERF_LLC_MISSES] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | cache_read_miss);
+        fds[PERF_DTLB_MISSES] = open_counter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | cache_read_miss);
+        return available();
+    }
+
+    bool available() const{
+        for(int c=0; c<PERF_COUNTER_NUM; c++){
+            if(fds[c]>=0){
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void start(){
+        for(int c=0; c<PERF_COUNTER_NUM; c++){
+            if(fds[c]>=0){
+                ioctl(fds[c], PERF_EVENT_IOC_RESET, 0);
+                ioctl(fds[c], PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+    }
+
+    // Stop and add counts to out. Unavailable counters are left untouched.
+    void stop(long long *out){
+        for(int c=0; c<PERF_COUNTER_NUM; c++){
+            if(fds[c]>=0){
+                long long value;
+                ioctl(fds[c], PERF_EVENT_IOC_DISABLE, 0);
+                if(read(fds[c], &value, sizeof(value))==sizeof(value)){
+                    out[c] += value;
+                }
+            }
+        }
+    }
+};
+
+// What a single thread did during ops calls
+struct SpmvThreadSample{
+    double busy=0;                        // Seconds inside its share of the loop
+    unsigned long long rows=0, nnz=0;
+    long long counters[PERF_COUNTER_NUM] = {0};
+    int calls=0;
+};
+
+// Per thread instrumentation of CSR_Matrix::ops. Set CSR_Matrix::profile to
+// enable it. Samples are accumulated until clear(), so a benchmark can sum
+// all timed calls of one configuration.
+class SpmvProfile{
+    private:
+    vector<PerfThreadCounters> counters;
+    vector<double> started;
+    // Whether begin started the counters of a thread, so end stops the same ones
+    vector<char> counting;
+
+    public:
+    // Whether hardware counters could be opened. Time, rows and nnz are always recorded.
+    // Cleared by the first thread that fails while the others read it.
+    atomic<bool> hardware{true};
+    vector<SpmvThreadSample> threads;
+
+    SpmvProfile() : counters(SPMV_PROFILE_MAX_THREADS), started(SPMV_PROFILE_MAX_THREADS),
+                    counting(SPMV_PROFILE_MAX_THREADS, 0), threads(SPMV_PROFILE_MAX_THREADS){}
+
+    // Called by every thread when it starts its share
+    void begin(int tid){
+        assert(tid<(int)counters.size());
+        counting[tid] = hardware && counters[tid].open_for_current();
+        if(counting[tid]){
+            counters[tid].start();
+        }else if(hardware.exchange(false)){
+            cout << "Hardware counters unavailable (check perf_event_paranoid), recording time only" << endl;
+        }
+        started[tid] = omp_get_wtime();
+    }
+
+    // Called by every thread when it finishes its share (before waiting others)
+    void end(int tid, unsigned long long rows, unsigned long long nnz){
+        SpmvThreadSample &s = threads[tid];
+        s.busy += omp_get_wtime()-started[tid];
+        if(counting[tid]){
+            counters[tid].stop(s.counters);
+        }
+        s.rows += rows;
+        s.nnz += nnz;
+        s.calls++;
+    }
+
+    void clear(){
+        threads.assign(threads.size(), SpmvThreadSample());
+    }
+};
+
+// STREAM style triad a = b + s*c with all threads, for a bandwidth baseline.
+// Arrays are left uninitialised and first written in parallel before timing, so
+// their pages are placed like those of the matrix. Returns best of reps in GB/s.
+inline double stream_triad_gbs(size_t n=1<<23, int reps=5){
+    page_vector<double> a(n), b(n), c(n);
+    double best = 0;
+    long long i;
+    #pragma omp parallel for schedule(static)
+    for(i=0; i<(long long)n; i++){
+        a[i] = 0;
+        b[i] = 1;
+        c[i] = 2;
+    }
+    for(int r=0; r<reps; r++){
+        double t = omp_get_wtime();
+        #pragma omp parallel for schedule(static)
+        for(i=0; i<(long long)n; i++){
+            a[i] = b[i] + 3.0*c[i];
+        }
+        t = omp_get_wtime()-t;
+        best = max(best, 3.0*sizeof(double)*n/t/1e9);
+    }
+    // Keep the compiler from dropping the loops
+    if(a[n/2]!=7.0){
+        cout << "Unexpected triad result" << endl;
+    }
+    return best;
+}
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+
+#include "trace.h"
+
+using namespace std;
+
+// Prints "Current Diff" lines on a background thread, so the solving thread
+// only queues a number instead of waiting for cout.
+class ProgressLog{
+    private:
+    thread printer;
+    mutex mtx;
+    condition_variable cv;
+    deque<double> diffs;
+    bool stop=false;
+
+    void loop(){
+        unique_lock<mutex> lock(mtx);
+        while(true){
+            cv.wait(lock, [this]{ return !diffs.empty() || stop; });
+            if(diffs.empty()){
+                break;
+            }
+            double diff = diffs.front();
+            diffs.pop_front();
+            lock.unlock();
+            trace_log(LOG_PROGRESS) << "Current Diff: " << diff << endl;
+            lock.lock();
+        }
+    }
+
+    public:
+    ProgressLog(){
+        printer = thread(&ProgressLog::loop, this);
+    }
+
+    // Prints everything posted before returning
+    ~ProgressLog(){
+        {
+            lock_guard<mutex> lock(mtx);
+            stop = true;
+        }
+        cv.notify_all();
+        printer.join();
+    }
+
+    void post(double diff){
+        trace_counter("diff", diff);
+        {
+            lock_guard<mutex> lock(mtx);
+            diffs.push_back(diff);
+        }
+        cv.notify_one();
+    }
+};
+
+#endif
@@ -0,0 +1,134 @@
+#ifndef PUSHBLOCK_H
+#define PUSHBLOCK_H
+
+#include <vector>
+#include <algorithm>
+#include <unistd.h>
+#include <omp.h>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+#include "alloc.h"
+
+using namespace std;
+typedef unsigned int uint;
+
+// Push style SpMV with propagation blocking, from the out-link (transposed) matrix.
+// Sources are split into blocks. Binning phase: every block walks its sources and
+// writes x[j]*value of every out-link sequentially into the bin of its destination
+// range. Accumulate phase: every bin is added into its slice of the result, which
+// fits in cache. Random reads of the pull kernel become sequential writes and reads.
+// Destinations of every bin entry never change, so they are stored once here and
+// only contributions are rewritten each iteration. Layout is bin major, block minor:
+//   offset[b*blocks+k] .. offset[b*blocks+k+1]   entries written by block k into bin b
+template<typename T>
+class PushBlocking{
+    public:
+    uint rows, cols;
+    uint width, bins, blocks;
+    // First source of every block, nnz balanced
+    vector<uint> block_begin;
+    page_vector<unsigned long long> offset;
+    page_vector<uint> dest;
+    page_vector<T> contrib;
+
+    // rows/cols of the transposed matrix: rows are sources, cols destinations
+    PushBlocking(uint rows, uint cols, const uint *row_begin, const uint *col_indices, uint width, uint blocks)
+        : rows(rows), cols(cols), width(max(width, 1u)), blocks(max(blocks, 1u)){
+        bins = cols==0 ? 0 : (cols-1)/this->width+1;
+        unsigned long long nnz = row_begin[rows];
+        block_begin.resize(this->blocks+1);
+        for(uint k=0; k<this->blocks; k++){
+            block_begin[k] = upper_bound(row_begin, row_begin+rows, nnz*k/this->blocks) - row_begin;
+        }
+        block_begin[0] = 0;
+        block_begin[this->blocks] = rows;
+
+        // Entries of every (bin, block), then prefix sum
+        offset.assign((unsigned long long)bins*this->blocks+1, 0);
+        long long k;
+        #pragma omp parallel for schedule(static)
+        for(k=0; k<this->blocks; k++){
+            for(uint j=block_begin[k]; j<block_begin[k+1]; j++){
+                for(uint l=row_begin[j]; l<row_begin[j+1]; l++){
+                    offset[(unsigned long long)(col_indices[l]/this->width)*this->blocks+k+1]++;
+                }
+            }
+        }
+        for(unsigned long long i=0; i<(unsigned long long)bins*this->blocks; i++){
+            offset[i+1] += offset[i];
+        }
+        dest.resize(nnz);
+        contrib.resize(nnz);
+        #pragma omp parallel for schedule(static)
+        for(k=0; k<this->blocks; k++){
+            vector<unsigned long long> cur(bins);
+            for(uint b=0; b<bins; b++){
+                cur[b] = offset[(unsigned long long)b*this->blocks+k];
+            }
+            for(uint j=block_begin[k]; j<block_begin[k+1]; j++){
+                for(uint l=row_begin[j]; l<row_begin[j+1]; l++){
+                    dest[cur[col_indices[l]/this->width]++] = col_indices[l];
+                }
+            }
+        }
+    }
+
+    // ret = init + sca * (M x), where row_begin, col_indices, values are the same
+    // transposed arrays given to the constructor. Returns sum |ret-x| (square matrices).
+    T multiply(const uint *row_begin, const uint *col_indices, const T *values,
+               const T *x, T sca, T init, page_vector<T> &ret){
+        T diff = 0;
+        long long k;
+        ret.resize(cols);
+        #pragma omp parallel private(k) reduction(+: diff)
+        {
+            // Binning, every block writes its own bin ranges sequentially
+            vector<unsigned long long> cur(bins);
+            #pragma omp for schedule(static)
+            for(k=0; k<blocks; k++){
+                for(uint b=0; b<bins; b++){
+                    cur[b] = offset[(unsigned long long)b*blocks+k];
+                }
+                for(uint j=block_begin[k]; j<block_begin[k+1]; j++){
+                    T xj = x[j];
+                    for(uint l=row_begin[j]; l<row_begin[j+1]; l++){
+                        contrib[cur[col_indices[l]/width]++] = xj*values[l];
+                    }
+                }
+            }
+            // Accumulate, one bin (result slice) at a time
+            #pragma omp for schedule(dynamic, 1)
+            for(k=0; k<bins; k++){
+                uint first = k*width, last = min<unsigned long long>((unsigned long long)(k+1)*width, cols);
+                for(uint i=first; i<last; i++){
+                    ret[i] = 0;
+                }
+                unsigned long long end = offset[(k+1)*blocks];
+                for(unsigned long long e=offset[k*blocks]; e<end; e++){
+                    ret[dest[e]] += contrib[e];
+                }
+                for(uint i=first; i<last; i++){
+                    ret[i] = init + ret[i]*sca;
+                    diff += abs(ret[i]-x[i]);
+                }
+            }
+        }
+        return diff;
+    }
+
+    unsigned long long bytes() const{
+        return (unsigned long long)offset.size()*sizeof(unsigned long long)
+             + (unsigned long long)dest.size()*sizeof(uint) + (unsigned long long)contrib.size()*sizeof(T);
+    }
+};
+
+// Destinations per bin so a result slice fills half of L2 (64 KiB if unknown)
+inline uint push_bin_width(uint elem_size){
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    return (l2>0 ? l2/2 : 1<<16)/elem_size;
+}
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef SEGMENT_H
+#define SEGMENT_H
+
+#include <vector>
+#include <algorithm>
+#include <climits>
+#include <unistd.h>
+#include <omp.h>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+#include "alloc.h"
+
+using namespace std;
+typedef unsigned int uint;
+
+// Column segmented copy of a CSR matrix (CSR segmenting). Columns are cut into
+// segments of "width" columns, so the part of the vector a segment gathers from
+// fits in cache. Every segment keeps only its non zero rows (DCSR style):
+//   rows[row_offset[s] .. row_offset[s+1])     rows of segment s, increasing
+//   row_ptr[row_offset[s]+s .. +rows_s]        their nonzero ranges, with an end entry
+//   col_indices, values                        nonzeros of all segments, segment major
+// Segments are multiplied one after another, rows of a segment are split between threads.
+template<typename T>
+class ColumnSegments{
+    public:
+    uint width = 0, segments = 0;
+    page_vector<uint> row_offset;
+    page_vector<uint> rows;
+    page_vector<uint> row_ptr;
+    page_vector<uint> col_indices;
+    page_vector<T> values;
+
+    // Build from CSR arrays. Every thread handles a block of rows and counts its
+    // rows and nonzeros per segment, so the fill pass needs no atomics and keeps
+    // rows (and the order of nonzeros within a row) as in the source.
+    ColumnSegments(uint row, uint col, const uint *src_row_begin, const uint *src_col, const T *src_val, uint width)
+        : width(width){
+        assert(width>0);
+        segments = col==0 ? 0 : (col-1)/width+1;
+        int nthreads = omp_get_max_threads();
+        uint nnz = src_row_begin[row];
+        // Per thread and segment counts, then start positions (segment major, thread minor)
+        vector<vector<uint>> seg_rows(nthreads, vector<uint>(segments, 0));
+        vector<vector<uint>> seg_nnz(nthreads, vector<uint>(segments, 0));
+        vector<uint> block(nthreads+1);
+        for(int t=0; t<=nthreads; t++){
+            block[t] = upper_bound(src_row_begin, src_row_begin+row, (unsigned long long)nnz*t/nthreads) - src_row_begin;
+        }
+        block[0] = 0;
+        block[nthreads] = row;
+
+        #pragma omp parallel num_threads(nthreads)
+        {
+            int tid = omp_get_thread_num();
+            vector<uint> last(segments, UINT_MAX);
+            for(uint i=block[tid]; i<block[tid+1]; i++){
+                for(uint l=src_row_begin[i]; l<src_row_begin[i+1]; l++){
+                    uint s = src_col[l]/width;
+                    if(last[s]!=i){
+                        last[s] = i;
+                        seg_rows[tid][s]++;
+                    }
+                    seg_nnz[tid][s]++;
+                }
+            }
+        }
+
+        row_offset.resize(segments+1);
+        vector<uint> nnz_offset(segments+1);
+        uint total_rows = 0, total_nnz = 0;
+        for(uint s=0; s<segments; s++){
+            row_offset[s] = total_rows;
+            nnz_offset[s] = total_nnz;
+            for(int t=0; t<nthreads; t++){
+                uint r = seg_rows[t][s], n = seg_nnz[t][s];
+                seg_rows[t][s] = total_rows;
+                seg_nnz[t][s] = total_nnz;
+                total_rows += r;
+                total_nnz += n;
+            }
+        }
+        row_offset[segments] = total_rows;
+        nnz_offset[segments] = total_nnz;
+        rows.resize(total_rows);
+        row_ptr.resize(total_rows+segments);
+        col_indices.resize(total_nnz);
+        values.resize(total_nnz);
+
+        #pragma omp parallel num_threads(nthreads)
+        {
+            int tid = omp_get_thread_num();
+            vector<uint> &next_row = seg_rows[tid], &next_nnz = seg_nnz[tid];
+            vector<uint> last(segments, UINT_MAX);
+            for(uint i=block[tid]; i<block[tid+1]; i++){
+                for(uint l=src_row_begin[i]; l<src_row_begin[i+1]; l++){
+                    uint s = src_col[l]/width;
+                    if(last[s]!=i){
+                        last[s] = i;
+                        uint k = next_row[s]++;
+                        rows[k] = i;
+                        row_ptr[k+s] = next_nnz[s];
+                    }
+                    uint dst = next_nnz[s]++;
+                    col_indices[dst] = src_col[l];
+                    values[dst] = src_val[l];
+                }
+            }
+        }
+        // End entry of every segment
+        for(uint s=0; s<segments; s++){
+            row_ptr[row_offset[s+1]+s] = nnz_offset[s+1];
+        }
+    }
+
+    // ret[i] += sca * (row i of the matrix) . x, called by every thread of a parallel region
+    void multiply_add(const T *x, T sca, page_vector<T> &ret) const{
+        for(uint s=0; s<segments; s++){
+            const uint *seg_rows = &rows[0]+row_offset[s];
+            const uint *ptr = &row_ptr[0]+row_offset[s]+s;
+            uint n = row_offset[s+1]-row_offset[s], k, l;
+            // Implicit barrier: a row may be in the next segment too
+            #pragma omp for schedule(runtime)
+            for(k=0; k<n; k++){
+                T sum = 0;
+                for(l=ptr[k]; l<ptr[k+1]; l++){
+                    sum += values[l] * x[col_indices[l]];
+                }
+                ret[seg_rows[k]] += sum * sca;
+            }
+        }
+    }
+
+    // Bytes of the segmented copy
+    unsigned long long bytes() const{
+        return (unsigned long long)(rows.size()+row_ptr.size()+col_indices.size()+row_offset.size())*sizeof(uint)
+             + (unsigned long long)values.size()*sizeof(T);
+    }
+};
+
+// Segment widths (in columns) tried by the tuner: vector slices of the L2 and
+// last level cache sizes (halves and quarters as well, since the matrix
+// streams through the same cache), for the given column count.
+inline vector<uint> segment_width_candidates(uint col, uint elem_size){
+    vector<long> caches = {sysconf(_SC_LEVEL2_CACHE_SIZE), sysconf(_SC_LEVEL3_CACHE_SIZE)};
+    vector<uint> widths;
+    for(long c : caches){
+        if(c<=0){
+            continue;
+        }
+        for(long div : {1, 2, 4}){
+            uint w = c/div/elem_size;
+            if(w>0 && w<col){
+                widths.push_back(w);
+            }
+        }
+    }
+    // Fallback if cache sizes are unknown: 256 KiB to 16 MiB slices
+    if(widths.empty()){
+        for(unsigned long long b = 1<<18; b<=(1<<24); b<<=2){
+            if(b/elem_size<col){
+                widths.push_back(b/elem_size);
+            }
+        }
+    }
+    sort(widths.begin(), widths.end());
+    widths.erase(unique(widths.begin(), widths.end()), widths.end());
+    return widths;
+}
+
+#endif
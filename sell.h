@@ -0,0 +1,118 @@
+#ifndef SELL_H
+#define SELL_H
+
+#include <vector>
+#include <algorithm>
+#include <omp.h>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+#include "alloc.h"
+
+using namespace std;
+typedef unsigned int uint;
+
+// Rows per chunk (SIMD lanes). 8 doubles fill an AVX-512 register, or two AVX2 ones.
+#define SELL_C 8
+
+// SELL-C-sigma copy of a CSR matrix. Rows are sorted by decreasing length within
+// windows of sigma rows, then packed in chunks of SELL_C rows. A chunk stores its
+// rows column major and padded to its longest row, so the kernel advances all
+// SELL_C rows in lockstep:
+//   entry k of lane r of chunk c is at chunk_begin[c] + k*SELL_C + r
+// perm[p] is the original row stored at position p. Padding has value 0 and
+// column 0, so it adds nothing. Results are written back to original row order.
+template<typename T>
+class SELL_Matrix{
+    public:
+    uint rows, sigma, chunks;
+    page_vector<uint> perm;
+    page_vector<unsigned long long> chunk_begin;
+    page_vector<uint> chunk_len;
+    page_vector<uint> col_indices;
+    page_vector<T> values;
+
+    SELL_Matrix(uint rows, const uint *row_begin, const uint *src_col, const T *src_val, uint sigma)
+        : rows(rows), sigma(max(sigma, 1u)){
+        chunks = (rows+SELL_C-1)/SELL_C;
+        long long w, c;
+        // Sort every sigma window by row length, longest first (stable, so equal rows keep order)
+        perm.resize(rows);
+        uint windows = (rows+this->sigma-1)/this->sigma;
+        #pragma omp parallel for schedule(dynamic, 1)
+        for(w=0; w<windows; w++){
+            uint first = w*this->sigma, last = min<unsigned long long>((unsigned long long)(w+1)*this->sigma, rows);
+            for(uint i=first; i<last; i++){
+                perm[i] = i;
+            }
+            stable_sort(perm.begin()+first, perm.begin()+last, [row_begin](uint a, uint b){
+                return row_begin[a+1]-row_begin[a] > row_begin[b+1]-row_begin[b];
+            });
+        }
+        // Chunk lengths and offsets
+        chunk_len.resize(chunks);
+        chunk_begin.resize(chunks+1);
+        #pragma omp parallel for schedule(static)
+        for(c=0; c<chunks; c++){
+            uint len = 0;
+            for(uint r=0; r<SELL_C && c*SELL_C+r<rows; r++){
+                uint i = perm[c*SELL_C+r];
+                len = max(len, row_begin[i+1]-row_begin[i]);
+            }
+            chunk_len[c] = len;
+        }
+        chunk_begin[0] = 0;
+        for(c=0; c<chunks; c++){
+            chunk_begin[c+1] = chunk_begin[c] + (unsigned long long)chunk_len[c]*SELL_C;
+        }
+        // Fill, padding included, in parallel so pages are first touched by the kernel's threads
+        col_indices.resize(chunk_begin[chunks]);
+        values.resize(chunk_begin[chunks]);
+        #pragma omp parallel for schedule(static)
+        for(c=0; c<chunks; c++){
+            for(uint r=0; r<SELL_C; r++){
+                uint p = c*SELL_C+r;
+                uint beg = p<rows ? row_begin[perm[p]] : 0, len = p<rows ? row_begin[perm[p]+1]-beg : 0;
+                for(uint k=0; k<chunk_len[c]; k++){
+                    unsigned long long dst = chunk_begin[c] + (unsigned long long)k*SELL_C + r;
+                    col_indices[dst] = k<len ? src_col[beg+k] : 0;
+                    values[dst] = k<len ? src_val[beg+k] : 0;
+                }
+            }
+        }
+    }
+
+    // ret[i] = init + sca * (row i) . x for every row, returns sum |ret[i]-old[i]|.
+    // Chunks are shared with the runtime schedule.
+    T multiply(const T *x, const T *old, T sca, T init, page_vector<T> &ret) const{
+        T diff = 0;
+        long long c;
+        #pragma omp parallel for schedule(runtime) reduction(+: diff)
+        for(c=0; c<chunks; c++){
+            T sum[SELL_C] = {0};
+            const uint *col = &col_indices[0] + chunk_begin[c];
+            const T *val = &values[0] + chunk_begin[c];
+            for(uint k=0; k<chunk_len[c]; k++){
+                #pragma omp simd
+                for(uint r=0; r<SELL_C; r++){
+                    sum[r] += val[k*SELL_C+r] * x[col[k*SELL_C+r]];
+                }
+            }
+            for(uint r=0; r<SELL_C && c*SELL_C+r<rows; r++){
+                uint i = perm[c*SELL_C+r];
+                ret[i] = init + sum[r]*sca;
+                diff += abs(ret[i]-old[i]);
+            }
+        }
+        return diff;
+    }
+
+    // Stored entries over nonzeros, 1 means no padding
+    double padding_ratio(uint nnz) const{
+        return nnz==0 ? 1 : (double)values.size()/nnz;
+    }
+};
+
+#endif
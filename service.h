@@ -0,0 +1,403 @@
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <sstream>
+#include <atomic>
+#include <thread>
+#include <iostream>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <omp.h>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+#include "snapshot.h"
+#include "stream.h"
+#include "checkpoint.h"
+#include "csv.h"
+#include "alloc.h"
+
+using namespace std;
+typedef unsigned int uint;
+
+// Host part of a node name (scheme, port and path removed).
+// Names that are not URLs are their own host.
+inline string_view name_host(string_view name){
+    size_t p = name.find("://");
+    if(p!=string_view::npos){
+        name.remove_prefix(p+3);
+    }
+    return name.substr(0, name.find_first_of("/:?#"));
+}
+
+// Everything a query reads. Built once and never changed afterwards, so it is
+// read without locks. A reload builds a new state and swaps it in whole.
+class ServiceState{
+    private:
+    char *map = NULL;
+    size_t map_bytes = 0;
+
+    public:
+    // Views into the mmap'd names section of the snapshot
+    vector<string_view> names;
+    unordered_map<string_view, uint> index;
+    page_vector<double> rank;
+    // Nodes by decreasing score (ties by index, like top_k), and place of every node
+    vector<uint> order, position;
+    // Nodes of every host and parent domain, by decreasing score
+    unordered_map<string_view, vector<uint>> domains;
+    int iterations = 0;
+    unsigned long long version = 0;
+
+    ServiceState(const ServiceState &) = delete;
+    ServiceState &operator=(const ServiceState &) = delete;
+
+    ServiceState(){}
+
+    ~ServiceState(){
+        if(map!=NULL){
+            munmap(map, map_bytes);
+        }
+    }
+
+    // Map snapshot file and index its names. The mapping stays valid if the file
+    // is replaced later (rename), so old states keep working until dropped.
+    bool map_names(const string &filename, const SnapshotFile &snap){
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat st;
+        if(fd<0 || fstat(fd, &st)!=0){
+            if(fd>=0){
+                close(fd);
+            }
+            return false;
+        }
+        map_bytes = st.st_size;
+        void *p = mmap(NULL, map_bytes, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if(p==MAP_FAILED || snap.header.names_offset+snap.header.names_bytes>map_bytes){
+            if(p!=MAP_FAILED){
+                munmap(p, map_bytes);
+            }
+            return false;
+        }
+        map = (char *)p;
+        string_view all(map+snap.header.names_offset, snap.header.names_bytes);
+        names.reserve(snap.header.col);
+        size_t beg = 0, end;
+        while((end = all.find('\n', beg))!=string_view::npos){
+            names.push_back(all.substr(beg, end-beg));
+            beg = end+1;
+        }
+        index.reserve(names.size());
+        for(uint i=0; i<names.size(); i++){
+            index.emplace(names[i], i);
+        }
+        return names.size()==snap.header.col;
+    }
+
+    // Sort nodes by score and group them by domain
+    void index_ranks(){
+        uint n = rank.size();
+        order.resize(n);
+        position.resize(n);
+        for(uint i=0; i<n; i++){
+            order[i] = i;
+        }
+        const page_vector<double> &r = rank;
+        sort(order.begin(), order.end(), [&r](uint a, uint b){
+            return r[a]>r[b] || (r[a]==r[b] && a<b);
+        });
+        for(uint p=0; p<n; p++){
+            uint node = order[p];
+            position[node] = p;
+            // www.a.example.com is also listed under a.example.com and example.com
+            string_view host = name_host(names[node]);
+            domains[host].push_back(node);
+            size_t dot = host.find('.');
+            while(dot!=string_view::npos){
+                host.remove_prefix(dot+1);
+                dot = host.find('.');
+                if(dot==string_view::npos){
+                    break;
+                }
+                domains[host].push_back(node);
+            }
+        }
+    }
+};
+
+// Build a state from a snapshot. Ranks come from a checkpoint file if given
+// (written by checkpoint mode), otherwise the snapshot is solved out of core
+// with budget bytes of shard buffers. Returns NULL on failure.
+inline ServiceState *load_service_state(const string &filename, const string &ranks,
+                                        unsigned long long budget, unsigned long long version){
+    SnapshotFile snap;
+    ServiceState *s = new ServiceState();
+    s->version = version;
+    if(!snap.open(filename) || !s->map_names(filename, snap)){
+        cout << "Cannot read snapshot: " << filename << endl;
+        delete s;
+        return NULL;
+    }
+    if(!ranks.empty()){
+        Checkpoint ck;
+        if(!read_checkpoint(ranks, ck) || ck.offset!=0 || ck.total!=snap.header.col || ck.vec.size()!=ck.total){
+            cout << "Cannot read ranks of " << snap.header.col << " nodes: " << ranks << endl;
+            delete s;
+            return NULL;
+        }
+        s->rank.assign(ck.vec.begin(), ck.vec.end());
+        s->iterations = ck.iteration;
+    }else{
+        StreamResult res;
+        if(!stream_pagerank(snap, budget, 0.2, 1e-6, res)){
+            delete s;
+            return NULL;
+        }
+        s->rank.swap(res.rank);
+        s->iterations = res.iterations;
+    }
+    double tim_st = omp_get_wtime();
+    s->index_ranks();
+    cout << "Ranks " << version << " indexed in: " << omp_get_wtime()-tim_st << endl;
+    return s;
+}
+
+// Long running query server on a Unix socket. One request per line, every reply
+// ends with an empty line:
+//   score NAME        -> NAME SCORE PLACE (1 is the highest), or "not found"
+//   top K [DOMAIN]    -> K lines of PLACE NAME SCORE, only nodes of DOMAIN if given
+//   reload [RANKS]    -> recompute (or read RANKS checkpoint) in the background
+//   stats             -> nodes, version, iterations, whether a reload is running
+//   shutdown          -> stop the server
+// Queries run on the serving thread only. A reload publishes its new state through
+// "pending", which the serving thread takes before the next query, so reads never
+// lock and old states are freed only by their single reader.
+class RankService{
+    private:
+    string filename, socket_path;
+    unsigned long long budget;
+    ServiceState *cur = NULL;
+    atomic<ServiceState *> pending{NULL};
+    atomic<bool> solving{false};
+    thread solver;
+    unsigned long long versions = 0;
+    bool stop = false;
+
+    // Current state, newest published one if any
+    const ServiceState *state(){
+        ServiceState *s = pending.exchange(NULL);
+        if(s!=NULL){
+            delete cur;
+            cur = s;
+        }
+        return cur;
+    }
+
+    // Returns false if a reload is already running
+    bool reload(const string &ranks){
+        if(solving.exchange(true)){
+            return false;
+        }
+        if(solver.joinable()){
+            solver.join();
+        }
+        unsigned long long version = ++versions;
+        solver = thread([this, ranks, version]{
+            ServiceState *s = load_service_state(filename, ranks, budget, version);
+            if(s!=NULL){
+                // Drop a state published earlier that was never taken
+                delete pending.exchange(s);
+            }
+            solving = false;
+        });
+        return true;
+    }
+
+    void append_node(string &out, const ServiceState *s, uint node){
+        append_number(out, s->position[node]+1);
+        out += ' ';
+        out += s->names[node];
+        out += ' ';
+        append_number(out, s->rank[node]);
+        out += '\n';
+    }
+
+    string answer(const string &line){
+        const ServiceState *s = state();
+        istringstream in(line);
+        string cmd, arg;
+        string out;
+        in >> cmd;
+        if(cmd=="score" && in >> arg){
+            auto it = s->index.find(string_view(arg));
+            if(it==s->index.end()){
+                out += "not found\n";
+            }else{
+                out += arg;
+                out += ' ';
+                append_number(out, s->rank[it->second]);
+                out += ' ';
+                append_number(out, s->position[it->second]+1);
+                out += '\n';
+            }
+        }else if(cmd=="top"){
+            uint k = 5;
+            // Client text is never trusted to parse, K must be a whole number
+            if(in >> arg){
+                auto res = from_chars(arg.data(), arg.data()+arg.size(), k);
+                if(res.ec!=errc() || res.ptr!=arg.data()+arg.size()){
+                    return "unknown request\n\n";
+                }
+            }
+            const vector<uint> *nodes = &s->order;
+            if(in >> arg){
+                auto it = s->domains.find(string_view(arg));
+                nodes = it==s->domains.end() ? NULL : &it->second;
+            }
+            for(uint i=0; nodes!=NULL && i<k && i<nodes->size(); i++){
+                append_node(out, s, (*nodes)[i]);
+            }
+        }else if(cmd=="reload"){
+            string ranks;
+            in >> ranks;
+            out += reload(ranks) ? "reloading\n" : "reload already running\n";
+        }else if(cmd=="stats"){
+            out += "nodes ";
+            append_number(out, s->names.size());
+            out += "\nversion ";
+            append_number(out, s->version);
+            out += "\niterations ";
+            append_number(out, s->iterations);
+            out += solving ? "\nreloading 1\n" : "\nreloading 0\n";
+        }else if(cmd=="shutdown"){
+            stop = true;
+            out += "bye\n";
+        }else{
+            out += "unknown request\n";
+        }
+        out += '\n';
+        return out;
+    }
+
+    static bool send_all(int fd, const string &data){
+        size_t done = 0;
+        while(done<data.size()){
+            ssize_t n = send(fd, data.data()+done, data.size()-done, MSG_NOSIGNAL);
+            if(n<=0){
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    public:
+    RankService(const RankService &) = delete;
+    RankService &operator=(const RankService &) = delete;
+
+    RankService(const string &filename, const string &socket_path, unsigned long long budget)
+        : filename(filename), socket_path(socket_path), budget(budget){}
+
+    ~RankService(){
+        if(solver.joinable()){
+            solver.join();
+        }
+        delete pending.exchange(NULL);
+        delete cur;
+    }
+
+    // Build the first state before serving
+    bool start(const string &ranks){
+        cur = load_service_state(filename, ranks, budget, ++versions);
+        return cur!=NULL;
+    }
+
+    // Serve clients until shutdown. Returns false if the socket cannot be opened.
+    bool serve(){
+        int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if(lfd<0 || socket_path.size()>=sizeof(addr.sun_path)){
+            return false;
+        }
+        strcpy(addr.sun_path, socket_path.c_str());
+        // Socket file of an earlier run
+        unlink(socket_path.c_str());
+        if(bind(lfd, (sockaddr *)&addr, sizeof(addr))!=0 || listen(lfd, 64)!=0){
+            close(lfd);
+            return false;
+        }
+        cout << "Serving on " << socket_path << endl;
+
+        // Listening socket first, then clients with their unfinished lines
+        vector<pollfd> fds = {{lfd, POLLIN, 0}};
+        vector<string> pending_lines = {""};
+        char buf[1<<16];
+        while(!stop){
+            if(poll(fds.data(), fds.size(), -1)<0){
+                continue;
+            }
+            for(size_t k=fds.size()-1; k>=1; k--){
+                if(fds[k].revents==0){
+                    continue;
+                }
+                ssize_t n = read(fds[k].fd, buf, sizeof(buf));
+                bool closed = n<=0;
+                if(n>0){
+                    string &lines = pending_lines[k];
+                    lines.append(buf, n);
+                    size_t end;
+                    while(!closed && (end = lines.find('\n'))!=string::npos){
+                        string line = lines.substr(0, end);
+                        lines.erase(0, end+1);
+                        if(!line.empty() && line.back()=='\r'){
+                            line.pop_back();
+                        }
+                        // A bad request must never stop the server
+                        string reply;
+                        try{
+                            reply = answer(line);
+                        }catch(const exception &e){
+                            reply = "unknown request\n\n";
+                        }
+                        closed = !send_all(fds[k].fd, reply);
+                    }
+                }
+                if(closed){
+                    close(fds[k].fd);
+                    fds.erase(fds.begin()+k);
+                    pending_lines.erase(pending_lines.begin()+k);
+                }
+            }
+            if(fds[0].revents & POLLIN){
+                int c = accept(lfd, NULL, NULL);
+                if(c>=0){
+                    fds.push_back({c, POLLIN, 0});
+                    pending_lines.push_back("");
+                }
+            }
+        }
+        for(size_t k=0; k<fds.size(); k++){
+            close(fds[k].fd);
+        }
+        unlink(socket_path.c_str());
+        return true;
+    }
+};
+
+#endif
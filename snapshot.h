@@ -0,0 +1,359 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>
+#include <fcntl.h>
+#include <unistd.h>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+using namespace std;
+typedef unsigned int uint;
+
+// Binary CSR snapshot, stored as row-block shards so a matrix larger than
+// memory can be streamed one shard at a time (native endianness):
+// SnapshotHeader, then shards, each starting at a SNAPSHOT_ALIGN boundary:
+//   uint row_begin[rows+1] (rebased to 0), uint col_indices[nnz],
+//   padding to 8 bytes, double values[nnz]
+// then node names, each ending with '\n', then the shard table
+// (SnapshotShard per shard, in row order, covering all rows).
+// Version 2 may also hold shards of the transposed (out-link) matrix after the
+// in-link shards, with their own table after the first one. Both share the names.
+// Version 3 adds the tuned column segment width (segment.h) of the in-link matrix.
+#define SNAPSHOT_MAGIC "PRSN"
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_ALIGN 4096
+
+struct SnapshotHeader{
+    char magic[4];
+    uint version;
+    uint row, col;
+    uint shards;
+    uint out_shards;           // Zero if there is no out-link view (always in version 1)
+    unsigned long long nnz;
+    unsigned long long names_offset, names_bytes;
+    unsigned long long table_offset;
+    // Version 2 and later
+    unsigned long long out_nnz;
+    unsigned long long out_table_offset;
+    // Version 3 and later, zero if not segmented
+    uint segment_cols;
+    uint reserved;
+};
+
+// Header size of each version
+inline size_t snapshot_header_bytes(uint version){
+    if(version<=1){
+        return offsetof(SnapshotHeader, out_nnz);
+    }
+    if(version==2){
+        return offsetof(SnapshotHeader, segment_cols);
+    }
+    return sizeof(SnapshotHeader);
+}
+
+struct SnapshotShard{
+    uint row_begin, row_end;   // Rows [row_begin, row_end)
+    unsigned long long offset; // Byte offset of shard data in file
+    unsigned long long nnz;
+    unsigned long long bytes;  // Shard data size, without alignment padding
+};
+
+// Bytes of a shard with given rows and nonzeros
+inline unsigned long long snapshot_shard_bytes(uint rows, unsigned long long nnz){
+    unsigned long long idx = (unsigned long long)(rows+1+nnz)*sizeof(uint);
+    return (idx+7)/8*8 + nnz*sizeof(double);
+}
+
+// Views into a shard read to memory
+struct ShardView{
+    uint first_row, rows;
+    const uint *row_begin;
+    const uint *col_indices;
+    const double *values;
+
+    ShardView(const SnapshotShard &s, const char *data){
+        first_row = s.row_begin;
+        rows = s.row_end-s.row_begin;
+        row_begin = (const uint *)data;
+        col_indices = row_begin+rows+1;
+        unsigned long long idx = (unsigned long long)(rows+1+s.nnz)*sizeof(uint);
+        values = (const double *)(data+(idx+7)/8*8);
+    }
+};
+
+// Writes a snapshot one shard at a time, so the whole matrix never has to be in memory.
+// Call add_shard for consecutive row blocks, optionally add_out_shard for the
+// transposed matrix, add_name for every node, then finish.
+class SnapshotWriter{
+    private:
+    FILE *f;
+    SnapshotHeader header;
+    vector<SnapshotShard> table, out_table;
+    unsigned long long pos;
+    bool ok, names_started=false;
+
+    bool pad_to(unsigned long long target){
+        static const char zeros[SNAPSHOT_ALIGN] = {0};
+        while(pos<target){
+            size_t n = min<unsigned long long>(target-pos, SNAPSHOT_ALIGN);
+            if(fwrite(zeros, 1, n, f)!=n){
+                return false;
+            }
+            pos += n;
+        }
+        return true;
+    }
+
+    // Write one shard and add it to shards
+    void write_shard(vector<SnapshotShard> &shards, uint first_row, uint rows, const uint *row_begin,
+                     const uint *col_indices, const double *values){
+        if(!ok){
+            return;
+        }
+        assert(!names_started);
+        assert(shards.empty() ? first_row==0 : first_row==shards.back().row_end);
+        SnapshotShard s;
+        s.row_begin = first_row;
+        s.row_end = first_row+rows;
+        s.nnz = row_begin[rows]-row_begin[0];
+        s.bytes = snapshot_shard_bytes(rows, s.nnz);
+        ok = pad_to((pos+SNAPSHOT_ALIGN-1)/SNAPSHOT_ALIGN*SNAPSHOT_ALIGN);
+        s.offset = pos;
+        // Rebase row_begin to 0
+        vector<uint> local(row_begin, row_begin+rows+1);
+        for(uint i=0; i<=rows; i++){
+            local[i] -= row_begin[0];
+        }
+        ok = ok && fwrite(local.data(), sizeof(uint), rows+1, f)==rows+1
+                && fwrite(col_indices, sizeof(uint), s.nnz, f)==s.nnz;
+        pos += (unsigned long long)(rows+1+s.nnz)*sizeof(uint);
+        ok = ok && pad_to((pos+7)/8*8)
+                && fwrite(values, sizeof(double), s.nnz, f)==s.nnz;
+        pos += s.nnz*sizeof(double);
+        shards.push_back(s);
+    }
+
+    public:
+    SnapshotWriter(const string &filename, uint row, uint col) : pos(0){
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+        header.version = SNAPSHOT_VERSION;
+        header.row = row;
+        header.col = col;
+        f = fopen(filename.c_str(), "wb");
+        // Header is rewritten by finish
+        ok = f!=NULL && fwrite(&header, sizeof(header), 1, f)==1;
+        pos = sizeof(header);
+    }
+
+    ~SnapshotWriter(){
+        if(f!=NULL){
+            fclose(f);
+        }
+    }
+
+    // Rows [first_row, first_row+rows). row_begin has rows+1 elements and may start
+    // at any offset, col_indices and values start at the shard's first nonzero.
+    void add_shard(uint first_row, uint rows, const uint *row_begin, const uint *col_indices, const double *values){
+        assert(out_table.empty());
+        write_shard(table, first_row, rows, row_begin, col_indices, values);
+        header.nnz += table.back().nnz;
+    }
+
+    // Column segment width to store in the header
+    void set_segment_cols(uint cols){
+        header.segment_cols = cols;
+    }
+
+    // Same for the transposed matrix (col rows), after all add_shard calls
+    void add_out_shard(uint first_row, uint rows, const uint *row_begin, const uint *col_indices, const double *values){
+        write_shard(out_table, first_row, rows, row_begin, col_indices, values);
+        header.out_nnz += out_table.back().nnz;
+    }
+
+    // Append name of next node. Names are written after all shards, in node order.
+    void add_name(const string &name){
+        if(!names_started){
+            header.names_offset = pos;
+            names_started = true;
+        }
+        ok = ok && fwrite(name.data(), 1, name.size(), f)==name.size() && fputc('\n', f)!=EOF;
+        pos += name.size()+1;
+    }
+
+    bool finish(const vector<string> &names){
+        for(uint i=0; i<names.size(); i++){
+            add_name(names[i]);
+        }
+        return finish();
+    }
+
+    // Write shard table. Returns false if any write failed.
+    bool finish(){
+        if(!ok){
+            return false;
+        }
+        assert(table.empty() ? header.row==0 : table.back().row_end==header.row);
+        assert(out_table.empty() || out_table.back().row_end==header.col);
+        if(!names_started){
+            header.names_offset = pos;
+        }
+        header.names_bytes = pos-header.names_offset;
+        ok = ok && pad_to((pos+7)/8*8);
+        header.table_offset = pos;
+        header.shards = table.size();
+        ok = ok && fwrite(table.data(), sizeof(SnapshotShard), table.size(), f)==table.size();
+        header.out_table_offset = pos+table.size()*sizeof(SnapshotShard);
+        header.out_shards = out_table.size();
+        ok = ok && fwrite(out_table.data(), sizeof(SnapshotShard), out_table.size(), f)==out_table.size();
+        ok = ok && fseek(f, 0, SEEK_SET)==0 && fwrite(&header, sizeof(header), 1, f)==1;
+        ok = (fclose(f)==0) && ok;
+        f = NULL;
+        return ok;
+    }
+};
+
+// Random access to a snapshot. Only header and shard table are kept in memory.
+class SnapshotFile{
+    private:
+    int fd = -1;
+
+    public:
+    SnapshotHeader header;
+    // Shards of the in-link matrix, and of the out-link matrix if stored
+    vector<SnapshotShard> table, out_table;
+
+    SnapshotFile(const SnapshotFile &) = delete;
+    SnapshotFile &operator=(const SnapshotFile &) = delete;
+
+    SnapshotFile(){}
+
+    ~SnapshotFile(){
+        if(fd>=0){
+            close(fd);
+        }
+    }
+
+    // Returns false if file is missing or is not a snapshot (any version up to SNAPSHOT_VERSION).
+    // Fields newer than the file's version are zero.
+    bool open(const string &filename){
+        memset(&header, 0, sizeof(header));
+        size_t v1 = snapshot_header_bytes(1);
+        fd = ::open(filename.c_str(), O_RDONLY);
+        if(fd<0 || !read_at(&header, v1, 0)
+           || memcmp(header.magic, SNAPSHOT_MAGIC, 4)!=0 || header.version<1 || header.version>SNAPSHOT_VERSION){
+            return false;
+        }
+        if(!read_at((char *)&header+v1, snapshot_header_bytes(header.version)-v1, v1)){
+            return false;
+        }
+        table.resize(header.shards);
+        out_table.resize(header.version>=2 ? header.out_shards : 0);
+        if(!read_at(table.data(), table.size()*sizeof(SnapshotShard), header.table_offset) ||
+           !read_at(out_table.data(), out_table.size()*sizeof(SnapshotShard), header.out_table_offset)){
+            return false;
+        }
+        // Shards are read front to back on every iteration
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        return true;
+    }
+
+    bool read_at(void *buf, size_t bytes, unsigned long long offset) const{
+        char *p = (char *)buf;
+        while(bytes>0){
+            ssize_t n = pread(fd, p, bytes, offset);
+            if(n<=0){
+                return false;
+            }
+            p += n;
+            bytes -= n;
+            offset += n;
+        }
+        return true;
+    }
+
+    // Read a shard (of table or out_table) into buf (resized as needed)
+    bool read_shard(const SnapshotShard &s, vector<char> &buf) const{
+        buf.resize(s.bytes);
+        return read_at(buf.data(), buf.size(), s.offset);
+    }
+
+    // Read in-link shard k into buf
+    bool read_shard(uint k, vector<char> &buf) const{
+        return read_shard(table[k], buf);
+    }
+
+    unsigned long long max_shard_bytes() const{
+        unsigned long long m = 0;
+        for(uint k=0; k<table.size(); k++){
+            m = max(m, table[k].bytes);
+        }
+        return m;
+    }
+
+    // All node names, in node order
+    vector<string> names() const{
+        vector<string> ret;
+        string all(header.names_bytes, '\0');
+        if(!read_at(&all[0], all.size(), header.names_offset)){
+            return ret;
+        }
+        size_t beg = 0, end;
+        while((end = all.find('\n', beg))!=string::npos){
+            ret.push_back(all.substr(beg, end-beg));
+            beg = end+1;
+        }
+        return ret;
+    }
+
+    // Names of given nodes only, found by scanning names section in blocks
+    vector<string> names(const vector<uint> &nodes) const{
+        vector<string> ret(nodes.size());
+        vector<char> block(1<<20);
+        string cur;
+        uint node = 0;
+        unsigned long long done = 0;
+        while(done<header.names_bytes){
+            size_t n = min<unsigned long long>(block.size(), header.names_bytes-done);
+            if(!read_at(block.data(), n, header.names_offset+done)){
+                break;
+            }
+            for(size_t i=0; i<n; i++){
+                if(block[i]!='\n'){
+                    cur += block[i];
+                    continue;
+                }
+                for(uint k=0; k<nodes.size(); k++){
+                    if(nodes[k]==node){
+                        ret[k] = cur;
+                    }
+                }
+                cur.clear();
+                node++;
+            }
+            done += n;
+        }
+        return ret;
+    }
+};
+
+// Whether a file starts with the snapshot magic
+inline bool is_snapshot(const string &filename){
+    char magic[4];
+    FILE *f = fopen(filename.c_str(), "rb");
+    if(f==NULL){
+        return false;
+    }
+    bool ok = fread(magic, 1, 4, f)==4 && memcmp(magic, SNAPSHOT_MAGIC, 4)==0;
+    fclose(f);
+    return ok;
+}
+
+#endif
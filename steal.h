@@ -0,0 +1,217 @@
+#ifndef STEAL_H
+#define STEAL_H
+
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+using namespace std;
+typedef unsigned int uint;
+
+// Rounds a waiting thread spins before it sleeps
+#define STEAL_SPIN 4000
+
+// Barrier that spins for a while, then sleeps on a condition variable.
+// Short waits (between two ops calls) stay out of the kernel.
+class SpinBarrier{
+    private:
+    const uint count;
+    atomic<uint> arrived{0};
+    atomic<uint> generation{0};
+    mutex mtx;
+    condition_variable cv;
+
+    public:
+    SpinBarrier(uint count) : count(count){}
+
+    void wait(){
+        uint gen = generation.load(memory_order_acquire);
+        if(arrived.fetch_add(1, memory_order_acq_rel)+1==count){
+            arrived.store(0, memory_order_relaxed);
+            {
+                lock_guard<mutex> lock(mtx);
+                generation.fetch_add(1, memory_order_release);
+            }
+            cv.notify_all();
+            return;
+        }
+        for(int s=0; s<STEAL_SPIN; s++){
+            if(generation.load(memory_order_acquire)!=gen){
+                return;
+            }
+            this_thread::yield();
+        }
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [this, gen]{ return generation.load(memory_order_acquire)!=gen; });
+    }
+};
+
+// Persistent pool running row loops with work stealing. Every thread starts with
+// a row range of about the same number of nonzeros, and takes chunks of about
+// "grain" nonzeros from its front. A thread that runs out steals the back half
+// (by nonzeros) of another thread's remaining range. Ranges are packed into one
+// 64 bit word (begin<<32 | end), so taking and stealing are single CAS operations.
+// The calling thread is thread 0, threads are kept between run calls.
+class StealExecutor{
+    private:
+    // One cache line per thread, so range updates and sums do not false share
+    struct alignas(64) Slot{
+        atomic<unsigned long long> range{0};
+        double sum = 0;
+        unsigned long long steals = 0;
+    };
+
+    uint nthreads, grain;
+    vector<Slot> slots;
+    vector<thread> workers;
+    SpinBarrier start_barrier, end_barrier;
+    bool stop = false;
+    // Current job, set by run before the start barrier
+    const uint *row_begin = NULL;
+    function<double(uint, uint, uint)> body;
+    function<void(int, bool)> hook;
+
+    static unsigned long long pack(uint begin, uint end){
+        return (unsigned long long)begin<<32 | end;
+    }
+
+    // Take the next chunk of own range. Returns false if it is empty.
+    bool take(uint tid, uint &begin, uint &end){
+        atomic<unsigned long long> &r = slots[tid].range;
+        unsigned long long cur = r.load(memory_order_acquire);
+        while(true){
+            uint lo = cur>>32, hi = (uint)cur;
+            if(lo>=hi){
+                return false;
+            }
+            // At least one row, then rows until grain nonzeros
+            uint mid = lower_bound(row_begin+lo+1, row_begin+hi, row_begin[lo]+grain) - row_begin;
+            if(r.compare_exchange_weak(cur, pack(mid, hi), memory_order_acq_rel)){
+                begin = lo;
+                end = mid;
+                return true;
+            }
+        }
+    }
+
+    // Move back half of some other thread's range to own (empty) range
+    bool steal(uint tid){
+        for(uint k=1; k<nthreads; k++){
+            atomic<unsigned long long> &r = slots[(tid+k)%nthreads].range;
+            unsigned long long cur = r.load(memory_order_acquire);
+            while(true){
+                uint lo = cur>>32, hi = (uint)cur;
+                // Leave a last chunk to its owner
+                if(lo>=hi || hi-lo<2 || row_begin[hi]-row_begin[lo]<=grain){
+                    break;
+                }
+                uint half = row_begin[lo]+(row_begin[hi]-row_begin[lo])/2;
+                uint mid = lower_bound(row_begin+lo+1, row_begin+hi, half) - row_begin;
+                mid = min(mid, hi-1);
+                if(r.compare_exchange_weak(cur, pack(lo, mid), memory_order_acq_rel)){
+                    slots[tid].range.store(pack(mid, hi), memory_order_release);
+                    slots[tid].steals++;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    void work(uint tid){
+        double sum = 0;
+        uint begin, end;
+        if(hook){
+            hook(tid, false);
+        }
+        do{
+            while(take(tid, begin, end)){
+                sum += body(tid, begin, end);
+            }
+        } while(steal(tid));
+        slots[tid].sum = sum;
+        if(hook){
+            hook(tid, true);
+        }
+    }
+
+    void loop(uint tid){
+        while(true){
+            start_barrier.wait();
+            if(stop){
+                break;
+            }
+            work(tid);
+            end_barrier.wait();
+        }
+    }
+
+    public:
+    StealExecutor(const StealExecutor &) = delete;
+    StealExecutor &operator=(const StealExecutor &) = delete;
+
+    StealExecutor(uint nthreads, uint grain)
+        : nthreads(max(nthreads, 1u)), grain(max(grain, 1u)), slots(this->nthreads),
+          start_barrier(this->nthreads), end_barrier(this->nthreads){
+        for(uint t=1; t<this->nthreads; t++){
+            workers.push_back(thread(&StealExecutor::loop, this, t));
+        }
+    }
+
+    ~StealExecutor(){
+        stop = true;
+        start_barrier.wait();
+        for(thread &w : workers){
+            w.join();
+        }
+    }
+
+    uint threads() const{
+        return nthreads;
+    }
+
+    // Total number of steals since construction
+    unsigned long long steals() const{
+        unsigned long long s = 0;
+        for(const Slot &slot : slots){
+            s += slot.steals;
+        }
+        return s;
+    }
+
+    // Run body(tid, begin, end) over rows [0, rows), where row i has row_begin[i+1]-row_begin[i]
+    // nonzeros, and return the sum of its results. If hook is given, every thread
+    // calls hook(tid, false) before and hook(tid, true) after its share.
+    double run(const uint *row_begin, uint rows, function<double(uint, uint, uint)> body,
+               function<void(int, bool)> hook=nullptr){
+        this->row_begin = row_begin;
+        this->body = move(body);
+        this->hook = move(hook);
+        unsigned long long nnz = row_begin[rows]-row_begin[0];
+        uint first = 0;
+        for(uint t=0; t<nthreads; t++){
+            uint last = t+1==nthreads ? rows :
+                lower_bound(row_begin+first, row_begin+rows, row_begin[0]+nnz*(t+1)/nthreads) - row_begin;
+            slots[t].range.store(pack(first, last), memory_order_relaxed);
+            first = last;
+        }
+        start_barrier.wait();
+        work(0);
+        end_barrier.wait();
+        double sum = 0;
+        for(uint t=0; t<nthreads; t++){
+            sum += slots[t].sum;
+        }
+        return sum;
+    }
+};
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <iostream>
+#include <omp.h>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+#include "snapshot.h"
+#include "alloc.h"
+#include "trace.h"
+
+using namespace std;
+typedef unsigned int uint;
+
+// A shard read to memory, and its index in the snapshot
+struct ShardBuffer{
+    uint shard;
+    vector<char> data;
+};
+
+// Reads shards of a snapshot in order on a background thread, over and over,
+// so the next shards are read while the current one is multiplied.
+// At most "slots" buffers exist, which bounds memory to slots * largest shard.
+class ShardStream{
+    private:
+    const SnapshotFile &snap;
+    thread reader;
+    mutex mtx;
+    condition_variable cv;
+    deque<ShardBuffer *> free_list, ready;
+    vector<ShardBuffer> buffers;
+    bool stop=false, failed=false;
+
+    void loop(){
+        uint k = 0;
+        while(true){
+            ShardBuffer *buf;
+            {
+                unique_lock<mutex> lock(mtx);
+                cv.wait(lock, [this]{ return !free_list.empty() || stop; });
+                if(stop){
+                    break;
+                }
+                buf = free_list.front();
+                free_list.pop_front();
+            }
+            buf->shard = k;
+            bool ok = snap.read_shard(k, buf->data);
+            {
+                lock_guard<mutex> lock(mtx);
+                failed = failed || !ok;
+                ready.push_back(buf);
+            }
+            cv.notify_all();
+            k = (k+1)%snap.table.size();
+        }
+    }
+
+    public:
+    // Bytes read by the background thread, for throughput reports
+    unsigned long long bytes_read=0;
+
+    ShardStream(const SnapshotFile &snap, uint slots) : snap(snap), buffers(slots){
+        assert(slots>0 && !snap.table.empty());
+        for(uint s=0; s<slots; s++){
+            free_list.push_back(&buffers[s]);
+        }
+        reader = thread(&ShardStream::loop, this);
+    }
+
+    ~ShardStream(){
+        {
+            lock_guard<mutex> lock(mtx);
+            stop = true;
+        }
+        cv.notify_all();
+        reader.join();
+    }
+
+    // Next shard in order. Blocks until it has been read. Returns NULL on read error.
+    ShardBuffer *next(){
+        unique_lock<mutex> lock(mtx);
+        cv.wait(lock, [this]{ return !ready.empty(); });
+        if(failed){
+            return NULL;
+        }
+        ShardBuffer *buf = ready.front();
+        ready.pop_front();
+        bytes_read += buf->data.size();
+        return buf;
+    }
+
+    // Give a buffer back, so the reader can fill it again
+    void release(ShardBuffer *buf){
+        {
+            lock_guard<mutex> lock(mtx);
+            free_list.push_back(buf);
+        }
+        cv.notify_all();
+    }
+};
+
+// Result of an out-of-core solve
+struct StreamResult{
+    int iterations=0;
+    double time=0;
+    double diff=0;
+    unsigned long long bytes_read=0;
+    page_vector<double> rank;
+};
+
+// PageRank with the matrix streamed from a snapshot. Only the rank vectors
+// (2 * col doubles) and shard buffers (budget bytes) stay in memory.
+// Same update as CSR_Matrix::ops, rows of every shard are split between threads.
+inline bool stream_pagerank(const SnapshotFile &snap, unsigned long long budget,
+                            double alpha, double epsillon, StreamResult &res){
+    unsigned long long shard_max = snap.max_shard_bytes();
+    uint slots = min<unsigned long long>(budget/max(shard_max, 1ULL), snap.table.size()+1);
+    if(slots==0){
+        cout << "Memory budget is smaller than largest shard (" << shard_max << " bytes)" << endl;
+        return false;
+    }
+    uint n = snap.header.col;
+    double init = (1-alpha)/n;
+    page_vector<double> r_t, r_t1(n, 1);
+    cout << "Streaming " << snap.table.size() << " shards with " << slots << " buffers, "
+         << "resident vectors " << 2.0*n*sizeof(double)/(1<<20) << " MiB" << endl;
+
+    ShardStream stream(snap, slots);
+    TraceScope phase("stream solve");
+    do{
+        r_t.swap(r_t1);
+        r_t1.resize(snap.header.row);
+        res.diff = 0;
+        for(uint k=0; k<snap.table.size(); k++){
+            ShardBuffer *buf = stream.next();
+            if(buf==NULL){
+                cout << "Snapshot read failed" << endl;
+                return false;
+            }
+            assert(buf->shard==k);
+            ShardView v(snap.table[k], buf->data.data());
+            double diff = 0;
+            uint i, l;
+            #pragma omp parallel for private(i, l) schedule(runtime) reduction(+: diff)
+            for(i=0; i<v.rows; i++){
+                double sum = 0;
+                for(l=v.row_begin[i]; l<v.row_begin[i+1]; l++){
+                    sum += v.values[l] * r_t[v.col_indices[l]];
+                }
+                r_t1[v.first_row+i] = init + sum*alpha;
+                diff += abs(r_t1[v.first_row+i]-r_t[v.first_row+i]);
+            }
+            res.diff += diff;
+            stream.release(buf);
+        }
+        res.iterations++;
+        trace_counter("diff", res.diff);
+        trace_log(LOG_PROGRESS) << "Current Diff: " << res.diff << endl;
+    } while(res.diff > epsillon);
+    res.time = phase.stop();
+    res.bytes_read = stream.bytes_read;
+    res.rank.swap(r_t);
+    return true;
+}
+
+#endif
@@ -14,6 +14,14 @@
 #include <thrust/generate.h>
 #include <thrust/sort.h>
 #include <thrust/copy.h>
+#include <thrust/transform.h>
+#include <thrust/inner_product.h>
+#include <thrust/functional.h>
+#include <thrust/reduce.h>
+#include <thrust/fill.h>
+#include <thrust/for_each.h>
+#include <thrust/iterator/counting_iterator.h>
+#include <thrust/iterator/transform_iterator.h>
 
 // Uncomment when building for production (disables assert)
 // #define NDEBUG
@@ -24,30 +32,37 @@
 using namespace std;
 typedef unsigned int uint;
 
+// Third field of the first line of csv backups. Files of older builds have
+// only row and col, and zero rows in their own formats.
+#define CSR_CSV_VERSION 2
+
+// Functors below only use raw pointers and plain arithmetic, so they run on any
+// thrust device system (CUDA, or OMP/TBB on host when built with g++).
+
+// Absolute difference of two elements
 template<typename T>
 struct saxpy_abs{
-    __host__ __device__ T operator()(const T &a)const{
-        return abs(a);
+    __host__ __device__ T operator()(const T &a, const T &b)const{
+        return a>b ? a-b : b-a;
     }
 };
 
+template<typename T>
 struct saxpy_ops{
     const uint * row_begin;
     const uint * col_indices;
-    const double * values;
-    const double * vec;
-    const float sca, add;
+    const T * values;
+    const T * vec;
+    const T sca, add;
 
-    saxpy_ops(uint *_row_begin, uint *_col_indices, double *_values, double *_vec, double _sca, double _add) 
+    saxpy_ops(uint *_row_begin, uint *_col_indices, T *_values, T *_vec, T _sca, T _add) 
         : row_begin(_row_begin), col_indices(_col_indices), values(_values), vec(_vec), sca(_sca), add(_add) {}
 
-    __host__ __device__ double operator()(const size_t idx) const{
-        double res = add;
-        uint l, end;
-        // Skip zero rows
-        for(end=idx+1; row_begin[end]==UINT_MAX; end++);
-        // Matrix multiplication
-        for(l=row_begin[idx]; l<row_begin[end]; l++){
+    __host__ __device__ T operator()(const size_t idx) const{
+        T res = add;
+        uint l;
+        // Matrix multiplication. Zero rows have an empty range.
+        for(l=row_begin[idx]; l<row_begin[idx+1]; l++){
             // While multiplying, also multiply with the scaler
             res += (values[l] * vec[col_indices[l]] * sca);
         }
@@ -55,42 +70,86 @@ struct saxpy_ops{
     }
 };
 
+// Scaled product of a single nonzero, for nnz balanced ops
+template<typename T>
+struct saxpy_product{
+    const uint * col_indices;
+    const T * values;
+    const T * vec;
+    const T sca;
+
+    saxpy_product(uint *_col_indices, T *_values, T *_vec, T _sca)
+        : col_indices(_col_indices), values(_values), vec(_vec), sca(_sca) {}
+
+    __host__ __device__ T operator()(const uint l) const{
+        return values[l] * vec[col_indices[l]] * sca;
+    }
+};
+
+// Add reduced row sums to their rows. Keys are unique, so no atomics are needed.
+template<typename T>
+struct saxpy_scatter{
+    const uint * keys;
+    const T * sums;
+    T * ret;
+
+    saxpy_scatter(uint *_keys, T *_sums, T *_ret) : keys(_keys), sums(_sums), ret(_ret) {}
+
+    __host__ __device__ void operator()(const uint idx) const{
+        ret[keys[idx]] += sums[idx];
+    }
+};
+
 template<typename T>
 class CSR_Matrix{
     private:
     uint row, col;
-    // Value indices. Must be ordered
+    // Device copies of the arrays below
     thrust::device_vector<uint> _row_begin;
     thrust::device_vector<uint> _col_indices;
     //Non zero values in the matrix
     thrust::device_vector<T> _values;
+    // Row of every nonzero, and reduce_by_key outputs. Only used if nnz_balanced.
+    thrust::device_vector<uint> _row_ids;
+    thrust::device_vector<uint> _keys;
+    thrust::device_vector<T> _sums;
+    // Value indices. Monotone, row+1 elements, zero rows have equal begin and end.
     vector<uint> row_begin;
     vector<uint> col_indices;
     //Non zero values in the matrix
     vector<T> values;
+    // Indices of non zero rows in order (DCSR style), for sparse row blocks
+    vector<uint> nz_rows;
 
     public:
     // Those values are non essential to CSR matrix's runtime.
     // But if they shouldn't be changed without caution.
     double two_vec_diff=0;
     vector<string> arr_dict;
+    // Split work by nonzeros instead of rows in ops. Must be set before transfer_device.
+    bool nnz_balanced=false;
+    // False if the file given to the constructor could not be read
+    bool loaded=true;
     // Write matrix to file
     void write(const string &filename){
         string buffer;
         // Write row
-        buffer += to_string(this->row);
+        append_number(buffer, this->row);
         buffer += ",";
         // Write col
-        buffer += to_string(this->col);
+        append_number(buffer, this->col);
+        // Write format version (row_begin is monotone)
+        buffer += ",";
+        append_number(buffer, CSR_CSV_VERSION);
         buffer += "\n";
         // Write row_begin array
-        buffer += join(vector_to_string(row_begin), ",");
+        append_joined(buffer, row_begin, ',');
         buffer += "\n";
-        // Write values array
-        buffer += join(vector_to_string(values), ",");
+        // Write values array (shortest text that reads back exactly)
+        append_joined(buffer, values, ',');
         buffer += "\n";
         // Write col_indices array
-        buffer += join(vector_to_string(col_indices), ",");
+        append_joined(buffer, col_indices, ',');
         buffer += "\n";
         // Write arr_dict array
         buffer += join(arr_dict, ",");
@@ -103,6 +162,19 @@ class CSR_Matrix{
 
     // This function is used 
     void transfer_device(){
+        if(nnz_balanced){
+            // Expand row_begin into a row index per nonzero
+            vector<uint> row_ids(values.size());
+            uint k, l;
+            for(k=0; k<nz_rows.size(); k++){
+                for(l=row_begin[nz_rows[k]]; l<row_begin[nz_rows[k]+1]; l++){
+                    row_ids[l] = nz_rows[k];
+                }
+            }
+            _row_ids = row_ids;
+            _keys.resize(this->row);
+            _sums.resize(this->row);
+        }
         _row_begin = row_begin;
         _col_indices = col_indices;
         _values = values;
@@ -126,14 +198,39 @@ class CSR_Matrix{
         cout << "Read file" << endl;
 
         // Now parse them accordingly
-        vector<uint>temp = string_to_uivector(str_init, ",");
+        vector<uint> temp;
+        if(!parse_numbers(str_init, ',', temp) || temp.size()<2 || !parse_numbers(str_row, ',', row_begin) ||
+           !parse_numbers(str_val, ',', values) || !parse_numbers(str_col, ',', col_indices) ||
+           row_begin.size()!=(size_t)temp[0]+1 || values.size()!=col_indices.size()){
+            loaded = false;
+            return;
+        }
         this->row = temp[0];
         this->col = temp[1];
-        row_begin = string_to_uivector(str_row, ",");
-        values = string_to_dvector(str_val, ",");
-        col_indices = string_to_uivector(str_col, ",");
         arr_dict = string_to_svector(str_maps, ",");
 
+        // Files without a version mark zero rows with UINT_MAX, and those of the
+        // MPI build repeat the begin of the row before (a run of equal begins is
+        // one row and zero rows after it). Make them monotone, from the end so
+        // every zero row takes the begin of the next non-zero row.
+        if(temp.size()<3){
+            for(uint i=this->row; i>0; i--){
+                if(row_begin[i-1]==UINT_MAX || (i>1 && row_begin[i-1]==row_begin[i-2])){
+                    row_begin[i-1] = row_begin[i];
+                }
+            }
+        }
+        index_rows();
+    }
+
+    // Rebuild non zero row list from row_begin
+    void index_rows(){
+        nz_rows.clear();
+        for(uint i=0; i<this->row; i++){
+            if(row_begin[i]!=row_begin[i+1]){
+                nz_rows.push_back(i);
+            }
+        }
     }
 
     // Special array initializator optimised for double node matrices.
@@ -147,51 +244,67 @@ class CSR_Matrix{
         this->col = arr_dict.size();
         this->row = arr_dict.size();
 
+        row_begin.push_back(0);
         for(int i=0; i<this->col; i++){
             // Set array structure variables
             uint old_size = values.size();
             values.resize(values.size()+link_by[i].size());
             col_indices.resize(values.size());
-            // If it is a zero row, then set according row_begin index to UINT_MAX
-            if(values.size()==old_size){
-                row_begin.push_back(UINT_MAX);
-            }else{
-                row_begin.push_back(old_size);
+            if(values.size()!=old_size){
+                nz_rows.push_back(i);
             }
 
             // Set values and according column indices.
             for(int l=0; l<link_by[i].size(); l++){
                 assert(link_to[link_by[i][l]].size()!=0);
-                values[old_size+l]=1/(link_to[link_by[i][l]].size());
+                values[old_size+l]=1.0/(link_to[link_by[i][l]].size());
                 col_indices[old_size+l]=link_by[i][l];
             }
             // Sorting is not required
             //sort(col_indices.begin()+old_size, col_indices.end());
+            row_begin.push_back(values.size());
         }
-        row_begin.push_back(values.size());
         assert(values.size()==col_indices.size());
     }
 
-    void ops(thrust::device_vector<double> &ret, thrust::device_vector<double> &vec, T sca, T add){
+    void ops(thrust::device_vector<T> &ret, thrust::device_vector<T> &vec, T sca, T add){
         assert(vec.size()==this->col);
         //uint i, end, l, beg;
         // Initialize with multiplied C vector
         //vector<T> ret(this->row, add/this->col);
         // add/this->col
-        
-        thrust::transform(  thrust::counting_iterator<uint>(0),
-                            thrust::counting_iterator<uint>(this->row),
-                            ret.begin(),
-                            saxpy_ops(  thrust::raw_pointer_cast(_row_begin.data()),
-                                        thrust::raw_pointer_cast(_col_indices.data()),
-                                        thrust::raw_pointer_cast(_values.data()),
-                                        thrust::raw_pointer_cast(vec.data()),
-                                        sca,
-                                        add/this->col)
-                            );
-        thrust::device_vector<double> _temp(this->row);
-        thrust::transform(ret.begin(), ret.end(), vec.begin(), _temp.begin(), thrust::minus<double>());
-        two_vec_diff = thrust::transform_reduce(_temp.begin(), _temp.end(), saxpy_abs<double>(), 0.0, thrust::plus<double>());
+
+        if(nnz_balanced){
+            // Segmented reduction over nonzeros: every thread gets an equal share of
+            // nonzeros regardless of row lengths. Empty rows only keep the added term.
+            thrust::fill(ret.begin(), ret.end(), add/this->col);
+            uint nrows = thrust::reduce_by_key(_row_ids.begin(), _row_ids.end(),
+                            thrust::make_transform_iterator(thrust::counting_iterator<uint>(0),
+                                saxpy_product<T>(  thrust::raw_pointer_cast(_col_indices.data()),
+                                                   thrust::raw_pointer_cast(_values.data()),
+                                                   thrust::raw_pointer_cast(vec.data()),
+                                                   sca)),
+                            _keys.begin(), _sums.begin()).first - _keys.begin();
+            thrust::for_each(   thrust::counting_iterator<uint>(0),
+                                thrust::counting_iterator<uint>(nrows),
+                                saxpy_scatter<T>(  thrust::raw_pointer_cast(_keys.data()),
+                                                   thrust::raw_pointer_cast(_sums.data()),
+                                                   thrust::raw_pointer_cast(ret.data()))
+                                );
+        }else{
+            thrust::transform(  thrust::counting_iterator<uint>(0),
+                                thrust::counting_iterator<uint>(this->row),
+                                ret.begin(),
+                                saxpy_ops<T>(  thrust::raw_pointer_cast(_row_begin.data()),
+                                               thrust::raw_pointer_cast(_col_indices.data()),
+                                               thrust::raw_pointer_cast(_values.data()),
+                                               thrust::raw_pointer_cast(vec.data()),
+                                               sca,
+                                               add/this->col)
+                                );
+        }
+        // Sum of absolute differences in one pass, without a temporary vector
+        two_vec_diff = thrust::inner_product(ret.begin(), ret.end(), vec.begin(), (T)0, thrust::plus<T>(), saxpy_abs<T>());
 
         /*
         // Skip zero rows
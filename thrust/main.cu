@@ -5,7 +5,6 @@
 #include <limits>
 #include <fstream>
 #include <iostream>
-#include <time.h>  //For clock_gettime
 
 // Thrust
 #include <thrust/host_vector.h>
@@ -14,6 +13,11 @@
 #include <thrust/sort.h>
 #include <thrust/copy.h>
 
+// Host backends (THRUST_DEVICE_SYSTEM_OMP) use OpenMP threads
+#if THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_OMP
+#include <omp.h>
+#endif
+
 // Uncomment when building for production (disables assert)
 // #define NDEBUG
 #include <assert.h>
@@ -21,11 +25,26 @@
 #include "parser.h"
 #include "csrmatrix.h"
 #include "csv.h"
+#include "trace.h"
 
 using namespace std;
 #define uint unsigned int
 
-void run_program(CSR_Matrix<double> *P){
+// Name of thrust device system this program is built for
+const char *backend_name(){
+#if THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_OMP
+    return "omp";
+#elif THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_TBB
+    return "tbb";
+#elif THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_CPP
+    return "cpp";
+#else
+    return "cuda";
+#endif
+}
+
+// Returns passed time in seconds and number of iterations for logging.
+pair<double, int> run_program(CSR_Matrix<double> *P){
     // Set initial values
     int iterations=0;
     double alpha = 0.2;
@@ -33,28 +52,25 @@ void run_program(CSR_Matrix<double> *P){
     vector<double> r_t(P->get_size().second, 1);
     thrust::device_vector<double>d_x, d_x1(r_t.begin(), r_t.end());
 
-    // Time measure
-    struct timespec mt1, mt2;
-    long int tt;
-    
-    cout << "Matrix in size: " << P->get_size().first << " " << P->get_size().second <<endl;
-    clock_gettime (CLOCK_REALTIME, &mt1);
+    trace_log(LOG_INFO) << "Matrix in size: " << P->get_size().first << " " << P->get_size().second <<endl;
+    TraceScope solve_phase("solve");
     
     // Begin operation. Keep going until vector diff is below epsilon
     // P->ops function is parallelised, this loop only performs minor operations.
     do{
+        TraceScope iteration_phase("iteration");
         d_x = d_x1;
         P->ops(d_x1, d_x, alpha, 1-alpha);
         iterations++;
-        cout << "Current Diff: "<<P->two_vec_diff<< endl;
+        trace_counter("diff", P->two_vec_diff);
+        trace_log(LOG_PROGRESS) << "Current Diff: "<<P->two_vec_diff<< endl;
     } while(P->two_vec_diff > epsillon);
     thrust::copy(d_x.begin(), d_x.end(), r_t.begin());
 
     // Print passed time. Also, this value will be used on schedule_program function.
-    clock_gettime (CLOCK_REALTIME, &mt2);
-    tt=1000000000*(mt2.tv_sec - mt1.tv_sec)+(mt2.tv_nsec - mt1.tv_nsec);
-    cout << "Completed in "<< iterations << " iterations..."<<endl;
-    cout << "Time passed: " << tt/1000000 << "msecs" << endl;
+    double tim = solve_phase.stop();
+    trace_log(LOG_INFO) << "Completed in "<< iterations << " iterations..."<<endl;
+    trace_log(LOG_INFO) << "Time passed: " << tim*1000 << "msecs" << endl;
 
     vector<vector<string>>high;
     double maxi, last = numeric_limits<double>::max();
@@ -73,27 +89,58 @@ void run_program(CSR_Matrix<double> *P){
         cout << i+1 << ": " <<P->arr_dict[ind] << " : "<< maxi << endl;
         last = maxi;
         // Push elements in order.
-        high.push_back(vector<string>({to_string(high.size()+1), P->arr_dict[ind], to_string(maxi)}));
+        high.push_back(vector<string>({to_string(high.size()+1), P->arr_dict[ind], number_to_string(maxi)}));
     }
     // Write result.csv
     write_csv("result.csv", vector<string>({"No.", "Nodes", "Scores"}), high);
+    return {tim, iterations};
+}
+
+#if THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_OMP
+// Run with 1 to 8 threads and write timings to log_thrust.csv.
+// Columns follow log.csv of OpenMP program, so both engines can be compared.
+// Backend goes in the scheduling column, there is no chunk size.
+void bench_program(CSR_Matrix<double> *P){
+    vector<string> last_row({"1", string(backend_name()) + (P->nnz_balanced ? " balanced" : ""), "-", ""});
+    pair<double, int> retval;
+    for(int i=1; i<=8; i++){
+        cout << "Running program with "<< backend_name() << " : " << i << endl;
+        omp_set_num_threads(i);
+        retval = run_program(P);
+        last_row.push_back(to_string(retval.first));
+    }
+    last_row[3] = to_string(retval.second);
+    vector<string>col_names({"Test No.", "Scheduling Method", "Chunk Size", "No of Iterations", "1", "2", "3", "4", "5", "6", "7", "8"});
+    write_csv("log_thrust.csv", col_names, vector<vector<string>>({last_row}));
 }
+#endif
 
 // Autonomously run different testcases, and parse CSR Matrix
 int main(int argc, char** argv){
     ios::sync_with_stdio(false); // Comment if stdio has been used!!!
     CSR_Matrix<double> *P;
 
-    // Time measure
-    struct timespec mt1, mt2;
-    long int tt;
-    
-    clock_gettime (CLOCK_REALTIME, &mt1);
+    // Chrome trace and phase summary written at exit (trace=trace.json),
+    // console output level (verbosity=quiet|info|progress|debug)
+    TraceSession trace;
+    for(int i=1; i<argc; i++){
+        if(strncmp(argv[i], "trace=", 6)==0){
+            trace.filename = argv[i]+6;
+        }else if(strncmp(argv[i], "verbosity=", 10)==0 && !set_verbosity(argv[i]+10)){
+            cout << "Unknown verbosity: " << argv[i]+10 << endl;
+        }
+    }
+    TraceScope program_phase("program");
     
     // Initialize CSR matrix. Either parse from file,
     // or load from dumped csv file if requested. (load filename)
     if(argc>=3 && strcmp(argv[1], "load")==0){
         P = new CSR_Matrix<double>(string(argv[2]));
+        if(!P->loaded){
+            cout << "Cannot read matrix: " << argv[2] << endl;
+            delete P;
+            return 1;
+        }
     }
     else{
         P = parse("graph.txt");
@@ -102,18 +149,34 @@ int main(int argc, char** argv){
             P->write(argv[2]);
         }
     }
+    // Optional flags after load/save arguments:
+    // balanced (split work by nonzeros), bench (thread sweep, OMP backend only)
+    bool bench = false;
+    for(int i=1; i<argc; i++){
+        if(strcmp(argv[i], "balanced")==0){
+            P->nnz_balanced = true;
+        }else if(strcmp(argv[i], "bench")==0){
+            bench = true;
+        }
+    }
     // Transfer items to gpu device (Also erase ram content)
     P->transfer_device();
 
-    cout << "CSR Matrix Initialized" << endl;
+    cout << "CSR Matrix Initialized on " << backend_name() << " backend" << endl;
 
+#if THRUST_DEVICE_SYSTEM == THRUST_DEVICE_SYSTEM_OMP
+    if(bench){
+        bench_program(P);
+    }else{
+        run_program(P);
+    }
+#else
     // Run program
     run_program(P);
+#endif
 
     // Print runtime and exit.
-    clock_gettime (CLOCK_REALTIME, &mt2);
-    tt=1000000000*(mt2.tv_sec - mt1.tv_sec)+(mt2.tv_nsec - mt1.tv_nsec);
-    cout << "Program finished in: " << tt/1000000 << "msecs" << endl;
+    cout << "Program finished in: " << program_phase.elapsed()*1000 << "msecs" << endl;
 
     delete P;
     return 0;
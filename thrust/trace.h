@@ -0,0 +1,351 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <time.h>
+
+// Uncomment when building for production (disables assert)
+// #define NDEBUG
+#include <assert.h>
+
+using namespace std;
+typedef unsigned int uint;
+
+// Phase timing and logging. Phases are timed with TraceScope (monotonic clock)
+// and may nest. Every thread appends finished phases and counters to its own
+// buffer, so recording takes no lock. Buffers are read by the export functions,
+// which should run when traced threads are done: a Chrome trace json
+// (chrome://tracing, Perfetto) and a summary table per phase name.
+// Console output goes through trace_log with a verbosity level.
+
+enum TraceLevel{
+    LOG_QUIET = 0,    // Results and errors only
+    LOG_INFO = 1,     // Phases, times and results
+    LOG_PROGRESS = 2, // Per iteration lines (Current Diff)
+    LOG_DEBUG = 3
+};
+
+// Nanoseconds of the monotonic clock
+inline long long trace_clock(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+struct TraceEvent{
+    const char *name;
+    long long start, dur;
+    int depth;
+    // Counter events have a value instead of a duration
+    bool counter;
+    double value;
+};
+
+struct TraceBuffer{
+    uint tid = 0;
+    int depth = 0;
+    vector<TraceEvent> events;
+};
+
+class Tracer{
+    private:
+    mutex mtx;
+    vector<unique_ptr<TraceBuffer>> buffers;
+    long long origin = trace_clock();
+
+    Tracer(){}
+
+    public:
+    int verbosity = LOG_PROGRESS;
+    // Process id in the trace (MPI rank)
+    int pid = 0;
+
+    static Tracer &get(){
+        static Tracer tracer;
+        return tracer;
+    }
+
+    // Buffer of the calling thread, registered (under the lock) on first use only
+    TraceBuffer &local(){
+        thread_local TraceBuffer *buf = NULL;
+        if(buf==NULL){
+            lock_guard<mutex> lock(mtx);
+            buffers.push_back(unique_ptr<TraceBuffer>(new TraceBuffer()));
+            buf = buffers.back().get();
+            buf->tid = buffers.size()-1;
+        }
+        return *buf;
+    }
+
+    // Events of all threads as Chrome trace objects, comma separated
+    void chrome_events(ostream &out, bool &first){
+        lock_guard<mutex> lock(mtx);
+        out << fixed << setprecision(3);
+        for(const unique_ptr<TraceBuffer> &buf : buffers){
+            for(const TraceEvent &e : buf->events){
+                out << (first ? "\n" : ",\n") << "  {\"name\": \"" << e.name << "\", \"pid\": " << pid
+                    << ", \"tid\": " << buf->tid << ", \"ts\": " << (e.start-origin)/1e3;
+                if(e.counter){
+                    out << ", \"ph\": \"C\", \"args\": {\"value\": " << defaultfloat << e.value << fixed << "}}";
+                }else{
+                    out << ", \"ph\": \"X\", \"dur\": " << e.dur/1e3 << "}";
+                }
+                first = false;
+            }
+        }
+        out << defaultfloat;
+    }
+
+    bool write_chrome(const string &filename){
+        ofstream out(filename);
+        bool first = true;
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+        chrome_events(out, first);
+        out << "\n]}\n";
+        out.close();
+        return out.good();
+    }
+
+    // Per phase name: count, total, mean and max seconds over all threads, in order
+    // of first start. Indentation is the nesting depth.
+    struct Phase{
+        string name;
+        int depth = 0;
+        long long first = 0;
+        unsigned long long count = 0;
+        double total = 0, max = 0;
+    };
+
+    vector<Phase> phases(){
+        lock_guard<mutex> lock(mtx);
+        map<string, Phase> by_name;
+        for(const unique_ptr<TraceBuffer> &buf : buffers){
+            for(const TraceEvent &e : buf->events){
+                if(e.counter){
+                    continue;
+                }
+                Phase &p = by_name[e.name];
+                if(p.count==0 || e.start<p.first){
+                    p.first = e.start;
+                    p.depth = e.depth;
+                }
+                p.name = e.name;
+                p.count++;
+                p.total += e.dur/1e9;
+                p.max = std::max(p.max, e.dur/1e9);
+            }
+        }
+        vector<Phase> ret;
+        for(auto &it : by_name){
+            ret.push_back(it.second);
+        }
+        sort(ret.begin(), ret.end(), [](const Phase &a, const Phase &b){
+            return a.first<b.first;
+        });
+        return ret;
+    }
+
+    void print_summary(ostream &out){
+        out << left << setw(32) << "Phase" << right << setw(10) << "count" << setw(14) << "total (s)"
+            << setw(14) << "mean (s)" << setw(14) << "max (s)" << endl;
+        for(const Phase &p : phases()){
+            out << left << setw(32) << string(2*p.depth, ' ')+p.name << right << setw(10) << p.count
+                << setw(14) << p.total << setw(14) << p.total/p.count << setw(14) << p.max << endl;
+        }
+    }
+
+    // Drop everything recorded so far (buffers stay registered)
+    void clear(){
+        lock_guard<mutex> lock(mtx);
+        for(unique_ptr<TraceBuffer> &buf : buffers){
+            buf->events.clear();
+        }
+    }
+};
+
+// Times the enclosing block as phase "name". name must outlive the trace
+// (string literals).
+class TraceScope{
+    private:
+    TraceBuffer &buf;
+    const char *name;
+    long long start;
+    bool running = true;
+
+    public:
+    TraceScope(const char *name) : buf(Tracer::get().local()), name(name){
+        buf.depth++;
+        start = trace_clock();
+    }
+
+    ~TraceScope(){
+        stop();
+    }
+
+    // Ends the phase before the end of the block (phases of a thread must end
+    // in reverse order of start). Returns its seconds.
+    double stop(){
+        long long end = trace_clock();
+        if(!running){
+            return 0;
+        }
+        running = false;
+        buf.depth--;
+        buf.events.push_back({name, start, end-start, buf.depth, false, 0});
+        return (end-start)/1e9;
+    }
+
+    // Seconds since the phase started
+    double elapsed() const{
+        return (trace_clock()-start)/1e9;
+    }
+};
+
+// Writes the Chrome trace and prints the summary when it goes out of scope,
+// if a file was given (end of main, on every return path)
+class TraceSession{
+    public:
+    string filename;
+
+    ~TraceSession(){
+        if(!filename.empty()){
+            Tracer::get().print_summary(cout);
+            if(!Tracer::get().write_chrome(filename)){
+                cout << "Cannot write trace: " << filename << endl;
+            }
+        }
+    }
+};
+
+// Records a value (diff, iteration) over time in the trace
+inline void trace_counter(const char *name, double value){
+    TraceBuffer &buf = Tracer::get().local();
+    buf.events.push_back({name, trace_clock(), 0, buf.depth, true, value});
+}
+
+// cout if level is enabled, otherwise a stream that drops everything
+inline ostream &trace_log(int level){
+    static ostream null_stream(NULL);
+    return level<=Tracer::get().verbosity ? cout : null_stream;
+}
+
+// Verbosity by name (quiet, info, progress, debug) or number
+inline bool set_verbosity(const string &value){
+    const char *names[] = {"quiet", "info", "progress", "debug"};
+    for(int l=LOG_QUIET; l<=LOG_DEBUG; l++){
+        if(value==names[l] || value==to_string(l)){
+            Tracer::get().verbosity = l;
+            return true;
+        }
+    }
+    return false;
+}
+
+#ifdef MPI_VERSION
+// Every rank sends its summary to root, which prints min, mean and max of the
+// per rank totals of every phase. Phases are matched by name.
+inline void print_summary_mpi(MPI_Comm comm, int root=0){
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    ostringstream line;
+    line.precision(17);
+    for(const Tracer::Phase &p : Tracer::get().phases()){
+        line << p.name << "\t" << p.depth << "\t" << p.count << "\t" << p.total << "\n";
+    }
+    string mine = line.str();
+    int len = mine.size();
+    vector<int> lens(size), offsets(size+1, 0);
+    MPI_Gather(&len, 1, MPI_INT, lens.data(), 1, MPI_INT, root, comm);
+    for(int r=0; r<size; r++){
+        offsets[r+1] = offsets[r]+lens[r];
+    }
+    vector<char> all(rank==root ? max(offsets[size], 1) : 1);
+    MPI_Gatherv(mine.data(), len, MPI_CHAR, all.data(), lens.data(), offsets.data(), MPI_CHAR, root, comm);
+    if(rank!=root){
+        return;
+    }
+    // Name order of the first rank that has it
+    struct Agg{ int depth; unsigned long long count=0; int ranks=0; double min=0, max=0, sum=0; };
+    vector<string> order;
+    map<string, Agg> agg;
+    for(int r=0; r<size; r++){
+        istringstream in(string(all.data()+offsets[r], lens[r]));
+        string name;
+        int depth;
+        unsigned long long count;
+        double total;
+        while(getline(in, name, '\t') && in >> depth >> count >> total){
+            in.ignore(1);
+            auto it = agg.find(name);
+            if(it==agg.end()){
+                order.push_back(name);
+                it = agg.insert({name, Agg()}).first;
+                it->second.depth = depth;
+                it->second.min = total;
+            }
+            Agg &a = it->second;
+            a.count += count;
+            a.ranks++;
+            a.min = min(a.min, total);
+            a.max = max(a.max, total);
+            a.sum += total;
+        }
+    }
+    cout << left << setw(32) << "Phase" << right << setw(7) << "ranks" << setw(10) << "count" << setw(14) << "min (s)"
+         << setw(14) << "mean (s)" << setw(14) << "max (s)" << endl;
+    for(const string &name : order){
+        const Agg &a = agg[name];
+        cout << left << setw(32) << string(2*a.depth, ' ')+name << right << setw(7) << a.ranks << setw(10) << a.count
+             << setw(14) << a.min << setw(14) << a.sum/a.ranks << setw(14) << a.max << endl;
+    }
+}
+
+// One Chrome trace of all ranks, written by root (pid is the rank)
+inline bool write_chrome_mpi(const string &filename, MPI_Comm comm, int root=0){
+    int rank, size;
+    MPI_Comm_rank(comm, &rank);
+    MPI_Comm_size(comm, &size);
+    Tracer::get().pid = rank;
+    ostringstream out;
+    bool first = rank==root;
+    Tracer::get().chrome_events(out, first);
+    string mine = out.str();
+    int len = mine.size();
+    vector<int> lens(size), offsets(size+1, 0);
+    MPI_Gather(&len, 1, MPI_INT, lens.data(), 1, MPI_INT, root, comm);
+    for(int r=0; r<size; r++){
+        offsets[r+1] = offsets[r]+lens[r];
+    }
+    vector<char> all(rank==root ? max(offsets[size], 1) : 1);
+    MPI_Gatherv(mine.data(), len, MPI_CHAR, all.data(), lens.data(), offsets.data(), MPI_CHAR, root, comm);
+    if(rank!=root){
+        return true;
+    }
+    // Root's events come first, other ranks start with a comma
+    string events(all.data()+offsets[root], lens[root]);
+    for(int r=0; r<size; r++){
+        if(r!=root){
+            events.append(all.data()+offsets[r], lens[r]);
+        }
+    }
+    if(!events.empty() && events[0]==','){
+        events[0] = ' ';
+    }
+    ofstream file(filename);
+    file << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [" << events << "\n]}\n";
+    file.close();
+    return file.good();
+}
+#endif
+
+#endif